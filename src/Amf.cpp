@@ -36,6 +36,66 @@ namespace relay
             return "";
         }
 
+        // members are kept sorted by key, a repeated key replaces the earlier value
+        static void setMember(Node::Object& object, std::string& key, Node& node)
+        {
+            auto i = std::lower_bound(object.begin(), object.end(), key,
+                                      [](const Node::Member& member, const std::string& k) { return member.first < k; });
+
+            if (i != object.end() && i->first == key)
+            {
+                i->second = std::move(node);
+            }
+            else
+            {
+                object.insert(i, Node::Member(std::move(key), std::move(node)));
+            }
+        }
+
+        struct Traits
+        {
+            std::vector<std::string> members; // names of the sealed members
+            bool dynamic = false;
+        };
+
+        struct ReadReferences
+        {
+            std::vector<std::string> strings;
+            std::vector<Node> objects;
+            std::vector<Traits> traits;
+        };
+
+        struct WriteReferences
+        {
+            std::map<std::string, uint32_t> strings;
+            // keyed by the shared value and the type of the node, setType keeps the value, so
+            // for example an object and a dictionary made of it share one
+            std::map<std::pair<const void*, Node::Type>, uint32_t> objects;
+            uint32_t objectCount = 0;
+            bool traitsWritten = false;
+        };
+
+        // dates, arrays, objects, XML, byte arrays and vectors share the object reference table
+        static bool usesObjectTable(AMF3Marker marker)
+        {
+            switch (marker)
+            {
+                case AMF3Marker::XMLDocument:
+                case AMF3Marker::Date:
+                case AMF3Marker::Array:
+                case AMF3Marker::Object:
+                case AMF3Marker::XML:
+                case AMF3Marker::ByteArray:
+                case AMF3Marker::VectorInt:
+                case AMF3Marker::VectorDouble:
+                case AMF3Marker::VectorObject:
+                case AMF3Marker::Dictionary:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
         // decoding
         // AMF0 and AMF3
         static uint32_t readNumber(const std::vector<uint8_t>& buffer, uint32_t offset, double& result)
@@ -119,13 +179,13 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t readStringAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, std::string& result)
+        static uint32_t readStringAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, std::string& result, ReadReferences& references)
         {
             uint32_t originalOffset = offset;
 
-            uint32_t length;
+            uint32_t header;
 
-            uint32_t ret = decodeU29(buffer, offset, length);
+            uint32_t ret = decodeU29(buffer, offset, header);
 
             if (ret == 0)
             {
@@ -134,7 +194,21 @@ namespace relay
 
             offset += ret;
 
-            length >>= 1; // shift out the low bit (reference/literal marker)
+            if (!(header & 0x01)) // the low bit is not set for references
+            {
+                uint32_t index = header >> 1;
+
+                if (index >= references.strings.size())
+                {
+                    return 0;
+                }
+
+                result = references.strings[index];
+
+                return offset - originalOffset;
+            }
+
+            uint32_t length = header >> 1;
 
             if (buffer.size() - offset < length)
             {
@@ -143,12 +217,18 @@ namespace relay
 
             result.assign(reinterpret_cast<const char*>(buffer.data() + offset), length);
             offset += length;
-            
+
+            // empty strings are never sent as references
+            if (!result.empty())
+            {
+                references.strings.push_back(result);
+            }
+
             return offset - originalOffset;
         }
 
         // AMF0
-        static uint32_t readObject(const std::vector<uint8_t>& buffer, uint32_t offset, std::map<std::string, Node>& result)
+        static uint32_t readObject(const std::vector<uint8_t>& buffer, uint32_t offset, Node::Object& result)
         {
             uint32_t originalOffset = offset;
 
@@ -189,7 +269,7 @@ namespace relay
                     }
                     offset += ret;
 
-                    result[key] = node;
+                    setMember(result, key, node);
                 }
             }
 
@@ -197,56 +277,119 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t readObjectAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, std::map<std::string, Node>& result)
+        static uint32_t readObjectAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t header, Node::Object& result, ReadReferences& references)
         {
             uint32_t originalOffset = offset;
 
-            while (true)
+            uint32_t ret;
+            uint32_t traitsIndex;
+
+            if (!(header & 0x02)) // traits of an earlier object
             {
-                std::string key;
+                traitsIndex = header >> 2;
 
-                uint32_t ret = readString(buffer, offset, key);
+                if (traitsIndex >= references.traits.size())
+                {
+                    return 0;
+                }
+            }
+            else
+            {
+                if (header & 0x04)
+                {
+                    Log(Log::Level::ERR) << "Externalizable objects are not supported";
+                    return 0;
+                }
 
-                if (ret == 0)
+                Traits traits;
+                traits.dynamic = (header & 0x08) != 0;
+
+                // the class name is not kept, typed objects are read as anonymous objects
+                std::string className;
+
+                if ((ret = readStringAMF3(buffer, offset, className, references)) == 0)
                 {
                     return 0;
                 }
 
                 offset += ret;
 
-                if (buffer.size() - offset < 1)
+                for (uint32_t i = 0; i < (header >> 4); ++i)
                 {
-                    return 0;
+                    std::string member;
+
+                    if ((ret = readStringAMF3(buffer, offset, member, references)) == 0)
+                    {
+                        return 0;
+                    }
+
+                    offset += ret;
+
+                    traits.members.push_back(member);
                 }
 
-                AMF0Marker marker = *reinterpret_cast<const AMF0Marker*>(buffer.data() + offset);
+                traitsIndex = static_cast<uint32_t>(references.traits.size());
+                references.traits.push_back(traits);
+            }
 
-                if (marker == AMF0Marker::ObjectEnd)
+            // nested objects can add traits, so the traits are looked up by index
+            for (uint32_t i = 0; i < references.traits[traitsIndex].members.size(); ++i)
+            {
+                std::string key = references.traits[traitsIndex].members[i];
+
+                Node node;
+                ret = node.decodeAMF3(buffer, offset, references);
+
+                if (ret == 0)
                 {
-                    offset += 1;
-                    break;
+                    return 0;
                 }
-                else
+
+                offset += ret;
+
+                setMember(result, key, node);
+            }
+
+            if (references.traits[traitsIndex].dynamic)
+            {
+                std::string key;
+
+                while (true)
                 {
-                    Node node;
+                    ret = readStringAMF3(buffer, offset, key, references);
 
-                    ret = node.decode(amf::Version::AMF0, buffer, offset);
+                    if (ret == 0)
+                    {
+                        return 0;
+                    }
+
+                    offset += ret;
+
+                    // an empty key ends the dynamic members
+                    if (key.empty())
+                    {
+                        break;
+                    }
+
+                    Node node;
+                    ret = node.decodeAMF3(buffer, offset, references);
 
                     if (ret == 0)
                     {
                         return 0;
                     }
+
                     offset += ret;
-                    
-                    result[key] = node;
+
+                    setMember(result, key, node);
                 }
             }
-            
+
             return offset - originalOffset;
         }
 
         // AMF0
-        static uint32_t readECMAArray(const std::vector<uint8_t>& buffer, uint32_t offset, std::map<std::string, Node>& result)
+        static uint32_t readECMAArray(const std::vector<uint8_t>& buffer, uint32_t offset, Node::Object& result)
         {
             uint32_t originalOffset = offset;
 
@@ -301,7 +444,7 @@ namespace relay
 
                     offset += ret;
 
-                    result[key] = node;
+                    setMember(result, key, node);
 
                     ++currentCount;
                 }
@@ -316,30 +459,25 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t readDictionary(const std::vector<uint8_t>& buffer, uint32_t offset, std::map<std::string, Node>& result)
+        static uint32_t readDictionary(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t header, Node::Object& result, ReadReferences& references)
         {
             uint32_t originalOffset = offset;
 
-            uint32_t count;
-
-            uint32_t ret = decodeU29(buffer, offset, count);
+            uint32_t count = header >> 1;
 
-            if (ret == 0)
+            if (buffer.size() - offset < 1)
             {
                 return 0;
             }
 
-            offset += ret;
-
             // skip the weakly-referenced flag
             offset += 1;
 
-            std::string key;
-
-            while (true)
+            for (uint32_t i = 0; i < count; ++i)
             {
-                key.clear();
-                ret = readStringAMF3(buffer, offset, key);
+                // keys can be of any type, the ones that are not strings are kept as their string value
+                Node keyNode;
+                uint32_t ret = keyNode.decodeAMF3(buffer, offset, references);
 
                 if (ret == 0)
                 {
@@ -348,13 +486,10 @@ namespace relay
 
                 offset += ret;
 
-                if (buffer.size() - offset < 1)
-                {
-                    return 0;
-                }
+                std::string key = keyNode.isString() ? keyNode.asString() : keyNode.toString();
 
                 Node node;
-                ret = node.decode(amf::Version::AMF3, buffer, offset);
+                ret = node.decodeAMF3(buffer, offset, references);
 
                 if (ret == 0)
                 {
@@ -363,7 +498,7 @@ namespace relay
 
                 offset += ret;
 
-                result[key] = node;
+                setMember(result, key, node);
             }
 
             return offset - originalOffset;
@@ -404,25 +539,53 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t readStrictArrayAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, std::vector<Node>& result)
+        static uint32_t readArrayAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t header,
+                                      std::vector<Node>& dense, Node::Object& associative, ReadReferences& references)
         {
             uint32_t originalOffset = offset;
 
-            uint32_t count;
-
-            uint32_t ret = decodeIntBE(buffer, offset, 4, count);
+            uint32_t ret;
+            std::string key;
 
-            if (ret == 0)
+            // the associative part comes first and ends with an empty key
+            while (true)
             {
-                return 0;
+                ret = readStringAMF3(buffer, offset, key, references);
+
+                if (ret == 0)
+                {
+                    return 0;
+                }
+
+                offset += ret;
+
+                if (key.empty())
+                {
+                    break;
+                }
+
+                Node node;
+                ret = node.decodeAMF3(buffer, offset, references);
+
+                if (ret == 0)
+                {
+                    return 0;
+                }
+
+                offset += ret;
+
+                setMember(associative, key, node);
             }
 
-            offset += ret;
+            uint32_t count = header >> 1;
+
+            // every value takes at least a byte, don't trust the count for the reservation
+            dense.reserve(std::min(count, static_cast<uint32_t>(buffer.size() - offset)));
 
             for (uint32_t i = 0; i < count; ++i)
             {
                 Node node;
-                ret = node.decode(amf::Version::AMF0, buffer, offset);
+                ret = node.decodeAMF3(buffer, offset, references);
 
                 if (ret == 0)
                 {
@@ -431,9 +594,9 @@ namespace relay
 
                 offset += ret;
 
-                result.push_back(node);
+                dense.push_back(node);
             }
-            
+
             return offset - originalOffset;
         }
 
@@ -468,25 +631,33 @@ namespace relay
         {
             uint32_t originalOffset = offset;
 
-            uint32_t value;
-            uint32_t ret = decodeU29(buffer, offset, value);
+            uint32_t ret = decodeDouble(buffer, offset, ms);
 
-            if (ret == 0)
+            if (ret == 0) // date in milliseconds from 01/01/1970
             {
                 return 0;
             }
 
             offset += ret;
 
-            ret = decodeDouble(buffer, offset, ms);
+            return offset - originalOffset;
+        }
 
-            if (ret == 0) // date in milliseconds from 01/01/1970
+        // AMF3
+        static uint32_t readXMLAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t header, std::string& result)
+        {
+            uint32_t originalOffset = offset;
+
+            uint32_t length = header >> 1;
+
+            if (buffer.size() - offset < length)
             {
                 return 0;
             }
 
-            offset += ret;
-            
+            result.assign(reinterpret_cast<const char*>(buffer.data() + offset), length);
+            offset += length;
+
             return offset - originalOffset;
         }
 
@@ -574,22 +745,41 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t writeStringAMF3(std::vector<uint8_t>& buffer, const std::string& value)
+        static uint32_t writeStringAMF3(std::vector<uint8_t>& buffer, const std::string& value, WriteReferences& references)
         {
+            // empty strings are never sent as references
+            if (!value.empty())
+            {
+                auto i = references.strings.find(value);
+
+                if (i != references.strings.end())
+                {
+                    return encodeU29(buffer, i->second << 1);
+                }
+
+                uint32_t index = static_cast<uint32_t>(references.strings.size());
+                references.strings[value] = index;
+            }
+
             uint32_t ret = encodeU29(buffer, static_cast<uint32_t>(value.size()) << 1 | 1); // add the low bit (string literal marker)
 
+            if (ret == 0)
+            {
+                return 0;
+            }
+
             uint32_t size = ret;
 
             buffer.insert(buffer.end(),
                           reinterpret_cast<const uint8_t*>(value.data()),
                           reinterpret_cast<const uint8_t*>(value.data()) + value.length());
             size += static_cast<uint32_t>(value.length());
-            
+
             return size;
         }
 
         // AMF0
-        static uint32_t writeObject(std::vector<uint8_t>& buffer, const std::map<std::string, Node>& value)
+        static uint32_t writeObject(std::vector<uint8_t>& buffer, const Node::Object& value)
         {
             uint32_t size = 0;
             uint32_t ret;
@@ -631,14 +821,43 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t writeObjectAMF3(std::vector<uint8_t>& buffer, const std::map<std::string, Node>& value)
+        static uint32_t writeObjectAMF3(std::vector<uint8_t>& buffer, const Node::Object& value, WriteReferences& references)
         {
             uint32_t size = 0;
             uint32_t ret;
 
+            // all the objects are written as anonymous dynamic objects, so after the
+            // first one they refer to its traits (traits reference 0)
+            if (references.traitsWritten)
+            {
+                ret = encodeU29(buffer, 0x01);
+            }
+            else
+            {
+                ret = encodeU29(buffer, 0x0B); // inline dynamic traits without sealed members
+                references.traitsWritten = true;
+
+                size += ret;
+
+                ret = writeStringAMF3(buffer, "", references); // no class name
+            }
+
+            if (ret == 0)
+            {
+                return 0;
+            }
+
+            size += ret;
+
             for (const auto& i : value)
             {
-                ret = writeString(buffer, i.first);
+                // an empty key would end the object
+                if (i.first.empty())
+                {
+                    continue;
+                }
+
+                ret = writeStringAMF3(buffer, i.first, references);
 
                 if (ret == 0)
                 {
@@ -647,7 +866,7 @@ namespace relay
 
                 size += ret;
 
-                ret = i.second.encode(amf::Version::AMF0, buffer);
+                ret = i.second.encodeAMF3(buffer, references);
 
                 if (ret == 0)
                 {
@@ -657,23 +876,18 @@ namespace relay
                 size += ret;
             }
 
-            if ((ret = writeString(buffer, "")) == 0)
+            if ((ret = writeStringAMF3(buffer, "", references)) == 0)
             {
                 return 0;
             }
 
             size += ret;
 
-            AMF0Marker marker = AMF0Marker::ObjectEnd;
-            buffer.push_back(static_cast<uint8_t>(marker));
-            
-            size += 1;
-            
             return size;
         }
 
         // AMF0
-        static uint32_t writeECMAArray(std::vector<uint8_t>& buffer, const std::map<std::string, Node>& value)
+        static uint32_t writeECMAArray(std::vector<uint8_t>& buffer, const Node::Object& value)
         {
             uint32_t size = 0;
 
@@ -723,25 +937,24 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t writeDictionary(std::vector<uint8_t>& buffer, const std::map<std::string, Node>& value)
+        // ECMA arrays are arrays with only associative values in AMF3
+        static uint32_t writeECMAArrayAMF3(std::vector<uint8_t>& buffer, const Node::Object& value, WriteReferences& references)
         {
             uint32_t size = 0;
 
-            uint32_t ret = encodeU29(buffer, static_cast<uint32_t>(value.size()) << 1 | 1); // add the low bit (dictionary literal marker)
-
-            if (ret == 0)
-            {
-                return 0;
-            }
+            uint32_t ret = encodeU29(buffer, 0x01); // no dense values
 
             size += ret;
 
-            buffer.push_back(0x00); // not using weakly-referenced keys
-            size += 1;
-
             for (const auto& i : value)
             {
-                ret = writeStringAMF3(buffer, i.first);
+                // an empty key would end the associative values
+                if (i.first.empty())
+                {
+                    continue;
+                }
+
+                ret = writeStringAMF3(buffer, i.first, references);
 
                 if (ret == 0)
                 {
@@ -750,7 +963,7 @@ namespace relay
 
                 size += ret;
 
-                ret = i.second.encode(amf::Version::AMF3, buffer);
+                ret = i.second.encodeAMF3(buffer, references);
 
                 if (ret == 0)
                 {
@@ -759,7 +972,14 @@ namespace relay
 
                 size += ret;
             }
-            
+
+            if ((ret = writeStringAMF3(buffer, "", references)) == 0)
+            {
+                return 0;
+            }
+
+            size += ret;
+
             return size;
         }
 
@@ -793,11 +1013,11 @@ namespace relay
         }
 
         // AMF3
-        static uint32_t writeStrictArrayAMF3(std::vector<uint8_t>& buffer, const std::vector<Node>& value)
+        static uint32_t writeStrictArrayAMF3(std::vector<uint8_t>& buffer, const std::vector<Node>& value, WriteReferences& references)
         {
             uint32_t size = 0;
 
-            uint32_t ret = encodeIntBE(buffer, 4, value.size());
+            uint32_t ret = encodeU29(buffer, static_cast<uint32_t>(value.size()) << 1 | 1); // add the low bit (array literal marker)
 
             if (ret == 0)
             {
@@ -806,9 +1026,16 @@ namespace relay
 
             size += ret;
 
+            if ((ret = writeStringAMF3(buffer, "", references)) == 0) // no associative values
+            {
+                return 0;
+            }
+
+            size += ret;
+
             for (const auto& i : value)
             {
-                ret = i.encode(amf::Version::AMF0, buffer);
+                ret = i.encodeAMF3(buffer, references);
 
                 if (ret == 0)
                 {
@@ -817,7 +1044,7 @@ namespace relay
 
                 size += ret;
             }
-            
+
             return size;
         }
 
@@ -852,22 +1079,39 @@ namespace relay
         {
             uint32_t size = 0;
 
-            uint32_t ret = encodeU29(buffer, 1);
+            uint32_t ret = encodeU29(buffer, 1); // date literal marker
+
+            size += ret;
+
+            ret = encodeDouble(buffer, ms);
 
             if (ret == 0) // date in milliseconds from 01/01/1970
             {
                 return 0;
             }
 
-            ret = encodeDouble(buffer, ms);
+            size += ret;
 
-            if (ret == 0) // date in milliseconds from 01/01/1970
+            return size;
+        }
+
+        // AMF3
+        static uint32_t writeXMLAMF3(std::vector<uint8_t>& buffer, const std::string& value)
+        {
+            uint32_t ret = encodeU29(buffer, static_cast<uint32_t>(value.size()) << 1 | 1); // add the low bit (XML literal marker)
+
+            if (ret == 0)
             {
                 return 0;
             }
 
-            size += ret;
-            
+            uint32_t size = ret;
+
+            buffer.insert(buffer.end(),
+                          reinterpret_cast<const uint8_t*>(value.data()),
+                          reinterpret_cast<const uint8_t*>(value.data()) + value.length());
+            size += static_cast<uint32_t>(value.length());
+
             return size;
         }
 
@@ -924,6 +1168,8 @@ namespace relay
         {
             uint32_t originalOffset = offset;
 
+            payload.reset();
+
             if (version == Version::AMF0)
             {
                 if (buffer.size() - offset < 1)
@@ -959,7 +1205,7 @@ namespace relay
                     case AMF0Marker::String:
                     {
                         type = Type::String;
-                        if ((ret = readString(buffer, offset, stringValue)) == 0)
+                        if ((ret = readString(buffer, offset, getMutableString())) == 0)
                         {
                             return 0;
                         }
@@ -968,7 +1214,7 @@ namespace relay
                     case AMF0Marker::Object:
                     {
                         type = Type::Object;
-                        if ((ret = readObject(buffer, offset, mapValue)) == 0)
+                        if ((ret = readObject(buffer, offset, getMutableObject())) == 0)
                         {
                             return 0;
                         }
@@ -979,7 +1225,7 @@ namespace relay
                     case AMF0Marker::ECMAArray:
                     {
                         type = Type::Dictionary;
-                        if ((ret = readECMAArray(buffer, offset, mapValue)) == 0)
+                        if ((ret = readECMAArray(buffer, offset, getMutableObject())) == 0)
                         {
                             return 0;
                         }
@@ -989,7 +1235,7 @@ namespace relay
                     case AMF0Marker::StrictArray:
                     {
                         type = Type::Array;
-                        if ((ret = readStrictArray(buffer, offset, vectorValue)) == 0)
+                        if ((ret = readStrictArray(buffer, offset, getMutableVector())) == 0)
                         {
                             return 0;
                         }
@@ -1007,7 +1253,7 @@ namespace relay
                     case AMF0Marker::LongString:
                     {
                         type = Type::String;
-                        if ((ret = readLongString(buffer, offset, stringValue)) == 0)
+                        if ((ret = readLongString(buffer, offset, getMutableString())) == 0)
                         {
                             return 0;
                         }
@@ -1016,7 +1262,7 @@ namespace relay
                     case AMF0Marker::XMLDocument:
                     {
                         type = Type::XMLDocument;
-                        if ((ret = readLongString(buffer, offset, stringValue)) == 0)
+                        if ((ret = readLongString(buffer, offset, getMutableString())) == 0)
                         {
                             return 0;
                         }
@@ -1033,8 +1279,12 @@ namespace relay
                     }
                     case AMF0Marker::SwitchToAMF3:
                     {
-                        ret += decode(Version::AMF3, buffer, offset);
-                        break;
+                        // every switch starts with empty reference tables
+                        if ((ret = decode(Version::AMF3, buffer, offset)) == 0)
+                        {
+                            return 0;
+                        }
+                        break;
                     }
                     default: return 0;
                 }
@@ -1043,99 +1293,12 @@ namespace relay
             }
             else if (version == Version::AMF3)
             {
-                AMF3Marker marker = *reinterpret_cast<const AMF3Marker*>(buffer.data() + offset);
-                offset += 1;
+                ReadReferences references;
+                uint32_t ret = decodeAMF3(buffer, offset, references);
 
-                uint32_t ret = 0;
-
-                switch (marker)
+                if (ret == 0)
                 {
-                    case AMF3Marker::Undefined:
-                        type = Type::Undefined;
-                        break;
-                    case AMF3Marker::Null:
-                        type = Type::Null;
-                        break;
-                    case AMF3Marker::False:
-                        type = Type::Boolean;
-                        boolValue = false;
-                        break;
-                    case AMF3Marker::True:
-                        type = Type::Boolean;
-                        boolValue = true;
-                        break;
-                    case AMF3Marker::Integer:
-                        type = Type::Integer;
-                        if ((ret = readInteger(buffer, offset, intValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::Double:
-                        type = Type::Double;
-                        if ((ret = readNumber(buffer, offset, doubleValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::String:
-                        type = Type::String;
-                        if ((ret = readStringAMF3(buffer, offset, stringValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::XMLDocument:
-                        type = Type::XMLDocument;
-                        if ((ret = readStringAMF3(buffer, offset, stringValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::Date:
-                        type = Type::Date;
-                        if ((ret = readDateAMF3(buffer, offset, doubleValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        timezone = 0;
-                        break;
-                    case AMF3Marker::Array:
-                        type = Type::Array;
-                        if ((ret = readStrictArrayAMF3(buffer, offset, vectorValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::Object:
-                        type = Type::Object;
-                        if ((ret = readObjectAMF3(buffer, offset, mapValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::XML:
-                        type = Type::XMLDocument;
-                        if ((ret = readStringAMF3(buffer, offset, stringValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
-                    case AMF3Marker::ByteArray:
-                        break;
-                    case AMF3Marker::VectorInt:
-                        break;
-                    case AMF3Marker::VectorDouble:
-                        break;
-                    case AMF3Marker::VectorObject:
-                        break;
-                    case AMF3Marker::Dictionary:
-                        type = Type::Dictionary;
-                        if ((ret = readDictionary(buffer, offset, mapValue)) == 0)
-                        {
-                            return 0;
-                        }
-                        break;
+                    return 0;
                 }
 
                 offset += ret;
@@ -1161,7 +1324,7 @@ namespace relay
                     case Type::Boolean: marker = AMF0Marker::Boolean; break;
                     case Type::String:
                     {
-                        marker = ((stringValue.length() <= std::numeric_limits<uint16_t>::max()) ? AMF0Marker::String : AMF0Marker::LongString);
+                        marker = ((getString().length() <= std::numeric_limits<uint16_t>::max()) ? AMF0Marker::String : AMF0Marker::LongString);
                         break;
                     }
                     case Type::Object: marker = AMF0Marker::Object; break;
@@ -1201,30 +1364,30 @@ namespace relay
                     }
                     case Type::String:
                     {
-                        if (stringValue.length() <= std::numeric_limits<uint16_t>::max())
+                        if (getString().length() <= std::numeric_limits<uint16_t>::max())
                         {
-                            ret = writeString(buffer, stringValue); break;
+                            ret = writeString(buffer, getString()); break;
                         }
                         else
                         {
-                            ret = writeLongString(buffer, stringValue); break;
+                            ret = writeLongString(buffer, getString()); break;
                         }
                         break;
                     }
                     case Type::Object:
                     {
-                        ret = writeObject(buffer, mapValue);
+                        ret = writeObject(buffer, getObject());
                         break;
                     }
                     case Type::Undefined: break;
                     case Type::Dictionary:
                     {
-                        ret = writeECMAArray(buffer, mapValue);
+                        ret = writeECMAArray(buffer, getObject());
                         break;
                     }
                     case Type::Array:
                     {
-                        ret = writeStrictArray(buffer, vectorValue);
+                        ret = writeStrictArray(buffer, getVector());
                         break;
                     }
                     case Type::Date:
@@ -1234,7 +1397,7 @@ namespace relay
                     }
                     case Type::XMLDocument:
                     {
-                        ret = writeXMLDocument(buffer, stringValue);
+                        ret = writeXMLDocument(buffer, getString());
                         break;
                     }
                     case Type::TypedObject:
@@ -1249,95 +1412,366 @@ namespace relay
             }
             else if (version == Version::AMF3)
             {
-                AMF3Marker marker;
+                WriteReferences references;
+                size = encodeAMF3(buffer, references);
+            }
 
-                switch (type)
+            return size;
+        }
+
+        uint32_t Node::decodeAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, ReadReferences& references)
+        {
+            uint32_t originalOffset = offset;
+
+            payload.reset();
+
+            if (offset >= buffer.size())
+            {
+                return 0;
+            }
+
+            AMF3Marker marker = *reinterpret_cast<const AMF3Marker*>(buffer.data() + offset);
+            offset += 1;
+
+            uint32_t ret = 0;
+            uint32_t header = 0;
+            uint32_t objectIndex = 0;
+            bool objectTable = usesObjectTable(marker);
+
+            if (objectTable)
+            {
+                if ((ret = decodeU29(buffer, offset, header)) == 0)
                 {
-                    case Type::Unknown: return 0; // should not happen
-                    case Type::Null: marker = AMF3Marker::Null; break;
-                    case Type::Integer: marker = AMF3Marker::Integer; break;
-                    case Type::Double: marker = AMF3Marker::Double; break;
-                    case Type::Boolean: marker = (boolValue) ? AMF3Marker::True : AMF3Marker::False; break;
-                    case Type::String: marker = AMF3Marker::String; break;
-                    case Type::Object: marker = AMF3Marker::Object; break;
-                    case Type::Undefined: marker = AMF3Marker::Undefined; break;
-                    case Type::Dictionary: marker = AMF3Marker::Dictionary; break;
-                    case Type::Array: marker = AMF3Marker::Array; break;
-                    case Type::Date: marker = AMF3Marker::Date; break;
-                    case Type::XMLDocument: marker = AMF3Marker::XMLDocument; break;
-                    case Type::TypedObject: return 0; // typed objects are not supported
-                    case Type::SwitchToAMF3: return 0; // switch to AMF3 not supported
-                    default: return 0;
+                    return 0;
                 }
 
-                buffer.push_back(static_cast<uint8_t>(marker));
-                size += 1;
-
-                uint32_t ret = 0;
+                offset += ret;
 
-                switch (type)
+                if (!(header & 0x01)) // the low bit is not set for references
                 {
-                    case Type::Unknown: break; // should not happen
-                    case Type::Null: break;
-                    case Type::Integer:
+                    uint32_t index = header >> 1;
+
+                    if (index >= references.objects.size())
                     {
-                        ret = writeInteger(buffer, intValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Double:
+
+                    *this = references.objects[index];
+
+                    return offset - originalOffset;
+                }
+
+                // the index is taken before the members are read, a reference to
+                // an object that is still being read (a cycle) is read as null
+                objectIndex = static_cast<uint32_t>(references.objects.size());
+                references.objects.push_back(Node(Type::Null));
+
+                ret = 0;
+            }
+
+            switch (marker)
+            {
+                case AMF3Marker::Undefined:
+                    type = Type::Undefined;
+                    break;
+                case AMF3Marker::Null:
+                    type = Type::Null;
+                    break;
+                case AMF3Marker::False:
+                    type = Type::Boolean;
+                    boolValue = false;
+                    break;
+                case AMF3Marker::True:
+                    type = Type::Boolean;
+                    boolValue = true;
+                    break;
+                case AMF3Marker::Integer:
+                    type = Type::Integer;
+                    if ((ret = readInteger(buffer, offset, intValue)) == 0)
                     {
-                        ret = writeNumber(buffer, doubleValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Boolean: break;
-                    case Type::String:
+                    break;
+                case AMF3Marker::Double:
+                    type = Type::Double;
+                    if ((ret = readNumber(buffer, offset, doubleValue)) == 0)
                     {
-                        ret = writeStringAMF3(buffer, stringValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Object:
+                    break;
+                case AMF3Marker::String:
+                    type = Type::String;
+                    if ((ret = readStringAMF3(buffer, offset, getMutableString(), references)) == 0)
                     {
-                        ret = writeObjectAMF3(buffer, mapValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Undefined: break;
-                    case Type::Dictionary:
+                    break;
+                case AMF3Marker::XMLDocument:
+                case AMF3Marker::XML:
+                    type = Type::XMLDocument;
+                    if ((ret = readXMLAMF3(buffer, offset, header, getMutableString())) == 0)
                     {
-                        ret = writeDictionary(buffer, mapValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Array:
+                    break;
+                case AMF3Marker::Date:
+                    type = Type::Date;
+                    timezone = 0;
+                    if ((ret = readDateAMF3(buffer, offset, doubleValue)) == 0)
                     {
-                        ret = writeStrictArrayAMF3(buffer, vectorValue);
-                        break;
+                        return 0;
                     }
-                    case Type::Date:
+                    break;
+                case AMF3Marker::Array:
+                {
+                    std::vector<Node> dense;
+                    Object associative;
+
+                    if ((ret = readArrayAMF3(buffer, offset, header, dense, associative, references)) == 0)
                     {
-                        ret = writeDateAMF3(buffer, doubleValue);
-                        break;
+                        return 0;
                     }
-                    case Type::XMLDocument:
+
+                    if (associative.empty())
                     {
-                        ret = writeStringAMF3(buffer, stringValue);
-                        break;
+                        type = Type::Array;
+                        payload = std::make_shared<std::vector<Node>>(std::move(dense));
                     }
-                    case Type::TypedObject:
+                    else
                     {
-                        break;
+                        // mixed arrays are kept as ECMA arrays with the dense values under their index
+                        for (size_t i = 0; i < dense.size(); ++i)
+                        {
+                            std::string key = std::to_string(i);
+                            setMember(associative, key, dense[i]);
+                        }
+
+                        type = Type::Dictionary;
+                        payload = std::make_shared<Object>(std::move(associative));
                     }
-                    case Type::SwitchToAMF3: break;
+                    break;
                 }
+                case AMF3Marker::Object:
+                    type = Type::Object;
+                    if ((ret = readObjectAMF3(buffer, offset, header, getMutableObject(), references)) == 0)
+                    {
+                        return 0;
+                    }
+                    break;
+                case AMF3Marker::Dictionary:
+                    type = Type::Dictionary;
+                    if ((ret = readDictionary(buffer, offset, header, getMutableObject(), references)) == 0)
+                    {
+                        return 0;
+                    }
+                    break;
+                case AMF3Marker::ByteArray:
+                case AMF3Marker::VectorInt:
+                case AMF3Marker::VectorDouble:
+                case AMF3Marker::VectorObject:
+                    Log(Log::Level::ERR) << "Byte arrays and vectors are not supported";
+                    return 0;
+                default: return 0;
+            }
 
-                size += ret;
+            offset += ret;
+
+            if (objectTable)
+            {
+                references.objects[objectIndex] = *this;
+            }
 
-                Log(Log::Level::ERR) << "AMF3 not supported";
+            return offset - originalOffset;
+        }
+
+        uint32_t Node::encodeAMF3(std::vector<uint8_t>& buffer, WriteReferences& references) const
+        {
+            uint32_t size = 0;
+
+            AMF3Marker marker;
+
+            switch (type)
+            {
+                case Type::Unknown: return 0; // should not happen
+                case Type::Null: marker = AMF3Marker::Null; break;
+                case Type::Integer:
+                {
+                    // only 29-bit integers fit in the integer type
+                    marker = (intValue >= -0x10000000 && intValue <= 0x0FFFFFFF) ? AMF3Marker::Integer : AMF3Marker::Double;
+                    break;
+                }
+                case Type::Double: marker = AMF3Marker::Double; break;
+                case Type::Boolean: marker = (boolValue) ? AMF3Marker::True : AMF3Marker::False; break;
+                case Type::String: marker = AMF3Marker::String; break;
+                case Type::Object: marker = AMF3Marker::Object; break;
+                case Type::Undefined: marker = AMF3Marker::Undefined; break;
+                case Type::Dictionary: marker = AMF3Marker::Array; break;
+                case Type::Array: marker = AMF3Marker::Array; break;
+                case Type::Date: marker = AMF3Marker::Date; break;
+                case Type::XMLDocument: marker = AMF3Marker::XMLDocument; break;
+                case Type::TypedObject: return 0; // typed objects are not supported
+                case Type::SwitchToAMF3: return 0; // switch to AMF3 not supported
+                default: return 0;
+            }
+
+            buffer.push_back(static_cast<uint8_t>(marker));
+            size += 1;
+
+            uint32_t ret = 0;
+
+            // a value that was already written (a copy of the node shares it) is sent as a reference
+            if (usesObjectTable(marker))
+            {
+                if (payload)
+                {
+                    std::pair<const void*, Type> key(payload.get(), type);
+                    auto i = references.objects.find(key);
+
+                    if (i != references.objects.end())
+                    {
+                        if ((ret = encodeU29(buffer, i->second << 1)) == 0)
+                        {
+                            return 0;
+                        }
+
+                        return size + ret;
+                    }
+
+                    references.objects[key] = references.objectCount;
+                }
+
+                ++references.objectCount;
+            }
+
+            switch (type)
+            {
+                case Type::Unknown: break; // should not happen
+                case Type::Null: break;
+                case Type::Integer:
+                {
+                    if (marker == AMF3Marker::Integer)
+                    {
+                        ret = writeInteger(buffer, intValue);
+                    }
+                    else
+                    {
+                        ret = writeNumber(buffer, static_cast<double>(intValue));
+                    }
+                    break;
+                }
+                case Type::Double:
+                {
+                    ret = writeNumber(buffer, doubleValue);
+                    break;
+                }
+                case Type::Boolean: break;
+                case Type::String:
+                {
+                    ret = writeStringAMF3(buffer, getString(), references);
+                    break;
+                }
+                case Type::Object:
+                {
+                    ret = writeObjectAMF3(buffer, getObject(), references);
+                    break;
+                }
+                case Type::Undefined: break;
+                case Type::Dictionary:
+                {
+                    ret = writeECMAArrayAMF3(buffer, getObject(), references);
+                    break;
+                }
+                case Type::Array:
+                {
+                    ret = writeStrictArrayAMF3(buffer, getVector(), references);
+                    break;
+                }
+                case Type::Date:
+                {
+                    ret = writeDateAMF3(buffer, doubleValue);
+                    break;
+                }
+                case Type::XMLDocument:
+                {
+                    ret = writeXMLAMF3(buffer, getString());
+                    break;
+                }
+                case Type::TypedObject: break;
+                case Type::SwitchToAMF3: break;
+            }
+
+            // the types that have a value fail with a zero size
+            if (ret == 0 &&
+                type != Type::Null &&
+                type != Type::Undefined &&
+                type != Type::Boolean)
+            {
                 return 0;
             }
 
+            size += ret;
+
             return size;
         }
 
-        void Node::dump(Log& log, const std::string& indent)
+        std::shared_ptr<Node::Object> Node::makeObject(const Object& value)
+        {
+            std::shared_ptr<Object> result = std::make_shared<Object>();
+            result->reserve(value.size());
+
+            for (const Member& member : value)
+            {
+                std::string key = member.first;
+                Node node = member.second;
+                setMember(*result, key, node);
+            }
+
+            return result;
+        }
+
+        const std::string& Node::getString() const
+        {
+            static const std::string empty;
+            return payload ? *static_cast<const std::string*>(payload.get()) : empty;
+        }
+
+        const std::vector<Node>& Node::getVector() const
+        {
+            static const std::vector<Node> empty;
+            return payload ? *static_cast<const std::vector<Node>*>(payload.get()) : empty;
+        }
+
+        const Node::Object& Node::getObject() const
+        {
+            static const Object empty;
+            return payload ? *static_cast<const Object*>(payload.get()) : empty;
+        }
+
+        std::string& Node::getMutableString()
+        {
+            if (!payload) payload = std::make_shared<std::string>();
+            else if (payload.use_count() > 1) payload = std::make_shared<std::string>(getString());
+
+            return *static_cast<std::string*>(payload.get());
+        }
+
+        std::vector<Node>& Node::getMutableVector()
+        {
+            if (!payload) payload = std::make_shared<std::vector<Node>>();
+            else if (payload.use_count() > 1) payload = std::make_shared<std::vector<Node>>(getVector());
+
+            return *static_cast<std::vector<Node>*>(payload.get());
+        }
+
+        Node::Object& Node::getMutableObject()
+        {
+            if (!payload) payload = std::make_shared<Object>();
+            else if (payload.use_count() > 1) payload = std::make_shared<Object>(getObject());
+
+            return *static_cast<Object*>(payload.get());
+        }
+
+        void Node::dump(Log& log, const std::string& indent) const
         {
             log << "Type: " << typeToString(type) << "(" << static_cast<uint32_t>(type) << ")";
 
@@ -1349,6 +1783,8 @@ namespace relay
 
                 if (type == Type::Array)
                 {
+                    const std::vector<Node>& vectorValue = getVector();
+
                     for (size_t index = 0; index < vectorValue.size(); index++)
                     {
                         log << "\n" << indent + INDENT << index << ": ";
@@ -1357,7 +1793,7 @@ namespace relay
                 }
                 else
                 {
-                    for (auto i : mapValue)
+                    for (const auto& i : getObject())
                     {
                         log << "\n" << indent + INDENT << i.first << ": ";
                         i.second.dump(log, indent + INDENT);
@@ -1378,9 +1814,9 @@ namespace relay
                     case Type::Integer: log << intValue; break;
                     case Type::Double: log << doubleValue; break;
                     case Type::Boolean: log << (boolValue ? "true" : "false"); break;
-                    case Type::String: log << stringValue; break;
+                    case Type::String: log << getString(); break;
                     case Type::Date: log << "ms=" <<  doubleValue << "timezone=" <<  timezone; break;
-                    case Type::XMLDocument: log << stringValue; break;
+                    case Type::XMLDocument: log << getString(); break;
                     default:break;
                 }
             }
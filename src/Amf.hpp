@@ -4,11 +4,15 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <limits>
-#include <vector>
 #include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 #include "Log.hpp"
 
 namespace relay
@@ -60,6 +64,14 @@ namespace relay
             Dictionary = 0x11
         };
 
+        // AMF3 reference tables of one value, strings, objects and traits that
+        // were already read or written are sent as an index to these tables
+        struct ReadReferences;
+        struct WriteReferences;
+
+        // values of objects and dictionaries are kept sorted by key in a flat vector,
+        // strings, arrays and objects are shared between copies of a node and copied
+        // only when a shared value is modified (copy-on-write)
         class Node
         {
         public:
@@ -81,14 +93,18 @@ namespace relay
                 SwitchToAMF3
             };
 
+            typedef std::pair<std::string, Node> Member;
+            typedef std::vector<Member> Object;
+
             Node() {}
             Node(Type aType): type(aType) {}
             Node(int32_t value): type(Type::Integer), intValue(value) {}
             Node(double value): type(Type::Double), doubleValue(value) {}
             Node(bool value): type(Type::Boolean), boolValue(value) {}
-            Node(const std::vector<Node>& value): type(Type::Array), vectorValue(value) {}
-            Node(const std::map<std::string, Node>& value): type(Type::Object), mapValue(value) {}
-            Node(const std::string& value): type(Type::String), stringValue(value) {}
+            Node(const std::vector<Node>& value): type(Type::Array), payload(std::make_shared<std::vector<Node>>(value)) {}
+            Node(const Object& value): type(Type::Object), payload(makeObject(value)) {}
+            Node(const std::map<std::string, Node>& value): type(Type::Object), payload(std::make_shared<Object>(value.begin(), value.end())) {}
+            Node(const std::string& value): type(Type::String), payload(std::make_shared<std::string>(value)) {}
 
             Node(double ms, uint32_t aTimezone): type(Type::Date), doubleValue(ms), timezone(aTimezone) {}
 
@@ -105,6 +121,7 @@ namespace relay
             Node& operator=(Type newType)
             {
                 type = newType;
+                payload.reset();
 
                 switch (type)
                 {
@@ -113,17 +130,13 @@ namespace relay
                     case Type::Integer: intValue = 0; break;
                     case Type::Double: doubleValue = 0.0; break;
                     case Type::Boolean: boolValue = false; break;
-                    case Type::String:
-                    case Type::XMLDocument:
-                        stringValue.clear();
-                        break;
-                    case Type::Object:
-                    case Type::Dictionary:
-                        mapValue.clear();
-                        break;
+                    case Type::String: break;
+                    case Type::Object: break;
                     case Type::Undefined: break;
-                    case Type::Array: vectorValue.clear(); break;
+                    case Type::Dictionary: break;
+                    case Type::Array: break;
                     case Type::Date: doubleValue = 0.0; timezone = 0; break;
+                    case Type::XMLDocument: break;
                     case Type::TypedObject: break;
                     case Type::SwitchToAMF3: break;
                 }
@@ -133,21 +146,21 @@ namespace relay
 
             Node& operator=(int32_t value)
             {
-                type = Type::Integer;
+                setType(Type::Integer);
                 intValue = value;
                 return *this;
             }
 
             Node& operator=(double value)
             {
-                type = Type::Double;
+                setType(Type::Double);
                 doubleValue = value;
                 return *this;
             }
 
             Node& operator=(bool value)
             {
-                type = Type::Boolean;
+                setType(Type::Boolean);
                 boolValue = value;
                 return *this;
             }
@@ -155,29 +168,41 @@ namespace relay
             Node& operator=(const std::string& value)
             {
                 type = Type::String;
-                stringValue = value;
+                payload = std::make_shared<std::string>(value);
                 return *this;
             }
 
             Node& operator=(const std::vector<Node>& value)
             {
                 type = Type::Array;
-                vectorValue = value;
+                payload = std::make_shared<std::vector<Node>>(value);
                 return *this;
             }
 
-            Node& operator=(const std::map<std::string, Node>& value)
+            Node& operator=(const Object& value)
             {
                 type = Type::Object;
-                mapValue = value;
+                payload = makeObject(value);
                 return *this;
             }
 
             Type getType() const { return type; }
 
+            // changes the type, the value is kept if the new type holds the same kind of
+            // value (object and dictionary, string and XML document)
+            void setType(Type newType)
+            {
+                if (getKind(newType) != getKind(type)) payload.reset();
+                type = newType;
+            }
+
             uint32_t decode(Version version, const std::vector<uint8_t>& buffer, uint32_t offset = 0);
             uint32_t encode(Version version, std::vector<uint8_t>& buffer) const;
 
+            // AMF3 value inside another one, sharing its reference tables
+            uint32_t decodeAMF3(const std::vector<uint8_t>& buffer, uint32_t offset, ReadReferences& references);
+            uint32_t encodeAMF3(std::vector<uint8_t>& buffer, WriteReferences& references) const;
+
             double asDouble() const
             {
                 assert(type == Type::Integer || type == Type::Double);
@@ -234,7 +259,7 @@ namespace relay
             {
                 assert(type == Type::String);
 
-                return stringValue;
+                return getString();
             }
 
             bool isNull() const
@@ -262,14 +287,20 @@ namespace relay
             {
                 assert(type == Type::Array);
 
-                return vectorValue;
+                return getVector();
             }
-            
-            const std::map<std::string, Node>& asMap() const
+
+            const Object& asObject() const
             {
                 assert(type == Type::Object || type == Type::Dictionary);
 
-                return mapValue;
+                return getObject();
+            }
+
+            // whether both nodes share the same string, array or object
+            bool isSharedWith(const Node& other) const
+            {
+                return payload && payload == other.payload;
             }
 
             std::string toString() const
@@ -281,13 +312,13 @@ namespace relay
                     case Type::Integer: return std::to_string(intValue);
                     case Type::Double: return std::to_string(doubleValue);
                     case Type::Boolean: return std::to_string(boolValue);
-                    case Type::String: return stringValue;
+                    case Type::String: return getString();
                     case Type::Object: return "object";
                     case Type::Undefined: return "undefined";
                     case Type::Dictionary: return "dictionary";
                     case Type::Array: return "array";
                     case Type::Date: return std::to_string(doubleValue) + " +" + std::to_string(timezone);
-                    case Type::XMLDocument: return stringValue;
+                    case Type::XMLDocument: return getString();
                     case Type::TypedObject: return "typed object";
                     case Type::SwitchToAMF3: return "switch to AMF3";
                 }
@@ -313,13 +344,15 @@ namespace relay
             {
                 assert(type == Type::Array);
 
-                return static_cast<uint32_t>(vectorValue.size());
+                return static_cast<uint32_t>(getVector().size());
             }
 
             Node operator[](size_t key) const
             {
                 assert(type == Type::Array);
-                
+
+                const std::vector<Node>& vectorValue = getVector();
+
                 if (key >= vectorValue.size())
                 {
                     return Node();
@@ -332,17 +365,18 @@ namespace relay
 
             Node& operator[](size_t key)
             {
-                type = Type::Array;
-                return vectorValue[key];
+                setType(Type::Array);
+                return getMutableVector()[key];
             }
 
             Node operator[](const std::string& key) const
             {
                 assert(type == Type::Object || type == Type::Dictionary);
 
-                auto i = mapValue.find(key);
+                const Object& objectValue = getObject();
+                auto i = findMember(objectValue, key);
 
-                if (i == mapValue.end())
+                if (i == objectValue.end() || i->first != key)
                 {
                     return Node();
                 }
@@ -357,28 +391,88 @@ namespace relay
                 if (type != Type::Object &&
                     type != Type::Dictionary)
                 {
-                    type = Type::Object;
+                    setType(Type::Object);
+                }
+
+                Object& objectValue = getMutableObject();
+                auto i = findMember(objectValue, key);
+
+                if (i == objectValue.end() || i->first != key)
+                {
+                    i = objectValue.insert(i, Member(key, Node()));
                 }
-                return mapValue[key];
+
+                return i->second;
             }
 
             bool hasElement(const std::string& key) const
             {
                 assert(type == Type::Object || type == Type::Dictionary);
 
-                return mapValue.find(key) != mapValue.end();
+                const Object& objectValue = getObject();
+                auto i = findMember(objectValue, key);
+
+                return i != objectValue.end() && i->first == key;
             }
-            
+
             void append(const Node& node)
             {
                 assert(type == Type::Array);
 
-                vectorValue.push_back(node);
+                getMutableVector().push_back(node);
             }
 
-            void dump(Log& log, const std::string& indent = "");
+            void dump(Log& log, const std::string& indent = "") const;
 
         private:
+            enum class Kind
+            {
+                None,
+                String,
+                Vector,
+                Object
+            };
+
+            static Kind getKind(Type type)
+            {
+                switch (type)
+                {
+                    case Type::String:
+                    case Type::XMLDocument:
+                        return Kind::String;
+                    case Type::Array:
+                        return Kind::Vector;
+                    case Type::Object:
+                    case Type::Dictionary:
+                        return Kind::Object;
+                    default:
+                        return Kind::None;
+                }
+            }
+
+            static Object::const_iterator findMember(const Object& objectValue, const std::string& key)
+            {
+                return std::lower_bound(objectValue.begin(), objectValue.end(), key,
+                                        [](const Member& member, const std::string& k) { return member.first < k; });
+            }
+
+            static Object::iterator findMember(Object& objectValue, const std::string& key)
+            {
+                return std::lower_bound(objectValue.begin(), objectValue.end(), key,
+                                        [](const Member& member, const std::string& k) { return member.first < k; });
+            }
+
+            static std::shared_ptr<Object> makeObject(const Object& value);
+
+            const std::string& getString() const;
+            const std::vector<Node>& getVector() const;
+            const Object& getObject() const;
+
+            // the value is copied first if another node shares it
+            std::string& getMutableString();
+            std::vector<Node>& getMutableVector();
+            Object& getMutableObject();
+
             Type type = Type::Unknown;
 
             union
@@ -387,10 +481,9 @@ namespace relay
                 double doubleValue;
                 bool boolValue;
             };
-            uint32_t timezone;
-            std::string stringValue;
-            std::vector<Node> vectorValue;
-            std::map<std::string, Node> mapValue;
+            uint32_t timezone = 0;
+            // std::string, std::vector<Node> or Object depending on the type
+            std::shared_ptr<void> payload;
         };
     }
 }
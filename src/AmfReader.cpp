@@ -0,0 +1,389 @@
+//
+//  rtmp_relay
+//
+
+#include "AmfReader.hpp"
+#include "Utils.hpp"
+
+namespace relay
+{
+    namespace amf
+    {
+        bool Reader::readNumber(double& result)
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            if (marker == static_cast<uint8_t>(AMF0Marker::Number))
+            {
+                if (readDouble(result)) return true;
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::SwitchToAMF3) && readU8(marker))
+            {
+                uint32_t unsignedValue;
+
+                if (marker == static_cast<uint8_t>(AMF3Marker::Double))
+                {
+                    if (readDouble(result)) return true;
+                }
+                else if (marker == static_cast<uint8_t>(AMF3Marker::Integer) && readU29(unsignedValue))
+                {
+                    // sign extend the 29-bit integer
+                    int32_t value = static_cast<int32_t>(unsignedValue << 3);
+                    result = value >> 3;
+                    return true;
+                }
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::readBoolean(bool& result)
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            if (marker == static_cast<uint8_t>(AMF0Marker::Boolean))
+            {
+                uint8_t value;
+
+                if (readU8(value))
+                {
+                    result = value > 0;
+                    return true;
+                }
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::SwitchToAMF3) && readU8(marker))
+            {
+                if (marker == static_cast<uint8_t>(AMF3Marker::False) ||
+                    marker == static_cast<uint8_t>(AMF3Marker::True))
+                {
+                    result = (marker == static_cast<uint8_t>(AMF3Marker::True));
+                    return true;
+                }
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::readString(StringView& result)
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            if (marker == static_cast<uint8_t>(AMF0Marker::String))
+            {
+                uint16_t length;
+                if (readU16(length) && readBytes(length, result)) return true;
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::LongString))
+            {
+                uint32_t length;
+                if (readU32(length) && readBytes(length, result)) return true;
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::SwitchToAMF3) && readU8(marker))
+            {
+                uint32_t length;
+
+                // every switch starts with empty reference tables, so only a literal is valid here
+                if (marker == static_cast<uint8_t>(AMF3Marker::String) && readU29(length) &&
+                    (length & 0x01) && readBytes(length >> 1, result))
+                {
+                    return true;
+                }
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::readNull()
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            if (marker == static_cast<uint8_t>(AMF0Marker::Null) ||
+                marker == static_cast<uint8_t>(AMF0Marker::Undefined))
+            {
+                return true;
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::SwitchToAMF3) && readU8(marker))
+            {
+                if (marker == static_cast<uint8_t>(AMF3Marker::Null) ||
+                    marker == static_cast<uint8_t>(AMF3Marker::Undefined))
+                {
+                    return true;
+                }
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::readObject()
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            if (marker == static_cast<uint8_t>(AMF0Marker::Object))
+            {
+                return true;
+            }
+            else if (marker == static_cast<uint8_t>(AMF0Marker::ECMAArray))
+            {
+                uint32_t count; // not reliable, Wowza sends 0
+                if (readU32(count)) return true;
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::readKey(StringView& result)
+        {
+            uint32_t originalOffset = offset;
+            uint16_t length;
+
+            if (readU16(length) && readBytes(length, result))
+            {
+                if (isEnd())
+                {
+                    offset = originalOffset;
+                    return false;
+                }
+
+                if (buffer[offset] == static_cast<uint8_t>(AMF0Marker::ObjectEnd))
+                {
+                    offset += 1;
+                    return false;
+                }
+
+                return true;
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+
+        bool Reader::skip()
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            bool result = false;
+            StringView value;
+            double number;
+            uint16_t length16;
+            uint32_t length32;
+
+            switch (static_cast<AMF0Marker>(marker))
+            {
+                case AMF0Marker::Number: result = readDouble(number); break;
+                case AMF0Marker::Boolean: result = readBytes(1, value); break;
+                case AMF0Marker::String: result = readU16(length16) && readBytes(length16, value); break;
+                case AMF0Marker::Object:
+                case AMF0Marker::ECMAArray:
+                {
+                    if (marker == static_cast<uint8_t>(AMF0Marker::ECMAArray) && !readU32(length32)) break;
+
+                    uint32_t keyOffset = offset;
+                    StringView key;
+                    bool valid = true;
+
+                    while (valid && readKey(key))
+                    {
+                        valid = skip();
+                        keyOffset = offset;
+                    }
+
+                    // readKey stops at the end marker or at an error, only the end marker moves the offset
+                    result = valid && offset != keyOffset;
+                    break;
+                }
+                case AMF0Marker::Null:
+                case AMF0Marker::Undefined:
+                    result = true;
+                    break;
+                case AMF0Marker::StrictArray:
+                {
+                    if (!readU32(length32)) break;
+
+                    result = true;
+
+                    for (uint32_t i = 0; i < length32 && result; ++i)
+                    {
+                        result = skip();
+                    }
+                    break;
+                }
+                case AMF0Marker::Date: result = readDouble(number) && readU16(length16); break;
+                case AMF0Marker::LongString:
+                case AMF0Marker::XMLDocument:
+                    result = readU32(length32) && readBytes(length32, value);
+                    break;
+                case AMF0Marker::SwitchToAMF3: result = skipAMF3(); break;
+                default: break;
+            }
+
+            if (!result) offset = originalOffset;
+
+            return result;
+        }
+
+        bool Reader::readNode(Node& result, Version version)
+        {
+            if (isEnd()) return false;
+
+            uint32_t ret = result.decode(version, buffer, offset);
+
+            if (ret == 0) return false;
+
+            offset += ret;
+
+            return true;
+        }
+
+        bool Reader::readU8(uint8_t& result)
+        {
+            if (offset >= buffer.size()) return false;
+
+            result = buffer[offset];
+            offset += 1;
+
+            return true;
+        }
+
+        bool Reader::readU16(uint16_t& result)
+        {
+            if (offset > buffer.size() || buffer.size() - offset < 2) return false;
+
+            result = loadBE<2>(buffer.data() + offset);
+            offset += 2;
+
+            return true;
+        }
+
+        bool Reader::readU32(uint32_t& result)
+        {
+            if (offset > buffer.size() || buffer.size() - offset < 4) return false;
+
+            result = loadBE<4>(buffer.data() + offset);
+            offset += 4;
+
+            return true;
+        }
+
+        bool Reader::readU29(uint32_t& result)
+        {
+            uint32_t originalOffset = offset;
+            result = 0;
+
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                uint8_t b;
+
+                if (!readU8(b))
+                {
+                    offset = originalOffset;
+                    return false;
+                }
+
+                if (i == 3)
+                {
+                    result = (result << 8) | b;
+                }
+                else
+                {
+                    result = (result << 7) | (b & 0x7F);
+                    if (!(b & 0x80)) break;
+                }
+            }
+
+            return true;
+        }
+
+        bool Reader::readDouble(double& result)
+        {
+            if (offset > buffer.size() || buffer.size() - offset < 8) return false;
+
+            result = loadDoubleBE(buffer.data() + offset);
+            offset += 8;
+
+            return true;
+        }
+
+        bool Reader::readBytes(uint32_t length, StringView& result)
+        {
+            if (offset > buffer.size() || buffer.size() - offset < length) return false;
+
+            result.data = reinterpret_cast<const char*>(buffer.data() + offset);
+            result.length = length;
+            offset += length;
+
+            return true;
+        }
+
+        bool Reader::skipAMF3()
+        {
+            uint32_t originalOffset = offset;
+            uint8_t marker;
+
+            if (!readU8(marker)) return false;
+
+            uint32_t value;
+            double number;
+            StringView bytes;
+
+            switch (static_cast<AMF3Marker>(marker))
+            {
+                case AMF3Marker::Undefined:
+                case AMF3Marker::Null:
+                case AMF3Marker::False:
+                case AMF3Marker::True:
+                    return true;
+                case AMF3Marker::Integer:
+                    if (readU29(value)) return true;
+                    break;
+                case AMF3Marker::Double:
+                    if (readDouble(number)) return true;
+                    break;
+                case AMF3Marker::String:
+                case AMF3Marker::XMLDocument:
+                case AMF3Marker::XML:
+                    // the low bit tells a literal from a reference
+                    if (readU29(value) && (!(value & 0x01) || readBytes(value >> 1, bytes))) return true;
+                    break;
+                default:
+                {
+                    // complex AMF3 values are rare in commands, let the node decoder find their end
+                    offset = originalOffset;
+                    Node node;
+                    uint32_t ret = node.decode(Version::AMF3, buffer, offset);
+                    if (ret > 0)
+                    {
+                        offset += ret;
+                        return true;
+                    }
+                    break;
+                }
+            }
+
+            offset = originalOffset;
+            return false;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Amf.hpp"
+
+namespace relay
+{
+    namespace amf
+    {
+        // string inside a packet, valid as long as the packet data is not changed
+        struct StringView
+        {
+            const char* data = nullptr;
+            uint32_t length = 0;
+
+            bool operator==(const char* other) const
+            {
+                return std::strlen(other) == length && std::memcmp(data, other, length) == 0;
+            }
+
+            bool operator!=(const char* other) const
+            {
+                return !(*this == other);
+            }
+
+            std::string str() const { return std::string(data, length); }
+        };
+
+        // reads encoded AMF0 values one by one without building nodes, AMF3 values
+        // (after the switch marker) are read for the simple types only
+        class Reader
+        {
+        public:
+            Reader(const std::vector<uint8_t>& aBuffer, uint32_t aOffset = 0):
+                buffer(aBuffer), offset(aOffset)
+            {
+            }
+
+            uint32_t getOffset() const { return offset; }
+            bool isEnd() const { return offset >= buffer.size(); }
+
+            // all the reads leave the offset unchanged if the next value is not of the type
+            bool readNumber(double& result);
+            bool readBoolean(bool& result);
+            bool readString(StringView& result);
+            // null or undefined
+            bool readNull();
+
+            // objects and ECMA arrays: after readObject, readKey returns the keys until the end of the
+            // object, the caller has to read or skip the value of every key
+            bool readObject();
+            bool readKey(StringView& result);
+
+            bool skip();
+
+            // builds a node of the next value for the parts that have to be kept
+            bool readNode(Node& result, Version version = Version::AMF0);
+
+        private:
+            bool readU8(uint8_t& result);
+            bool readU16(uint16_t& result);
+            bool readU32(uint32_t& result);
+            bool readU29(uint32_t& result);
+            bool readDouble(double& result);
+            bool readBytes(uint32_t length, StringView& result);
+            bool skipAMF3();
+
+            const std::vector<uint8_t>& buffer;
+            uint32_t offset = 0;
+        };
+    }
+}
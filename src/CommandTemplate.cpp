@@ -0,0 +1,127 @@
+//
+//  rtmp_relay
+//
+
+#include <limits>
+#include "CommandTemplate.hpp"
+#include "Amf.hpp"
+#include "Utils.hpp"
+
+namespace relay
+{
+    namespace rtmp
+    {
+        static void writeString(std::vector<uint8_t>& data, const std::string& prefix, const std::string& value, const std::string& suffix)
+        {
+            size_t length = prefix.length() + value.length() + suffix.length();
+
+            if (length <= std::numeric_limits<uint16_t>::max())
+            {
+                data.push_back(static_cast<uint8_t>(amf::AMF0Marker::String));
+                encodeIntBE(data, 2, static_cast<uint16_t>(length));
+            }
+            else
+            {
+                data.push_back(static_cast<uint8_t>(amf::AMF0Marker::LongString));
+                encodeIntBE(data, 4, static_cast<uint32_t>(length));
+            }
+
+            data.insert(data.end(), prefix.begin(), prefix.end());
+            data.insert(data.end(), value.begin(), value.end());
+            data.insert(data.end(), suffix.begin(), suffix.end());
+        }
+
+        CommandTemplate& CommandTemplate::addNumber(double value)
+        {
+            fixed.push_back(static_cast<uint8_t>(amf::AMF0Marker::Number));
+            encodeDouble(fixed, value);
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::addString(const std::string& value)
+        {
+            writeString(fixed, "", value, "");
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::addNull()
+        {
+            fixed.push_back(static_cast<uint8_t>(amf::AMF0Marker::Null));
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::startObject()
+        {
+            fixed.push_back(static_cast<uint8_t>(amf::AMF0Marker::Object));
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::addKey(const std::string& key)
+        {
+            encodeIntBE(fixed, 2, static_cast<uint16_t>(key.length()));
+            fixed.insert(fixed.end(), key.begin(), key.end());
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::endObject()
+        {
+            encodeIntBE(fixed, 2, static_cast<uint16_t>(0));
+            fixed.push_back(static_cast<uint8_t>(amf::AMF0Marker::ObjectEnd));
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::addNumberField()
+        {
+            Field field;
+            field.offset = fixed.size();
+            field.type = FieldType::NUMBER;
+            fields.push_back(field);
+            return *this;
+        }
+
+        CommandTemplate& CommandTemplate::addStringField(const std::string& prefix, const std::string& suffix)
+        {
+            Field field;
+            field.offset = fixed.size();
+            field.type = FieldType::STRING;
+            field.prefix = prefix;
+            field.suffix = suffix;
+            fields.push_back(field);
+            return *this;
+        }
+
+        bool CommandTemplate::encode(std::vector<uint8_t>& data, std::initializer_list<Argument> arguments) const
+        {
+            if (arguments.size() != fields.size()) return false;
+
+            size_t offset = 0;
+            auto argument = arguments.begin();
+
+            for (const Field& field : fields)
+            {
+                data.insert(data.end(), fixed.begin() + static_cast<std::ptrdiff_t>(offset), fixed.begin() + static_cast<std::ptrdiff_t>(field.offset));
+                offset = field.offset;
+
+                if (field.type == FieldType::NUMBER)
+                {
+                    if (argument->string) return false;
+
+                    data.push_back(static_cast<uint8_t>(amf::AMF0Marker::Number));
+                    encodeDouble(data, argument->number);
+                }
+                else
+                {
+                    if (!argument->string) return false;
+
+                    writeString(data, field.prefix, *argument->string, field.suffix);
+                }
+
+                ++argument;
+            }
+
+            data.insert(data.end(), fixed.begin() + static_cast<std::ptrdiff_t>(offset), fixed.end());
+
+            return true;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace relay
+{
+    namespace rtmp
+    {
+        // AMF0 command body encoded once, only the fields (transaction ID, stream ID, stream
+        // names) are encoded when the command is sent, the bytes are the same that amf::Node
+        // encodes for the same values (object keys have to be added in sorted order)
+        class CommandTemplate
+        {
+        public:
+            // value of a field, strings are not copied
+            struct Argument
+            {
+                Argument(double aNumber): number(aNumber) {}
+                Argument(const std::string& aString): string(&aString) {}
+
+                double number = 0.0;
+                const std::string* string = nullptr;
+            };
+
+            CommandTemplate& addNumber(double value);
+            CommandTemplate& addString(const std::string& value);
+            CommandTemplate& addNull();
+            CommandTemplate& startObject();
+            CommandTemplate& addKey(const std::string& key);
+            CommandTemplate& endObject();
+
+            CommandTemplate& addNumberField();
+            // the argument is encoded between the prefix and the suffix
+            CommandTemplate& addStringField(const std::string& prefix = "", const std::string& suffix = "");
+
+            // appends the body with the arguments in the order of the fields, fails if the
+            // arguments don't match the fields
+            bool encode(std::vector<uint8_t>& data, std::initializer_list<Argument> arguments = {}) const;
+
+        private:
+            enum class FieldType
+            {
+                NUMBER,
+                STRING
+            };
+
+            struct Field
+            {
+                size_t offset; // in the fixed bytes
+                FieldType type;
+                std::string prefix;
+                std::string suffix;
+            };
+
+            std::vector<uint8_t> fixed;
+            std::vector<Field> fields;
+        };
+    }
+}
@@ -0,0 +1,184 @@
+//
+//  rtmp_relay
+//
+
+#include <algorithm>
+#include "ConnectScheduler.hpp"
+#include "Log.hpp"
+
+namespace relay
+{
+    ConnectScheduler::ConnectScheduler(std::mt19937& aGenerator):
+        generator(aGenerator)
+    {
+    }
+
+    bool ConnectScheduler::isAvailable(const std::string& address) const
+    {
+        auto i = targets.find(address);
+
+        if (i == targets.end()) return true;
+
+        switch (i->second.circuit)
+        {
+            case Circuit::CLOSED: return true;
+            case Circuit::OPEN: return std::chrono::steady_clock::now() >= i->second.openUntil;
+            case Circuit::HALF_OPEN: return !i->second.probing;
+        }
+
+        return true;
+    }
+
+    bool ConnectScheduler::startConnect(const std::string& address)
+    {
+        if (maxConnecting > 0 && connecting >= maxConnecting) return false;
+
+        Target& target = targets[address];
+
+        if (target.circuit == Circuit::OPEN)
+        {
+            if (std::chrono::steady_clock::now() < target.openUntil) return false;
+
+            Log(Log::Level::INFO) << "Trying " << address << " again after " << target.failures << " failed connects";
+            target.circuit = Circuit::HALF_OPEN;
+        }
+
+        // only one connection probes a half-open address
+        if (target.circuit == Circuit::HALF_OPEN)
+        {
+            if (target.probing) return false;
+            target.probing = true;
+        }
+
+        ++target.attempts;
+        ++connecting;
+
+        return true;
+    }
+
+    void ConnectScheduler::finishConnect(const std::string& address, bool success)
+    {
+        if (connecting > 0) --connecting;
+
+        Target& target = targets[address];
+        target.probing = false;
+
+        if (success)
+        {
+            if (target.circuit != Circuit::CLOSED)
+            {
+                Log(Log::Level::INFO) << address << " is reachable again";
+            }
+
+            target.circuit = Circuit::CLOSED;
+            target.failures = 0;
+            ++target.successes;
+        }
+        else
+        {
+            ++target.failures;
+            ++target.totalFailures;
+
+            if (target.circuit == Circuit::HALF_OPEN ||
+                (target.circuit == Circuit::CLOSED && circuitThreshold > 0 && target.failures >= circuitThreshold))
+            {
+                Log(Log::Level::WARN) << "Failed to connect to " << address << " " << target.failures << " times in a row, pausing connects for " << circuitTime << "s";
+
+                target.circuit = Circuit::OPEN;
+                target.openUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(circuitTime * 1000));
+            }
+        }
+    }
+
+    void ConnectScheduler::cancelConnect(const std::string& address)
+    {
+        if (connecting > 0) --connecting;
+
+        auto i = targets.find(address);
+        if (i != targets.end()) i->second.probing = false;
+    }
+
+    float ConnectScheduler::getRetryInterval(const std::string& address, float baseInterval)
+    {
+        Target& target = targets[address];
+
+        float limit = std::max(maxRetryInterval, baseInterval);
+        float interval = baseInterval;
+
+        for (uint32_t i = 0; i < target.failures && interval < limit; ++i)
+        {
+            interval *= 2.0f;
+        }
+
+        interval = std::min(interval, limit);
+
+        // wait between half and the full interval
+        std::uniform_real_distribution<float> jitter(0.5f, 1.0f);
+        target.retryInterval = interval * jitter(generator);
+
+        return target.retryInterval;
+    }
+
+    const char* ConnectScheduler::circuitToString(Circuit circuit)
+    {
+        switch (circuit)
+        {
+            case Circuit::CLOSED: return "closed";
+            case Circuit::OPEN: return "open";
+            case Circuit::HALF_OPEN: return "half-open";
+        }
+
+        return "";
+    }
+
+    void ConnectScheduler::getStats(std::string& str, ReportType reportType) const
+    {
+        switch (reportType)
+        {
+            case ReportType::TEXT:
+            {
+                str += "\nReconnects (connecting " + std::to_string(connecting) + "/" + std::to_string(maxConnecting) + "):\n";
+
+                for (const auto& target : targets)
+                {
+                    str += target.first +
+                        " circuit: " + circuitToString(target.second.circuit) +
+                        ", failures: " + std::to_string(target.second.failures) +
+                        ", attempts: " + std::to_string(target.second.attempts) +
+                        ", successes: " + std::to_string(target.second.successes) +
+                        ", total failures: " + std::to_string(target.second.totalFailures) +
+                        ", retry interval: " + std::to_string(target.second.retryInterval) + "\n";
+                }
+                break;
+            }
+            case ReportType::HTML:
+            {
+                break;
+            }
+            case ReportType::JSON:
+            {
+                str += "{\"connecting\":" + std::to_string(connecting) + "," +
+                    "\"maxConnecting\":" + std::to_string(maxConnecting) + "," +
+                    "\"targets\":[";
+
+                bool first = true;
+
+                for (const auto& target : targets)
+                {
+                    if (!first) str += ",";
+                    first = false;
+                    str += "{\"address\":\"" + target.first + "\"," +
+                        "\"circuit\":\"" + circuitToString(target.second.circuit) + "\"," +
+                        "\"failures\":" + std::to_string(target.second.failures) + "," +
+                        "\"attempts\":" + std::to_string(target.second.attempts) + "," +
+                        "\"successes\":" + std::to_string(target.second.successes) + "," +
+                        "\"totalFailures\":" + std::to_string(target.second.totalFailures) + "," +
+                        "\"retryInterval\":" + std::to_string(target.second.retryInterval) + "}";
+                }
+
+                str += "]}";
+                break;
+            }
+        }
+    }
+}
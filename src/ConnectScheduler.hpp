@@ -0,0 +1,82 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include "Status.hpp"
+
+namespace relay
+{
+    // decides when client connections may (re)connect: limits the number of
+    // connects and handshakes in flight, backs off per address and stops
+    // connecting to addresses that keep failing (circuit breaker)
+    class ConnectScheduler
+    {
+    public:
+        ConnectScheduler(std::mt19937& aGenerator);
+
+        ConnectScheduler(const ConnectScheduler&) = delete;
+        ConnectScheduler& operator=(const ConnectScheduler&) = delete;
+        ConnectScheduler(ConnectScheduler&&) = delete;
+        ConnectScheduler& operator=(ConnectScheduler&&) = delete;
+
+        void setMaxConnecting(uint32_t newMaxConnecting) { maxConnecting = newMaxConnecting; }
+        void setMaxRetryInterval(float newMaxRetryInterval) { maxRetryInterval = newMaxRetryInterval; }
+        void setCircuitBreaker(uint32_t newThreshold, float newTime) { circuitThreshold = newThreshold; circuitTime = newTime; }
+
+        // whether the circuit of the address lets a connect through
+        bool isAvailable(const std::string& address) const;
+
+        // takes a connect slot, fails if all slots are taken or the circuit of the address is open
+        bool startConnect(const std::string& address);
+        // releases the slot, success means that the handshake was completed
+        void finishConnect(const std::string& address, bool success);
+        // releases the slot of an attempt that was abandoned without a result
+        void cancelConnect(const std::string& address);
+
+        // time to wait before the next attempt to the address, doubled with every
+        // consecutive failure and randomized so that connections don't retry in lock-step
+        float getRetryInterval(const std::string& address, float baseInterval);
+
+        uint32_t getConnecting() const { return connecting; }
+
+        void getStats(std::string& str, ReportType reportType) const;
+
+    private:
+        enum class Circuit
+        {
+            CLOSED,
+            OPEN,
+            HALF_OPEN
+        };
+
+        struct Target
+        {
+            uint32_t failures = 0;
+            uint64_t attempts = 0;
+            uint64_t successes = 0;
+            uint64_t totalFailures = 0;
+            float retryInterval = 0.0f;
+            Circuit circuit = Circuit::CLOSED;
+            bool probing = false;
+            std::chrono::steady_clock::time_point openUntil;
+        };
+
+        static const char* circuitToString(Circuit circuit);
+
+        std::mt19937& generator;
+        std::map<std::string, Target> targets;
+
+        uint32_t connecting = 0;
+        uint32_t maxConnecting = 64;
+        float maxRetryInterval = 60.0f;
+        uint32_t circuitThreshold = 10;
+        float circuitTime = 30.0f;
+    };
+}
@@ -2,25 +2,131 @@
 //  rtmp_relay
 //
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
 
 #include "Connection.hpp"
+#include "AmfReader.hpp"
+#include "CommandTemplate.hpp"
 #include "Relay.hpp"
 #include "Server.hpp"
 #include "Endpoint.hpp"
 #include "Constants.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 
 namespace relay
 {
+    // the chunk streams of the streams on a shared connection follow the ones of the connection,
+    // every stream has one for audio, one for video and one for the rest
+    static const uint32_t CARRIED_CHANNEL_BASE = rtmp::Channel::SOURCE + 1;
+    static const uint32_t CHANNELS_PER_STREAM = 3;
+
+    static void fillRandom(std::mt19937& generator, uint8_t* buffer, size_t size)
+    {
+        // one 32-bit draw per four bytes instead of a distribution call per byte
+        for (size_t i = 0; i < size; i += sizeof(uint32_t))
+        {
+            uint32_t value = generator();
+            memcpy(buffer + i, &value, std::min(sizeof(value), size - i));
+        }
+    }
+
+    // command bodies, the fields are filled in by the send functions
+    static const rtmp::CommandTemplate ON_BW_DONE = rtmp::CommandTemplate().addString("onBWDone").addNumberField().addNull().addNumber(0.0);
+    static const rtmp::CommandTemplate CHECK_BW = rtmp::CommandTemplate().addString("_checkbw").addNumberField().addNull();
+    static const rtmp::CommandTemplate RESULT = rtmp::CommandTemplate().addString("_result").addNumberField().addNull();
+    static const rtmp::CommandTemplate RESULT_NUMBER = rtmp::CommandTemplate().addString("_result").addNumberField().addNull().addNumberField();
+    static const rtmp::CommandTemplate CREATE_STREAM = rtmp::CommandTemplate().addString("createStream").addNumberField().addNull();
+    static const rtmp::CommandTemplate RELEASE_STREAM = rtmp::CommandTemplate().addString("releaseStream").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate DELETE_STREAM = rtmp::CommandTemplate().addString("deleteStream").addNumberField().addNull().addNumberField();
+    static const rtmp::CommandTemplate FC_PUBLISH = rtmp::CommandTemplate().addString("FCPublish").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate ON_FC_PUBLISH = rtmp::CommandTemplate().addString("onFCPublish");
+    static const rtmp::CommandTemplate FC_UNPUBLISH = rtmp::CommandTemplate().addString("FCUnpublish").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate ON_FC_UNPUBLISH = rtmp::CommandTemplate().addString("onFCUnpublish");
+    static const rtmp::CommandTemplate FC_SUBSCRIBE = rtmp::CommandTemplate().addString("FCSubscribe").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate FC_UNSUBSCRIBE = rtmp::CommandTemplate().addString("FCUnsubscribe").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate ON_FC_UNSUBSCRIBE = rtmp::CommandTemplate().addString("onFCUnsubscribe");
+    static const rtmp::CommandTemplate PUBLISH = rtmp::CommandTemplate().addString("publish").addNumberField().addNull().addStringField().addString("live");
+    static const rtmp::CommandTemplate GET_STREAM_LENGTH = rtmp::CommandTemplate().addString("getStreamLength").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate PLAY = rtmp::CommandTemplate().addString("play").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate STOP = rtmp::CommandTemplate().addString("stop").addNumberField().addNull().addStringField();
+    static const rtmp::CommandTemplate ON_STATUS = rtmp::CommandTemplate().addString("onStatus").addNumberField().addNull();
+
+    // object keys in sorted order, like amf::Node encodes them
+    static const rtmp::CommandTemplate CONNECT = rtmp::CommandTemplate().addString("connect").addNumberField()
+        .startObject()
+        .addKey("app").addStringField()
+        .addKey("flashVer").addString("FMLE/3.0 (compatible; Lavf56.16.0)")
+        .addKey("objectEncoding").addNumberField()
+        .addKey("tcUrl").addStringField()
+        .addKey("type").addString("nonprivate")
+        .endObject();
+
+    static const rtmp::CommandTemplate CONNECT_RESULT = rtmp::CommandTemplate().addString("_result").addNumberField()
+        .startObject()
+        .addKey("capabilities").addNumber(31.0)
+        .addKey("fmsVer").addString("FMS/3,5,7,7009")
+        .endObject()
+        .startObject()
+        .addKey("code").addString("NetConnection.Connect.Success")
+        .addKey("description").addString("Connection succeeded.")
+        .addKey("level").addString("status")
+        .addKey("objectEncoding").addNumberField()
+        .endObject();
+
+    static const rtmp::CommandTemplate ON_FC_SUBSCRIBE = rtmp::CommandTemplate().addString("onFCSubscribe").addNull()
+        .startObject()
+        .addKey("clientid").addString("Lavf57.1.0")
+        .addKey("code").addString("NetStream.Play.Start")
+        .addKey("description").addStringField("Subscribed to ")
+        .addKey("level").addString("status")
+        .endObject();
+
+    static rtmp::CommandTemplate createStatus(const std::string& code, const std::string& description)
+    {
+        return rtmp::CommandTemplate().addString("onStatus").addNumberField().addNull()
+            .startObject()
+            .addKey("clientid").addString("Lavf57.1.0")
+            .addKey("code").addString(code)
+            .addKey("description").addStringField("", description)
+            .addKey("details").addStringField()
+            .addKey("level").addString("status")
+            .endObject();
+    }
+
+    static const rtmp::CommandTemplate PUBLISH_STATUS = createStatus("NetStream.Publish.Start", " is now published");
+    static const rtmp::CommandTemplate UNPUBLISH_STATUS = createStatus("NetStream.Unpublish.Success", " stopped publishing");
+    static const rtmp::CommandTemplate PLAY_STATUS = createStatus("NetStream.Play.Start", " is now playing");
+    static const rtmp::CommandTemplate STOP_STATUS = createStatus("NetStream.Play.Stop", " is now stopped");
+
+    // builds nodes of all the values of a command for the debug log
+    static void dumpValues(const std::string& prefix, const std::vector<uint8_t>& data, uint32_t offset)
+    {
+        amf::Reader reader(data, offset);
+
+        for (uint32_t index = 0; !reader.isEnd(); ++index)
+        {
+            amf::Node node;
+            if (!reader.readNode(node)) break;
+
+            Log log(Log::Level::ALL);
+            log << prefix << ", value " << index << ": ";
+            node.dump(log);
+        }
+    }
+
     Connection::Connection(Relay& aRelay,
                            Socket& client):
         relay(aRelay),
         id(Relay::nextId()),
         type(Type::HOST),
-        socket(std::move(client))
+        socket(std::move(client)),
+        handshakeStartTime(std::chrono::steady_clock::now())
     {
         updateIdString();
         Log(Log::Level::INFO) << idString << "Create connection";
@@ -45,6 +151,27 @@ namespace relay
         resolveStreamName();
         Log(Log::Level::INFO) << idString << "Create connection";
 
+        initClient();
+    }
+
+    Connection::Connection(Relay& aRelay,
+                           const Endpoint& aEndpoint,
+                           const std::string& aApplicationName):
+        relay(aRelay),
+        id(Relay::nextId()),
+        type(Type::CLIENT),
+        socket(relay.getNetwork()),
+        endpoint(&aEndpoint)
+    {
+        applicationName = aApplicationName;
+        updateIdString();
+        Log(Log::Level::INFO) << idString << "Create connection without a stream";
+
+        initClient();
+    }
+
+    void Connection::initClient()
+    {
         reconnectCount = endpoint->reconnectCount;
         bufferSize = endpoint->bufferSize;
         direction = endpoint->direction;
@@ -53,6 +180,10 @@ namespace relay
         socket.setReadCallback(std::bind(&Connection::handleRead, this, std::placeholders::_1, std::placeholders::_2));
         socket.setCloseCallback(std::bind(&Connection::handleClose, this, std::placeholders::_1));
         socket.setConnectTimeout(endpoint->connectionTimeout);
+        socket.setFastOpen(endpoint->fastOpen);
+        socket.setOptions(endpoint->socketOptions);
+        if (direction == Direction::OUTPUT) socket.setPacing(endpoint->pacingHeadroom);
+        if (direction == Direction::INPUT) socket.setReadRate(endpoint->maxIngestRate);
         socket.setConnectCallback(std::bind(&Connection::handleConnect, this, std::placeholders::_1));
         socket.setConnectErrorCallback(std::bind(&Connection::handleConnectError, this, std::placeholders::_1));
     }
@@ -60,12 +191,31 @@ namespace relay
     Connection::~Connection()
     {
         close();
+        closeRacingConnects();
+
+        // the carried streams must not keep a pointer to the deleted connection
+        while (!carriedConnections.empty())
+        {
+            removeCarriedConnection(*carriedConnections.back());
+        }
+
+        Metrics::releaseSeries(metricsSeries);
+
         Log(Log::Level::INFO) << idString << "Delete connection";
     }
 
     void Connection::updateIdString()
     {
         idString = "[CON:" + std::to_string(id) + " " + applicationName + "/" + streamName + "] ";
+
+        // host connections are counted for the address they were accepted on
+        std::string endpointName;
+        if (type == Type::HOST) endpointName = ipToString(socket.getLocalIPAddress()) + ":" + std::to_string(socket.getLocalPort());
+        else if (endpoint && !endpoint->addresses.empty()) endpointName = endpoint->addresses.front().url;
+
+        uint32_t previousSeries = metricsSeries;
+        metricsSeries = Metrics::getSeries(applicationName, streamName, endpointName);
+        Metrics::releaseSeries(previousSeries);
     }
 
     void Connection::close(bool forceClose)
@@ -74,7 +224,39 @@ namespace relay
 
         Log(Log::Level::INFO) << idString << "Close called";
         closed = closed || forceClose;
+
+        if (carrier)
+        {
+            if (streamId != 0)
+            {
+                if (direction == Direction::OUTPUT) sendFCUnpublish();
+                sendDeleteStream();
+            }
+
+            carrier->removeCarriedConnection(*this);
+        }
+
+        // the streams carried by this connection wait for it to reconnect on its own schedule,
+        // they find a new one on their next update only if it is closed for good
+        if (closed)
+        {
+            while (!carriedConnections.empty())
+            {
+                Connection* carriedConnection = carriedConnections.back();
+                removeCarriedConnection(*carriedConnection);
+                carriedConnection->reset();
+            }
+        }
+        else
+        {
+            for (Connection* carriedConnection : carriedConnections)
+            {
+                carriedConnection->reset();
+            }
+        }
         socket.close(forceClose);
+        closeRacingConnects();
+        cancelConnect();
 
         reset();
     }
@@ -95,6 +277,7 @@ namespace relay
         sentPackets.clear();
         invokeId = 0;
         invokes.clear();
+        streamId = 0;
         timeSinceMeasure = 0.0f;
         connected = false;
         videoFrameSent = false;
@@ -125,7 +308,40 @@ namespace relay
     {
         if (closed) return;
 
-        if (socket.isReady())
+        // stop reading the active input while none of the outputs can keep up, TCP pushes back on the publisher
+        if (direction == Direction::INPUT && endpoint && endpoint->maxIngestBuffer > 0)
+        {
+            bool saturated = stream && stream->getInputConnection() == this &&
+                stream->isSaturated(endpoint->maxIngestBuffer);
+
+            if (saturated != socket.isReadPaused())
+            {
+                if (saturated) Log(Log::Level::INFO) << idString << "All outputs are saturated, pausing input";
+                else Log(Log::Level::INFO) << idString << "Resuming input";
+
+                socket.setReadPaused(saturated);
+            }
+        }
+
+        // outputs whose data piles up in front of the network are slow consumers
+        if (direction == Direction::OUTPUT && !carrier && socket.isCongested() != congested)
+        {
+            congested = socket.isCongested();
+            const Socket::TcpInfo& tcpInfo = socket.getTcpInfo();
+
+            if (congested)
+            {
+                Log(Log::Level::WARN) << idString << "Output is congested, " << socket.getBacklog() << " bytes queued, " << tcpInfo.ackRate << " B/s acknowledged (rtt " <<
+                    tcpInfo.rtt / 1000 << " ms, " << tcpInfo.retransmits << " retransmits)";
+            }
+            else
+            {
+                Log(Log::Level::INFO) << idString << "Output is no longer congested";
+            }
+        }
+
+        // idle pooled and shared connections don't receive any media, paused inputs are not read
+        if (socket.isReady() && !pooled && carriedConnections.empty() && !socket.isReadPaused())
         {
             timeSinceLastData += delta;
             if (timeSinceLastData > 5.0f)
@@ -160,18 +376,36 @@ namespace relay
         {
             if (!endpoint) return;
 
-            if (socket.isReady() && state == State::HANDSHAKE_DONE)
+            updateRacingConnects(delta);
+
+            if (endpoint->multiplex && !stream && carriedConnections.empty())
+            {
+                Log(Log::Level::INFO) << idString << "No streams left on the shared connection";
+                socket.close(); // flushes deleteStream of the last stream
+                close(true);
+                return;
+            }
+
+            if (endpoint->multiplex && stream)
+            {
+                // the shared connection connects and reconnects
+                if (!carrier) connect();
+            }
+            else if (socket.isReady() && state == State::HANDSHAKE_DONE)
             {
                 timeSinceConnect = 0.0f;
+                retryScheduled = false;
             }
-            else
+            else if (connectPending)
             {
                 timeSinceConnect += delta;
 
-                if (timeSinceConnect >= endpoint->reconnectInterval)
+                // the attempt failed if nothing is connecting any more or the handshake did not finish in time
+                if ((!socket.isReady() && !socket.isConnecting() && racingSockets.empty() && pendingResolves == 0) ||
+                    timeSinceConnect >= endpoint->connectionTimeout + endpoint->connectStagger * (endpoint->addresses.size() - 1))
                 {
-                    timeSinceConnect = 0.0f;
-                    state = State::UNINITIALIZED;
+                    finishConnect(false);
+                    close();
 
                     if (connectCount >= reconnectCount)
                     {
@@ -183,12 +417,26 @@ namespace relay
                     {
                         addressIndex = 0;
                     }
+                }
+            }
+            else if (reconnecting)
+            {
+                if (!retryScheduled)
+                {
+                    retryScheduled = true;
+                    timeSinceConnect = 0.0f;
+                    retryInterval = relay.getConnectScheduler().getRetryInterval(endpoint->addresses[addressIndex].url,
+                                                                                 endpoint->reconnectInterval);
+                }
 
-                    if (addressIndex < endpoint->addresses.size())
-                    {
-                        socket.connect(endpoint->addresses[addressIndex].ipAddresses.first,
-                                       endpoint->addresses[addressIndex].ipAddresses.second);
-                    }
+                timeSinceConnect += delta;
+
+                if (timeSinceConnect >= retryInterval)
+                {
+                    timeSinceConnect = 0.0f;
+                    state = State::UNINITIALIZED;
+
+                    connect();
                 }
             }
         }
@@ -208,6 +456,9 @@ namespace relay
 
     void Connection::getStats(std::string& str, ReportType reportType) const
     {
+        // streams of a multiplexed endpoint report the shared connection
+        const Socket& statusSocket = carrier ? carrier->socket : socket;
+
         switch (reportType)
         {
             case ReportType::TEXT:
@@ -219,8 +470,8 @@ namespace relay
                 << std::setw(5) << id << " "
                 << std::setw(20) << applicationName << " "
                 << std::setw(20) << streamName << " "
-                << std::setw(15) << (socket.isReady() ? "connected" : "not connected") << " "
-                << std::setw(22) << ipToString(socket.getRemoteIPAddress()) + ":" + std::to_string(socket.getRemotePort()) << " "
+                << std::setw(15) << (statusSocket.isReady() ? "connected" : "not connected") << " "
+                << std::setw(22) << ipToString(statusSocket.getRemoteIPAddress()) + ":" + std::to_string(statusSocket.getRemotePort()) << " "
                 << std::setw(7) << (type == Type::HOST ? "HOST" : "CLIENT") << " "
                 << std::setw(20);
                 switch (state)
@@ -247,7 +498,7 @@ namespace relay
                 {
                     bool first = true;
 
-                    for (const std::pair<std::string, amf::Node>& value : metaData.asMap())
+                    for (const amf::Node::Member& value : metaData.asObject())
                     {
                         if (!first) ss << ", ";
                         first = false;
@@ -255,6 +506,24 @@ namespace relay
                     }
                 }
 
+                if (statusSocket.getPacingRate() > 0)
+                {
+                    ss << " (sending " << statusSocket.getSendRate() << " B/s, paced at " << statusSocket.getPacingRate() <<
+                        " B/s, delay " << static_cast<uint32_t>(statusSocket.getPacingDelay() * 1000.0f) << " ms)";
+                }
+
+                if (socket.isReadPaused()) ss << " (reading paused)";
+
+                const Socket::TcpInfo& tcpInfo = statusSocket.getTcpInfo();
+
+                if (tcpInfo.valid)
+                {
+                    ss << " (rtt " << tcpInfo.rtt / 1000.0f << "/" << tcpInfo.rttVariance / 1000.0f << " ms, cwnd " << tcpInfo.congestionWindow <<
+                        ", unacked " << tcpInfo.unacked << ", retransmits " << tcpInfo.retransmits <<
+                        ", delivering " << tcpInfo.deliveryRate << " B/s, acked " << tcpInfo.ackRate << " B/s, not sent " << tcpInfo.notSentBytes << " B" <<
+                        (statusSocket.isCongested() ? ", congested)" : ")");
+                }
+
                 str += ss.str();
                 str += "\n";
                 break;
@@ -263,7 +532,7 @@ namespace relay
             {
                 str += "<tr><td>" + std::to_string(id) +"</td><td>" + streamName + "</td>" +
                     "<td>" + applicationName + "</td>" +
-                    "<td>" + (socket.isReady() ? "Connected" : "Not connected") + "</td><td>" + ipToString(socket.getRemoteIPAddress()) + ":" + std::to_string(socket.getRemotePort()) + "</td><td>";
+                    "<td>" + (statusSocket.isReady() ? "Connected" : "Not connected") + "</td><td>" + ipToString(statusSocket.getRemoteIPAddress()) + ":" + std::to_string(statusSocket.getRemotePort()) + "</td><td>";
 
                 switch (type)
                 {
@@ -293,12 +562,30 @@ namespace relay
 
                 str += "</td><td>" + (stream ? std::to_string(stream->getServer().getId()) : "") + "</td><td>";
 
+                const Socket::TcpInfo& tcpInfo = statusSocket.getTcpInfo();
+
+                if (tcpInfo.valid)
+                {
+                    str += "rtt: " + std::to_string(tcpInfo.rtt / 1000.0f) + " ms<br/>" +
+                        "rtt variance: " + std::to_string(tcpInfo.rttVariance / 1000.0f) + " ms<br/>" +
+                        "cwnd: " + std::to_string(tcpInfo.congestionWindow) + "<br/>" +
+                        "unacked: " + std::to_string(tcpInfo.unacked) + "<br/>" +
+                        "retransmits: " + std::to_string(tcpInfo.retransmits) + "<br/>" +
+                        "delivery rate: " + std::to_string(tcpInfo.deliveryRate) + " B/s<br/>" +
+                        "ack rate: " + std::to_string(tcpInfo.ackRate) + " B/s<br/>" +
+                        "not sent: " + std::to_string(tcpInfo.notSentBytes) + " B";
+
+                    if (statusSocket.isCongested()) str += "<br/>congested";
+                }
+
+                str += "</td><td>";
+
                 if (metaData.getType() == amf::Node::Type::Dictionary ||
                     metaData.getType() == amf::Node::Type::Object)
                 {
                     bool first = true;
 
-                    for (const std::pair<std::string, amf::Node>& value : metaData.asMap())
+                    for (const amf::Node::Member& value : metaData.asObject())
                     {
                         if (!first) str += "<br/>";
                         first = false;
@@ -314,8 +601,8 @@ namespace relay
                 str += "{\"id\":" + std::to_string(id) + "," +
                     "\"name\":\"" + streamName + "\","
                     "\"application\":\"" + applicationName + "\"," +
-                    "\"status\":" + (socket.isReady() ? "\"connected\"" : "\"not connected\"") + "," +
-                    "\"address\":\"" + ipToString(socket.getRemoteIPAddress()) + ":" + std::to_string(socket.getRemotePort()) + "\"," +
+                    "\"status\":" + (statusSocket.isReady() ? "\"connected\"" : "\"not connected\"") + "," +
+                    "\"address\":\"" + ipToString(statusSocket.getRemoteIPAddress()) + ":" + std::to_string(statusSocket.getRemotePort()) + "\"," +
                     "\"connection\":";
 
                 switch (type)
@@ -346,13 +633,39 @@ namespace relay
 
                 if (stream) str += ",\"serverId\":" + std::to_string(stream->getServer().getId());
 
+                str += ",\"sendRate\":" + std::to_string(statusSocket.getSendRate());
+
+                if (statusSocket.getPacingRate() > 0)
+                {
+                    str += ",\"pacingRate\":" + std::to_string(statusSocket.getPacingRate()) +
+                        ",\"pacingDelay\":" + std::to_string(statusSocket.getPacingDelay());
+                }
+
+                if (socket.isReadPaused()) str += ",\"readPaused\":true";
+
+                const Socket::TcpInfo& tcpInfo = statusSocket.getTcpInfo();
+
+                if (tcpInfo.valid)
+                {
+                    str += std::string(",\"tcp\":{") +
+                        "\"rtt\":" + std::to_string(tcpInfo.rtt) + "," +
+                        "\"rttVariance\":" + std::to_string(tcpInfo.rttVariance) + "," +
+                        "\"congestionWindow\":" + std::to_string(tcpInfo.congestionWindow) + "," +
+                        "\"unacked\":" + std::to_string(tcpInfo.unacked) + "," +
+                        "\"retransmits\":" + std::to_string(tcpInfo.retransmits) + "," +
+                        "\"deliveryRate\":" + std::to_string(tcpInfo.deliveryRate) + "," +
+                        "\"ackRate\":" + std::to_string(tcpInfo.ackRate) + "," +
+                        "\"notSentBytes\":" + std::to_string(tcpInfo.notSentBytes) + "," +
+                        "\"congested\":" + (statusSocket.isCongested() ? "true" : "false") + "}";
+                }
+
                 if (metaData.getType() == amf::Node::Type::Dictionary ||
                     metaData.getType() == amf::Node::Type::Object)
                 {
                     str += ",\"metaData\":{";
                     bool first = true;
 
-                    for (const std::pair<std::string, amf::Node>& value : metaData.asMap())
+                    for (const amf::Node::Member& value : metaData.asObject())
                     {
                         if (!first) str += ", ";
                         first = false;
@@ -383,13 +696,195 @@ namespace relay
     {
         if (!endpoint) return;
 
+        if (endpoint->multiplex && stream)
+        {
+            if (!carrier) stream->getServer().getCarrier(*endpoint, applicationName).addCarriedConnection(*this);
+
+            if (carrier->isConnected() && !connected)
+            {
+                connected = true;
+                state = State::HANDSHAKE_DONE;
+                startStream();
+            }
+
+            return;
+        }
+
         if (addressIndex < endpoint->addresses.size())
         {
-            socket.connect(endpoint->addresses[addressIndex].ipAddresses.first,
-                           endpoint->addresses[addressIndex].ipAddresses.second);
+            cancelConnect();
+
+            ConnectScheduler& connectScheduler = relay.getConnectScheduler();
+
+            // skip addresses that keep failing if there are others
+            if (!connectScheduler.isAvailable(endpoint->addresses[addressIndex].url) &&
+                endpoint->addresses.size() > 1)
+            {
+                addressIndex = (addressIndex + 1) % static_cast<uint32_t>(endpoint->addresses.size());
+            }
+
+            if (!connectScheduler.startConnect(endpoint->addresses[addressIndex].url))
+            {
+                // try again on the next update
+                retryScheduled = true;
+                retryInterval = 0.0f;
+                timeSinceConnect = 0.0f;
+                return;
+            }
+
+            connectPending = true;
+            connectStartTime = std::chrono::steady_clock::now();
+            retryScheduled = false;
+            connectAddress = endpoint->addresses[addressIndex].url;
+
+            closeRacingConnects();
+            startedConnects = 1;
+            timeSinceConnectStart = 0.0f;
+
+            resolveAddress(addressIndex, false);
+        }
+    }
+
+    void Connection::resolveAddress(uint32_t index, bool racing)
+    {
+        // decremented by handleResolve, which is called right away on a cache hit
+        ++pendingResolves;
+
+        uint64_t requestId = relay.getResolver().resolve(endpoint->addresses[index].url,
+                                                         std::bind(&Connection::handleResolve, this, index, racing,
+                                                                   std::placeholders::_1, std::placeholders::_2));
+
+        if (requestId) resolveRequests.push_back(requestId);
+    }
+
+    void Connection::handleResolve(uint32_t index, bool racing, bool success, const std::pair<uint32_t, uint16_t>& ipAddress)
+    {
+        if (pendingResolves > 0) --pendingResolves;
+
+        // failed lookups are retried after reconnectInterval
+        if (closed || !endpoint || !success || socket.isReady()) return;
+
+        if (racing)
+        {
+            std::unique_ptr<Socket> racingSocket(new Socket(relay.getNetwork()));
+            racingSocket->setConnectTimeout(endpoint->connectionTimeout);
+            racingSocket->setFastOpen(endpoint->fastOpen);
+            racingSocket->setOptions(endpoint->socketOptions);
+            if (direction == Direction::OUTPUT) racingSocket->setPacing(endpoint->pacingHeadroom);
+            if (direction == Direction::INPUT) racingSocket->setReadRate(endpoint->maxIngestRate);
+            racingSocket->setConnectCallback(std::bind(&Connection::handleRacingConnect, this, std::placeholders::_1));
+
+            Socket& newSocket = *racingSocket;
+            racingSockets.push_back(std::make_pair(index, std::move(racingSocket)));
+
+            Log(Log::Level::INFO) << idString << "Starting parallel connect to " << endpoint->addresses[index].url;
+
+            newSocket.connect(ipAddress.first, ipAddress.second);
+        }
+        else
+        {
+            socket.connect(ipAddress.first, ipAddress.second);
+        }
+    }
+
+    void Connection::updateRacingConnects(float delta)
+    {
+        // drop the attempts that failed or lost the race
+        for (auto i = racingSockets.begin(); i != racingSockets.end();)
+        {
+            if (!i->second->isConnecting() && !i->second->isReady())
+            {
+                i = racingSockets.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if (endpoint->connectStagger <= 0.0f ||
+            socket.isReady() ||
+            startedConnects == 0 ||
+            startedConnects >= endpoint->addresses.size())
+        {
+            return;
+        }
+
+        timeSinceConnectStart += delta;
+
+        // the next address is tried after the stagger delay, or right away if every attempt has failed
+        if (timeSinceConnectStart >= endpoint->connectStagger ||
+            (!socket.isConnecting() && racingSockets.empty() && pendingResolves == 0))
+        {
+            uint32_t index = (addressIndex + startedConnects) % static_cast<uint32_t>(endpoint->addresses.size());
+            ++startedConnects;
+            timeSinceConnectStart = 0.0f;
+
+            resolveAddress(index, true);
         }
     }
 
+    void Connection::closeRacingConnects()
+    {
+        // the sockets are erased in update, this can be called from their callbacks
+        for (const auto& racingSocket : racingSockets)
+        {
+            racingSocket.second->close(true);
+        }
+
+        for (uint64_t requestId : resolveRequests)
+        {
+            relay.getResolver().cancel(requestId);
+        }
+
+        resolveRequests.clear();
+        pendingResolves = 0;
+        startedConnects = 0;
+    }
+
+    void Connection::finishConnect(bool success)
+    {
+        if (!connectPending) return;
+
+        connectPending = false;
+        relay.getConnectScheduler().finishConnect(connectAddress, success);
+    }
+
+    void Connection::cancelConnect()
+    {
+        if (!connectPending) return;
+
+        connectPending = false;
+        relay.getConnectScheduler().cancelConnect(connectAddress);
+    }
+
+    void Connection::handleRacingConnect(Socket& racingSocket)
+    {
+        if (closed || socket.isReady())
+        {
+            racingSocket.close(true);
+            return;
+        }
+
+        for (const auto& racing : racingSockets)
+        {
+            if (racing.second.get() == &racingSocket)
+            {
+                addressIndex = racing.first;
+                Log(Log::Level::INFO) << idString << "Parallel connect to " << endpoint->addresses[addressIndex].url << " won";
+            }
+        }
+
+        // replaces (and cancels) the pending connect of the primary socket
+        socket = std::move(racingSocket);
+        socket.setReadCallback(std::bind(&Connection::handleRead, this, std::placeholders::_1, std::placeholders::_2));
+        socket.setCloseCallback(std::bind(&Connection::handleClose, this, std::placeholders::_1));
+        socket.setConnectCallback(std::bind(&Connection::handleConnect, this, std::placeholders::_1));
+        socket.setConnectErrorCallback(std::bind(&Connection::handleConnectError, this, std::placeholders::_1));
+
+        handleConnect(socket);
+    }
+
     void Connection::handleConnect(Socket&)
     {
         if (closed)
@@ -401,34 +896,30 @@ namespace relay
         // handshake
         if (type == Type::CLIENT)
         {
-            Log(Log::Level::INFO) << idString << "Connected to " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort();
+            closeRacingConnects();
 
-            // C0
-            std::vector<uint8_t> version;
-            version.push_back(RTMP_VERSION);
-            socket.send(version);
+            handshakeStartTime = std::chrono::steady_clock::now();
+            Metrics::observe(Metrics::Histogram::CONNECT_TIME, handshakeStartTime - connectStartTime);
 
-            Log(Log::Level::ALL) << idString << "Sending version message " << RTMP_VERSION;
+            Log(Log::Level::INFO) << idString << "Connected to " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort();
 
-            // C1
-            rtmp::Challenge challenge;
-            challenge.time = 0;
-            std::copy(RTMP_SERVER_VERSION, RTMP_SERVER_VERSION + sizeof(RTMP_SERVER_VERSION), challenge.version);
+            // C0 and C1 in one buffer
+            std::vector<uint8_t> message(sizeof(uint8_t) + sizeof(rtmp::Challenge));
+            uint8_t* messageData = message.data();
 
-            for (size_t i = 0; i < sizeof(challenge.randomBytes); ++i)
-            {
-                uint32_t randomValue = std::uniform_int_distribution<uint32_t>{0, 255}(relay.getGenerator());
+            // C0
+            *messageData = RTMP_VERSION;
+            messageData += sizeof(uint8_t);
 
-                challenge.randomBytes[i] = static_cast<uint8_t>(randomValue);
-            }
+            LOG(Log::Level::ALL) << idString << "Sending version message " << RTMP_VERSION;
+
+            // C1, time is zero
+            std::copy(RTMP_SERVER_VERSION, RTMP_SERVER_VERSION + sizeof(RTMP_SERVER_VERSION), messageData + offsetof(rtmp::Challenge, version));
+            fillRandom(relay.getGenerator(), messageData + offsetof(rtmp::Challenge, randomBytes), sizeof(rtmp::Challenge::randomBytes));
 
-            std::vector<uint8_t> challengeMessage;
-            challengeMessage.insert(challengeMessage.begin(),
-                                    reinterpret_cast<uint8_t*>(&challenge),
-                                    reinterpret_cast<uint8_t*>(&challenge) + sizeof(challenge));
-            socket.send(challengeMessage);
+            socket.send(std::move(message));
 
-            Log(Log::Level::ALL) << idString << "Sending challenge message";
+            LOG(Log::Level::ALL) << idString << "Sending challenge message";
 
             state = State::VERSION_SENT;
         }
@@ -441,8 +932,9 @@ namespace relay
     void Connection::handleRead(Socket&, const std::vector<uint8_t>& newData)
     {
         data.insert(data.end(), newData.begin(), newData.end());
+        Metrics::add(metricsSeries, Metrics::Counter::RECEIVED_BYTES, newData.size());
 
-        Log(Log::Level::ALL) << idString << "Got " << std::to_string(newData.size()) << " bytes";
+        LOG(Log::Level::ALL) << idString << "Got " << std::to_string(newData.size()) << " bytes";
 
         uint32_t offset = 0;
 
@@ -456,7 +948,7 @@ namespace relay
 
                 if (ret > 0)
                 {
-                    Log(Log::Level::ALL) << idString << "Total packet size: " << ret;
+                    LOG(Log::Level::ALL) << idString << "Total packet size: " << ret;
 
                     offset += ret;
 
@@ -475,9 +967,6 @@ namespace relay
                     {
                         // C0
                         uint8_t version = *(data.data() + offset);
-                        offset += sizeof(version);
-
-                        Log(Log::Level::ALL) << idString << "Got version " << static_cast<uint32_t>(version);
 
                         if (version != 0x03)
                         {
@@ -485,64 +974,48 @@ namespace relay
                             close();
                             break;
                         }
-
-                        // S0
-                        std::vector<uint8_t> reply;
-                        reply.push_back(RTMP_VERSION);
-                        socket.send(reply);
-                        Log(Log::Level::ALL) << idString << "Sending reply version " << RTMP_VERSION;
-
-                        state = State::VERSION_SENT;
                     }
-                    else
-                    {
-                        break;
-                    }
-                }
-                else if (state == State::VERSION_SENT)
-                {
-                    if (data.size() - offset >= sizeof(rtmp::Challenge))
+
+                    // S0, S1 and S2 are sent in one buffer once C1 has arrived
+                    if (data.size() - offset >= sizeof(uint8_t) + sizeof(rtmp::Challenge))
                     {
+                        offset += sizeof(uint8_t);
+
+                        LOG(Log::Level::ALL) << idString << "Got version " << static_cast<uint32_t>(RTMP_VERSION);
+
                         // C1
                         rtmp::Challenge* challenge = reinterpret_cast<rtmp::Challenge*>(data.data() + offset);
                         offset += sizeof(*challenge);
 
-                        Log(Log::Level::ALL) << idString << "Got challenge message, time: " << challenge->time <<
+                        LOG(Log::Level::ALL) << idString << "Got challenge message, time: " << challenge->time <<
                         ", version: " << static_cast<uint32_t>(challenge->version[0]) << "." <<
                         static_cast<uint32_t>(challenge->version[1]) << "." <<
                         static_cast<uint32_t>(challenge->version[2]) << "." <<
                         static_cast<uint32_t>(challenge->version[3]);
 
-                        // S1
-                        rtmp::Challenge replyChallenge;
-                        replyChallenge.time = 0;
-                        std::copy(RTMP_SERVER_VERSION, RTMP_SERVER_VERSION + sizeof(RTMP_SERVER_VERSION), replyChallenge.version);
+                        std::vector<uint8_t> reply(sizeof(uint8_t) + sizeof(rtmp::Challenge) + sizeof(rtmp::Ack));
+                        uint8_t* replyData = reply.data();
 
-                        for (size_t i = 0; i < sizeof(replyChallenge.randomBytes); ++i)
-                        {
-                            uint32_t randomValue = std::uniform_int_distribution<uint32_t>{0, 255}(relay.getGenerator());
-                            replyChallenge.randomBytes[i] = static_cast<uint8_t>(randomValue);
-                        }
+                        // S0
+                        *replyData = RTMP_VERSION;
+                        replyData += sizeof(uint8_t);
 
-                        std::vector<uint8_t> reply;
-                        reply.insert(reply.begin(),
-                                     reinterpret_cast<uint8_t*>(&replyChallenge),
-                                     reinterpret_cast<uint8_t*>(&replyChallenge) + sizeof(replyChallenge));
-                        socket.send(reply);
+                        LOG(Log::Level::ALL) << idString << "Sending reply version " << RTMP_VERSION;
 
-                        Log(Log::Level::ALL) << idString << "Sending challange reply message";
+                        // S1, time is zero
+                        std::copy(RTMP_SERVER_VERSION, RTMP_SERVER_VERSION + sizeof(RTMP_SERVER_VERSION), replyData + offsetof(rtmp::Challenge, version));
+                        fillRandom(relay.getGenerator(), replyData + offsetof(rtmp::Challenge, randomBytes), sizeof(rtmp::Challenge::randomBytes));
+                        replyData += sizeof(rtmp::Challenge);
 
-                        // S2
-                        rtmp::Ack ack;
-                        ack.time = challenge->time;
-                        std::copy(challenge->version, challenge->version + sizeof(ack.version), ack.version);
-                        std::copy(challenge->randomBytes, challenge->randomBytes + sizeof(ack.randomBytes), ack.randomBytes);
+                        LOG(Log::Level::ALL) << idString << "Sending challange reply message";
 
-                        std::vector<uint8_t> ackData(reinterpret_cast<uint8_t*>(&ack),
-                                                     reinterpret_cast<uint8_t*>(&ack) + sizeof(ack));
-                        socket.send(ackData);
+                        // S2, echo of C1
+                        const uint8_t* challengeData = reinterpret_cast<const uint8_t*>(challenge);
+                        std::copy(challengeData, challengeData + sizeof(rtmp::Ack), replyData);
 
-                        Log(Log::Level::ALL) << idString << "Sending Ack message";
+                        socket.send(std::move(reply));
+
+                        LOG(Log::Level::ALL) << idString << "Sending Ack message";
 
                         state = State::ACK_SENT;
                     }
@@ -559,14 +1032,15 @@ namespace relay
                         rtmp::Ack* ack = reinterpret_cast<rtmp::Ack*>(data.data() + offset);
                         offset += sizeof(*ack);
 
-                        Log(Log::Level::ALL) << idString << "Got Ack reply message, time: " << ack->time <<
+                        LOG(Log::Level::ALL) << idString << "Got Ack reply message, time: " << ack->time <<
                             ", version: " << static_cast<uint32_t>(ack->version[0]) << "." <<
                         static_cast<uint32_t>(ack->version[1]) << "." <<
                         static_cast<uint32_t>(ack->version[2]) << "." <<
                         static_cast<uint32_t>(ack->version[3]);
-                        Log(Log::Level::ALL) << idString << "Handshake done";
+                        LOG(Log::Level::ALL) << idString << "Handshake done";
 
                         state = State::HANDSHAKE_DONE;
+                        Metrics::observe(Metrics::Histogram::HANDSHAKE_TIME, std::chrono::steady_clock::now() - handshakeStartTime);
                     }
                     else
                     {
@@ -584,7 +1058,7 @@ namespace relay
                         uint8_t version = *(data.data() + offset);
                         offset += sizeof(version);
 
-                        Log(Log::Level::ALL) << idString << "Got reply version " << static_cast<uint32_t>(version);
+                        LOG(Log::Level::ALL) << idString << "Got reply version " << static_cast<uint32_t>(version);
 
                         if (version != 0x03)
                         {
@@ -608,7 +1082,7 @@ namespace relay
                         rtmp::Challenge* challenge = reinterpret_cast<rtmp::Challenge*>(data.data() + offset);
                         offset += sizeof(*challenge);
 
-                        Log(Log::Level::ALL) << idString << "Got challenge reply message, time: " << challenge->time <<
+                        LOG(Log::Level::ALL) << idString << "Got challenge reply message, time: " << challenge->time <<
                             ", version: " << static_cast<uint32_t>(challenge->version[0]) << "." <<
                         static_cast<uint32_t>(challenge->version[1]) << "." <<
                         static_cast<uint32_t>(challenge->version[2]) << "." <<
@@ -624,7 +1098,7 @@ namespace relay
                                                      reinterpret_cast<uint8_t*>(&ack) + sizeof(ack));
                         socket.send(ackData);
 
-                        Log(Log::Level::ALL) << "[" << id << ", " << name << " " << applicationName << "/" << streamName << "] " << "Sending Ack message";
+                        LOG(Log::Level::ALL) << "[" << id << ", " << name << " " << applicationName << "/" << streamName << "] " << "Sending Ack message";
 
                         state = State::ACK_SENT;
                     }
@@ -641,16 +1115,18 @@ namespace relay
                         rtmp::Ack* ack = reinterpret_cast<rtmp::Ack*>(data.data() + offset);
                         offset += sizeof(*ack);
 
-                        Log(Log::Level::ALL) << idString << "Got Ack reply message, time: " << ack->time <<
+                        LOG(Log::Level::ALL) << idString << "Got Ack reply message, time: " << ack->time <<
                             ", version: " << static_cast<uint32_t>(ack->version[0]) << "." <<
                             static_cast<uint32_t>(ack->version[1]) << "." <<
                             static_cast<uint32_t>(ack->version[2]) << "." <<
                             static_cast<uint32_t>(ack->version[3]);
-                        Log(Log::Level::ALL) << idString << "Handshake done";
+                        LOG(Log::Level::ALL) << idString << "Handshake done";
                         
                         state = State::HANDSHAKE_DONE;
+                        finishConnect(true);
+                        Metrics::observe(Metrics::Histogram::HANDSHAKE_TIME, std::chrono::steady_clock::now() - handshakeStartTime);
 
-                        Log(Log::Level::ALL) << idString << "Connecting to application " << applicationName;
+                        LOG(Log::Level::ALL) << idString << "Connecting to application " << applicationName;
 
                         sendConnect();
                     }
@@ -675,7 +1151,7 @@ namespace relay
         {
             data.erase(data.begin(), data.begin() + offset);
             
-            Log(Log::Level::ALL) << idString << "Remaining data " << data.size();
+            LOG(Log::Level::ALL) << idString << "Remaining data " << data.size();
         }
     }
 
@@ -685,12 +1161,29 @@ namespace relay
 
         reset();
 
+        for (Connection* carriedConnection : carriedConnections)
+        {
+            carriedConnection->reset();
+        }
+
         timeSincePing = 0.0f;
         timeSinceConnect = 0.0f;
     }
 
     bool Connection::handlePacket(const rtmp::Packet& packet)
     {
+        // messages of the streams that share this connection
+        if (packet.messageStreamId != 0)
+        {
+            for (Connection* carriedConnection : carriedConnections)
+            {
+                if (carriedConnection->streamId == packet.messageStreamId)
+                {
+                    return carriedConnection->handlePacket(packet);
+                }
+            }
+        }
+
         switch (packet.messageType)
         {
             case rtmp::MessageType::SET_CHUNK_SIZE:
@@ -704,7 +1197,7 @@ namespace relay
                     return false;
                 }
 
-                Log(Log::Level::ALL) << idString << "Received SET_CHUNK_SIZE, parameter: " << inChunkSize;
+                LOG(Log::Level::ALL) << idString << "Received SET_CHUNK_SIZE, parameter: " << inChunkSize;
 
                 if (type == Type::CLIENT)
                 {
@@ -716,7 +1209,7 @@ namespace relay
 
             case rtmp::MessageType::ABORT:
             {
-                Log(Log::Level::ALL) << idString << "Received ABORT";
+                LOG(Log::Level::ALL) << idString << "Received ABORT";
                 break;
             }
 
@@ -732,7 +1225,7 @@ namespace relay
                     return false;
                 }
 
-                Log(Log::Level::ALL) << idString << "Received BYTES_READ, parameter: " << bytesRead;
+                LOG(Log::Level::ALL) << idString << "Received BYTES_READ, parameter: " << bytesRead;
 
                 break;
             }
@@ -763,6 +1256,7 @@ namespace relay
 
                 offset += ret;
 
+                if (Log::isEnabled(Log::Level::ALL))
                 {
                     Log log(Log::Level::ALL);
                     log << idString << "Received PING, type: ";
@@ -804,7 +1298,7 @@ namespace relay
 
                 offset += ret;
 
-                Log(Log::Level::ALL) << idString << "Received SERVER_BANDWIDTH, parameter: " << bandwidth;
+                LOG(Log::Level::ALL) << idString << "Received SERVER_BANDWIDTH, parameter: " << bandwidth;
 
                 break;
             }
@@ -833,7 +1327,7 @@ namespace relay
 
                 offset += ret;
 
-                Log(Log::Level::ALL) << idString << "Received CLIENT_BANDWIDTH, parameter: " << bandwidth << ", type: " << bandwidthType;
+                LOG(Log::Level::ALL) << idString << "Received CLIENT_BANDWIDTH, parameter: " << bandwidth << ", type: " << bandwidthType;
 
                 break;
             }
@@ -866,121 +1360,85 @@ namespace relay
                 // only input can receive notify packets
                 if (direction == Direction::INPUT)
                 {
-                    amf::Node command;
+                    if (Log::isEnabled(Log::Level::ALL)) dumpValues(idString + "Received NOTIFY", packet.data, offset);
 
-                    ret = command.decode(amf::Version::AMF0, packet.data, offset);
+                    amf::Reader reader(packet.data, offset);
+                    amf::StringView commandName;
 
-                    if (ret == 0)
+                    if (!reader.readString(commandName))
                     {
                         return false;
                     }
 
-                    offset += ret;
+                    rtmp::Command command = rtmp::getCommand(commandName.data, commandName.length);
 
-                    {
-                        Log log(Log::Level::ALL);
-                        log << idString << "Received NOTIFY, command: ";
-                        command.dump(log);
-                    }
+                    // @setDataFrame wraps onMetaData
+                    bool dataFrame = false;
+                    amf::StringView dataName;
 
-                    amf::Node argument1;
-
-                    if ((ret = argument1.decode(amf::Version::AMF0, packet.data, offset))  > 0)
+                    if (command == rtmp::Command::SET_DATA_FRAME &&
+                        reader.readString(dataName) &&
+                        dataName == "onMetaData")
                     {
-                        offset += ret;
-
-                        Log log(Log::Level::ALL);
-                        log << idString << "Argument 1: ";
-                        argument1.dump(log);
+                        command = rtmp::Command::ON_META_DATA;
+                        dataFrame = true;
                     }
 
-                    amf::Node argument2;
+                    // the meta data is forwarded, so it is the only part that is built into nodes
+                    amf::Node newMetaData;
 
-                    if ((ret = argument2.decode(amf::Version::AMF0, packet.data, offset)) > 0)
+                    if (command == rtmp::Command::ON_META_DATA &&
+                        reader.readNode(newMetaData) &&
+                        (newMetaData.getType() == amf::Node::Type::Dictionary ||
+                         newMetaData.getType() == amf::Node::Type::Object))
                     {
-                        offset += ret;
-
-                        Log log(Log::Level::ALL);
-                        log << idString << "Argument 2: ";
-                        argument2.dump(log);
-                    }
-
-                    if (command.asString() == "@setDataFrame" &&
-                        argument1.asString() == "onMetaData" &&
-                        (argument2.getType() == amf::Node::Type::Dictionary ||
-                         argument2.getType() == amf::Node::Type::Object))
-                    {
-                        metaData = argument2;
+                        metaData = std::move(newMetaData);
 
                         if (metaData.hasElement("audiocodecid"))
                         {
                             if (metaData["audiocodecid"].isNumber())
-                                Log(Log::Level::ALL) << "Audio codec: " << getAudioCodec(static_cast<AudioCodec>(metaData["audiocodecid"].asUInt32()));
+                            {
+                                LOG(Log::Level::ALL) << "Audio codec: " << getAudioCodec(static_cast<AudioCodec>(metaData["audiocodecid"].asUInt32()));
+                            }
                             else if (metaData["audiocodecid"].isString())
-                                Log(Log::Level::ALL) << "Audio codec: " << metaData["audiocodecid"].asString();
+                            {
+                                LOG(Log::Level::ALL) << "Audio codec: " << metaData["audiocodecid"].asString();
+                            }
                         }
 
                         if (metaData.hasElement("videocodecid"))
                         {
                             if (metaData["videocodecid"].isNumber())
-                                Log(Log::Level::ALL) << "Video codec: " << getVideoCodec(static_cast<VideoCodec>(metaData["videocodecid"].asUInt32()));
+                            {
+                                LOG(Log::Level::ALL) << "Video codec: " << getVideoCodec(static_cast<VideoCodec>(metaData["videocodecid"].asUInt32()));
+                            }
                             else if (metaData["videocodecid"].isString())
-                                Log(Log::Level::ALL) << "Video codec: " << metaData["videocodecid"].asString();
+                            {
+                                LOG(Log::Level::ALL) << "Video codec: " << metaData["videocodecid"].asString();
+                            }
                         }
 
                         // forward notify packet
                         if (stream)
                         {
-                            stream->sendMetaData(metaData);
+                            stream->sendMetaData(*this, metaData);
                             timeSinceLastData = 0;
                         }
                         else
                         {
-                            Log(Log::Level::ERR) << idString << "Not server, disconnecting - setDataFrame > onMetaData";
+                            Log(Log::Level::ERR) << idString << "Not server, disconnecting - " << (dataFrame ? "setDataFrame > onMetaData" : "onMetaData");
                             close();
                             return false;
                         }
                     }
-                    else if (command.asString() == "onMetaData" &&
-                             (argument1.getType() == amf::Node::Type::Dictionary ||
-                              argument1.getType() == amf::Node::Type::Object))
+                    else if (command == rtmp::Command::ON_TEXT_DATA)
                     {
-                        metaData = argument1;
-
-                        if (metaData.hasElement("audiocodecid"))
-                        {
-                            if (metaData["audiocodecid"].isNumber())
-                                Log(Log::Level::ALL) << "Audio codec: " << getAudioCodec(static_cast<AudioCodec>(metaData["audiocodecid"].asUInt32()));
-                            else if (metaData["audiocodecid"].isString())
-                                Log(Log::Level::ALL) << "Audio codec: " << metaData["audiocodecid"].asString();
-                        }
+                        amf::Node textData;
+                        reader.readNode(textData);
 
-                        if (metaData.hasElement("videocodecid"))
-                        {
-                            if (metaData["videocodecid"].isNumber())
-                                Log(Log::Level::ALL) << "Video codec: " << getVideoCodec(static_cast<VideoCodec>(metaData["videocodecid"].asUInt32()));
-                            else if (metaData["videocodecid"].isString())
-                                Log(Log::Level::ALL) << "Video codec: " << metaData["videocodecid"].asString();
-                        }
-
-                        // forward notify packet
                         if (stream)
                         {
-                            stream->sendMetaData(metaData);
-                            timeSinceLastData = 0;
-                        }
-                        else
-                        {
-                            Log(Log::Level::ERR) << idString << "Not server, disconnecting - onMetaData";
-                            close();
-                            return false;
-                        }
-                    }
-                    else if (command.asString() == "onTextData")
-                    {
-                        if (stream)
-                        {
-                            stream->sendTextData(packet.timestamp, argument1);
+                            stream->sendTextData(*this, packet.timestamp, textData);
                             timeSinceLastData = 0;
                         }
                         else
@@ -1005,6 +1463,7 @@ namespace relay
                 // only input can receive audio packets
                 if (direction == Direction::INPUT)
                 {
+                    if (Log::isEnabled(Log::Level::ALL))
                     {
                         Log log(Log::Level::ALL);
                         log << idString << "Received AUDIO_PACKET";
@@ -1012,6 +1471,7 @@ namespace relay
                     }
 
                     currentAudioBytes += packet.data.size();
+                    Metrics::add(metricsSeries, Metrics::Counter::RECEIVED_FRAMES);
                     timeSinceLastData = 0;
 
                     if (isCodecHeader(packet.data))
@@ -1020,11 +1480,11 @@ namespace relay
                         AudioCodec codec = static_cast<AudioCodec>((format & 0xf0) >> 4);
                         uint32_t channels = (format & 0x01) + 1;
                         uint32_t sampleSize = (format & 0x02) ? 2 : 1;
-                        Log(Log::Level::ALL) << "Codec: " << getAudioCodec(codec) << ", channels: " << channels << ", sampleSize: " << sampleSize * 8;
+                        LOG(Log::Level::ALL) << "Codec: " << getAudioCodec(codec) << ", channels: " << channels << ", sampleSize: " << sampleSize * 8;
 
                         if (stream)
                         {
-                            stream->sendAudioHeader(packet.data);
+                            stream->sendAudioHeader(*this, packet.data);
                         }
                         else
                         {
@@ -1038,7 +1498,7 @@ namespace relay
                         // forward audio packet
                         if (stream)
                         {
-                            stream->sendAudioFrame(packet.timestamp, packet.data);
+                            stream->sendAudioFrame(*this, packet.timestamp, packet.data);
                         }
                         else
                         {
@@ -1064,6 +1524,7 @@ namespace relay
                 {
                     VideoFrameType frameType = getVideoFrameType(packet.data);
 
+                    if (Log::isEnabled(Log::Level::ALL))
                     {
                         Log log(Log::Level::ALL);
                         log << idString << "Received VIDEO_PACKET";
@@ -1085,18 +1546,19 @@ namespace relay
                     }
 
                     currentVideoBytes += packet.data.size();
+                    Metrics::add(metricsSeries, Metrics::Counter::RECEIVED_FRAMES);
                     timeSinceLastData = 0;
 
                     if (isCodecHeader(packet.data))
                     {
                         uint8_t format = packet.data[0];
                         VideoCodec codec = static_cast<VideoCodec>(format & 0x0f);
-                        Log(Log::Level::ALL) << "Codec: " << getVideoCodec(codec);
+                        LOG(Log::Level::ALL) << "Codec: " << getVideoCodec(codec);
 
                         if (stream)
                         {
                             // do nothing if frameType is VideoFrameType::VIDEO_INFO
-                            if (frameType == VideoFrameType::KEY) stream->sendVideoHeader(packet.data);
+                            if (frameType == VideoFrameType::KEY) stream->sendVideoHeader(*this, packet.data);
                         }
                         else
                         {
@@ -1110,7 +1572,7 @@ namespace relay
                         // forward video packet
                         if (stream)
                         {
-                            stream->sendVideoFrame(packet.timestamp, packet.data, frameType);
+                            stream->sendVideoFrame(*this, packet.timestamp, packet.data, frameType);
                         }
                         else
                         {
@@ -1154,79 +1616,62 @@ namespace relay
                     }
                 }
 
-                amf::Node command;
+                if (Log::isEnabled(Log::Level::ALL)) dumpValues(idString + "Received INVOKE", packet.data, offset);
 
-                ret = command.decode(amf::Version::AMF0, packet.data, offset);
+                amf::Reader reader(packet.data, offset);
+                amf::StringView commandName;
+                double transactionId;
 
-                if (ret == 0)
+                if (!reader.readString(commandName) || !reader.readNumber(transactionId))
                 {
                     return false;
                 }
 
-                offset += ret;
-
-                {
-                    Log log(Log::Level::ALL);
-                    log << idString << "Received INVOKE, command: ";
-                    command.dump(log);
-                }
-
-                amf::Node transactionId;
+                rtmp::Command command = rtmp::getCommand(commandName.data, commandName.length);
 
-                ret = transactionId.decode(amf::Version::AMF0, packet.data, offset);
+                // the command object, only connect has one and only two of its fields are used
+                amf::StringView app;
+                double objectEncoding = 0.0;
+                bool hasObjectEncoding = false;
 
-                if (ret == 0)
+                if (reader.readObject())
                 {
-                    return false;
-                }
+                    amf::StringView key;
 
-                offset += ret;
-
-                {
-                    Log log(Log::Level::ALL);
-                    log << idString << "Transaction ID: ";
-                    transactionId.dump(log);
+                    while (reader.readKey(key))
+                    {
+                        if (key == "app" && reader.readString(app)) continue;
+                        if (key == "objectEncoding" && reader.readNumber(objectEncoding)) { hasObjectEncoding = true; continue; }
+                        if (!reader.skip()) return false;
+                    }
                 }
-
-                amf::Node argument1;
-
-                if ((ret = argument1.decode(amf::Version::AMF0, packet.data, offset)) > 0)
+                else
                 {
-                    offset += ret;
-
-                    Log log(Log::Level::ALL);
-                    log << idString << "Argument 1: ";
-                    argument1.dump(log);
+                    reader.skip();
                 }
 
-                if (command.asString() == "connect")
+                if (command == rtmp::Command::CONNECT)
                 {
                     if (type == Type::HOST)
                     {
-                        applicationName = argument1["app"].asString();
+                        applicationName = app.str();
 
-                        if (argument1.hasElement("objectEncoding"))
+                        if (hasObjectEncoding)
                         {
-                            amfVersion = (argument1["objectEncoding"].asDouble() == 3.0) ? amf::Version::AMF3 : amf::Version::AMF0;
+                            amfVersion = (objectEncoding == 3.0) ? amf::Version::AMF3 : amf::Version::AMF0;
                         }
 
                         sendServerBandwidth();
                         sendClientBandwidth();
                         sendUserControl(rtmp::UserControlType::CLEAR_STREAM);
                         sendSetChunkSize();
-                        sendConnectResult(transactionId.asDouble());
+                        sendConnectResult(transactionId);
                         sendOnBWDone();
 
                         connected = true;
 
                         updateIdString();
-                        Log(Log::Level::INFO) << idString << "Input from " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort() << " sent connect, application: \"" << argument1["app"].asString() << "\"";
-
-#ifdef DEBUG
-                        Log log(Log::Level::ALL);
-                        log << "Connect argument: ";
-                        argument1.dump(log);
-#endif
+                        Log(Log::Level::INFO) << idString << "Input from " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort() << " sent connect, application: \"" << applicationName << "\"";
                     }
                     else
                     {
@@ -1235,7 +1680,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "onBWDone")
+                else if (command == rtmp::Command::ON_BW_DONE)
                 {
                     if (type == Type::CLIENT)
                     {
@@ -1248,11 +1693,11 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "_checkbw")
+                else if (command == rtmp::Command::CHECK_BW)
                 {
                     if (type == Type::HOST)
                     {
-                        sendCheckBWResult(transactionId.asDouble());
+                        sendCheckBWResult(transactionId);
                     }
                     else
                     {
@@ -1261,11 +1706,11 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "createStream")
+                else if (command == rtmp::Command::CREATE_STREAM)
                 {
                     if (type == Type::HOST)
                     {
-                        sendCreateStreamResult(transactionId.asDouble());
+                        sendCreateStreamResult(transactionId);
                     }
                     else
                     {
@@ -1274,11 +1719,11 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "releaseStream")
+                else if (command == rtmp::Command::RELEASE_STREAM)
                 {
                     if (type == Type::HOST)
                     {
-                        sendReleaseStreamResult(transactionId.asDouble());
+                        sendReleaseStreamResult(transactionId);
                     }
                     else
                     {
@@ -1287,7 +1732,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "deleteStream")
+                else if (command == rtmp::Command::DELETE_STREAM)
                 {
                     if (type == Type::HOST)
                     {
@@ -1303,7 +1748,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "FCPublish")
+                else if (command == rtmp::Command::FC_PUBLISH)
                 {
                     if (direction == Direction::NONE ||
                         direction == Direction::INPUT)
@@ -1317,10 +1762,10 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "onFCPublish")
+                else if (command == rtmp::Command::ON_FC_PUBLISH)
                 {
                 }
-                else if (command.asString() == "FCUnpublish")
+                else if (command == rtmp::Command::FC_UNPUBLISH)
                 {
                     if (direction == Direction::INPUT)
                     {
@@ -1338,7 +1783,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "onFCUnpublish")
+                else if (command == rtmp::Command::ON_FC_UNPUBLISH)
                 {
                     if (direction == Direction::INPUT)
                     {
@@ -1352,7 +1797,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "FCSubscribe")
+                else if (command == rtmp::Command::FC_SUBSCRIBE)
                 {
                     if (direction == Direction::NONE ||
                         direction == Direction::OUTPUT)
@@ -1366,28 +1811,20 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "onFCSubscribe")
+                else if (command == rtmp::Command::ON_FC_SUBSCRIBE)
                 {
                 }
-                else if (command.asString() == "publish")
+                else if (command == rtmp::Command::PUBLISH)
                 {
                     if (direction == Direction::NONE ||
                         direction == Direction::INPUT)
                     {
                         direction = Direction::INPUT;
 
-                        amf::Node argument2;
+                        amf::StringView name;
+                        reader.readString(name);
 
-                        if ((ret = argument2.decode(amf::Version::AMF0, packet.data, offset)) > 0)
-                        {
-                            offset += ret;
-
-                            Log log(Log::Level::ALL);
-                            log << idString << "Argument 2: ";
-                            argument2.dump(log);
-                        }
-
-                        streamName = argument2.asString();
+                        streamName = name.str();
                         updateIdString();
 
                         std::vector<std::pair<Server*, const Endpoint*>> endpoints = relay.getEndpoints(std::make_pair(socket.getLocalIPAddress(), socket.getLocalPort()), direction, applicationName, streamName);
@@ -1396,9 +1833,11 @@ namespace relay
                         {
                             Server* server = endpoints.front().first;
                             endpoint = endpoints.front().second;
+                            socket.setReadRate(endpoint->maxIngestRate);
+                            socket.setOptions(endpoint->socketOptions);
 
                             sendUserControl(rtmp::UserControlType::CLEAR_STREAM);
-                            sendPublishStatus(transactionId.asDouble());
+                            sendPublishStatus(transactionId);
 
                             pingInterval = endpoint->pingInterval;
 
@@ -1407,7 +1846,8 @@ namespace relay
                             {
                                 newStream = server->createStream(applicationName, streamName);
                             }
-                            else if (newStream->getInputConnection() && newStream->getInputConnection() != this)
+                            else if (newStream->getInputConnection() && newStream->getInputConnection() != this &&
+                                     !newStream->canAddBackupInput(*this))
                             {
                                 Log(Log::Level::WARN) << idString << "Stream \"" << applicationName << "/" << streamName << "\" already has input, disconnecting " << newStream->getInputConnection()->getId();
                                 close(true);
@@ -1435,7 +1875,7 @@ namespace relay
                         return false;
                     }
                 }
-                else if (command.asString() == "unpublish")
+                else if (command == rtmp::Command::UNPUBLISH)
                 {
                     if (direction != Direction::INPUT)
                     {
@@ -1447,10 +1887,10 @@ namespace relay
 
                     Log(Log::Level::INFO) << idString << "Input from " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort() << " unpublished stream \"" << streamName << "\"";
 
-                    sendUnublishStatus(transactionId.asDouble());
+                    sendUnublishStatus(transactionId);
                     close();
                 }
-                else if (command.asString() == "play")
+                else if (command == rtmp::Command::PLAY)
                 {
                     if (direction == Direction::INPUT)
                     {
@@ -1462,20 +1902,12 @@ namespace relay
 
                     direction = Direction::OUTPUT;
 
-                    amf::Node argument2;
-
-                    if ((ret = argument2.decode(amf::Version::AMF0, packet.data, offset)) > 0)
-                    {
-                        offset += ret;
-
-                        Log log(Log::Level::ALL);
-                        log << idString << "Argument 2: ";
-                        argument2.dump(log);
-                    }
+                    amf::StringView name;
+                    reader.readString(name);
 
-                    Log(Log::Level::INFO) << idString << "Input from " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort() << " sent play, stream: \"" << argument2.asString() << "\"";
+                    streamName = name.str();
 
-                    streamName = argument2.asString();
+                    Log(Log::Level::INFO) << idString << "Input from " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort() << " sent play, stream: \"" << streamName << "\"";
                     updateIdString();
 
                     std::vector<std::pair<Server*, const Endpoint*>> endpoints = relay.getEndpoints(std::make_pair(socket.getLocalIPAddress(), socket.getLocalPort()), direction, applicationName, streamName);
@@ -1490,9 +1922,11 @@ namespace relay
 
                     Server* server = endpoints.front().first;
                     endpoint = endpoints.front().second;
+                    socket.setPacing(endpoint->pacingHeadroom);
+                    socket.setOptions(endpoint->socketOptions);
 
                     sendUserControl(rtmp::UserControlType::CLEAR_STREAM);
-                    sendPlayStatus(transactionId.asDouble());
+                    sendPlayStatus(transactionId);
 
                     Stream* newStream = server->findStream(applicationName, streamName);
                     if (!newStream) newStream = server->createStream(applicationName, streamName);
@@ -1501,7 +1935,7 @@ namespace relay
                     streaming = true;
                     stream->start(*this);
                 }
-                else if (command.asString() == "getStreamLength")
+                else if (command == rtmp::Command::GET_STREAM_LENGTH)
                 {
                     if (direction == Direction::INPUT)
                     {
@@ -1511,9 +1945,9 @@ namespace relay
                         return false;
                     }
 
-                    sendGetStreamLengthResult(transactionId.asDouble());
+                    sendGetStreamLengthResult(transactionId);
                 }
-                else if (command.asString() == "stop")
+                else if (command == rtmp::Command::STOP)
                 {
                     if (direction != Direction::OUTPUT)
                     {
@@ -1524,21 +1958,39 @@ namespace relay
 
                     close();
                 }
-                else if (command.asString() == "onStatus")
+                else if (command == rtmp::Command::ON_STATUS)
                 {
-                    amf::Node argument2;
+                    amf::StringView code;
+                    std::string amf3Code;
 
-                    if ((ret = argument2.decode((packet.messageType == rtmp::MessageType::AMF3_INVOKE) ? amf::Version::AMF3 : amf::Version::AMF0, packet.data, offset)) > 0)
+                    if (packet.messageType == rtmp::MessageType::AMF3_INVOKE)
                     {
-                        offset += ret;
+                        // the info object of AMF3 invokes is built with the node decoder, it is
+                        // either an AMF0 object or an AMF3 one after the switch marker
+                        amf::Node info;
 
-                        Log log(Log::Level::ALL);
-                        log << idString << "Argument 2: ";
-                        argument2.dump(log);
+                        if (reader.readNode(info, amf::Version::AMF0) &&
+                            (info.getType() == amf::Node::Type::Object || info.getType() == amf::Node::Type::Dictionary) &&
+                            info.hasElement("code") && info["code"].isString())
+                        {
+                            amf3Code = info["code"].asString();
+                            code.data = amf3Code.data();
+                            code.length = static_cast<uint32_t>(amf3Code.length());
+                        }
+                    }
+                    else if (reader.readObject())
+                    {
+                        amf::StringView key;
+
+                        while (reader.readKey(key))
+                        {
+                            if (key == "code" && reader.readString(code)) continue;
+                            if (!reader.skip()) break;
+                        }
                     }
 
                     // TODO: paarbaudiit - izskataas nepareizi
-                    if (argument2["code"].asString() == "NetStream.Publish.Start")
+                    if (code == "NetStream.Publish.Start")
                     {
                         if (direction != Direction::OUTPUT)
                         {
@@ -1557,7 +2009,7 @@ namespace relay
                         streaming = true;
                         stream->start(*this);
                     }
-                    else if (argument2["code"].asString() == "NetStream.Play.Start")
+                    else if (code == "NetStream.Play.Start")
                     {
                         if (direction != Direction::INPUT)
                         {
@@ -1574,7 +2026,8 @@ namespace relay
                         }
 
 
-                        if (stream->getInputConnection() && stream->getInputConnection() != this)
+                        if (stream->getInputConnection() && stream->getInputConnection() != this &&
+                            !stream->canAddBackupInput(*this))
                         {
                             Log(Log::Level::WARN) << idString << "Stream \"" << applicationName << "/" << streamName << "\" already has input, disconnecting";
                             close(true);
@@ -1586,50 +2039,43 @@ namespace relay
                     }
 
                 }
-                else if (command.asString() == "_error")
+                else if (command == rtmp::Command::CALL_ERROR)
                 {
-                    auto i = invokes.find(static_cast<uint32_t>(transactionId.asDouble()));
+                    auto i = invokes.find(static_cast<uint32_t>(transactionId));
 
                     if (i != invokes.end())
                     {
-                        Log(Log::Level::ALL) << idString << i->second << " error";
+                        LOG(Log::Level::ALL) << idString << i->second << " error";
 
                         invokes.erase(i);
                     }
+                    else if (Connection* carriedConnection = findCarriedConnection(static_cast<uint32_t>(transactionId)))
+                    {
+                        return carriedConnection->handlePacket(packet);
+                    }
                     else
                     {
-                        Log(Log::Level::ALL) << idString << i->second << "Invalid _error received";
+                        LOG(Log::Level::ALL) << idString << "Invalid _error received";
                     }
                 }
-                else if (command.asString() == "_result")
+                else if (command == rtmp::Command::CALL_RESULT)
                 {
-                    auto i = invokes.find(static_cast<uint32_t>(transactionId.asDouble()));
+                    auto i = invokes.find(static_cast<uint32_t>(transactionId));
 
                     if (i != invokes.end())
                     {
-                        Log(Log::Level::ALL) << idString << i->second << " result";
+                        LOG(Log::Level::ALL) << idString << i->second << " result";
 
                         if (i->second == "connect")
                         {
                             connected = true;
 
-                            if (!streamName.empty())
-                            {
-                                if (direction == Direction::OUTPUT)
-                                {
-                                    Log(Log::Level::ALL) << idString << "Publishing stream " << streamName;
-
-                                    sendReleaseStream();
-                                    sendFCPublish();
-                                }
-                                else if (direction == Direction::INPUT)
-                                {
-                                    Log(Log::Level::ALL) << idString << "Subscribing to stream " << streamName;
-
-                                    sendFCSubscribe();
-                                }
+                            startStream();
 
-                                sendCreateStream();
+                            // start the streams that share this connection
+                            for (Connection* carriedConnection : carriedConnections)
+                            {
+                                carriedConnection->connect();
                             }
                         }
                         else if (i->second == "_checkbw")
@@ -1640,18 +2086,10 @@ namespace relay
                         }
                         else if (i->second == "createStream")
                         {
-                            amf::Node argument2;
-
-                            if ((ret = argument2.decode(amf::Version::AMF0, packet.data, offset)) > 0)
-                            {
-                                offset += ret;
+                            double newStreamId = 0.0;
+                            reader.readNumber(newStreamId);
 
-                                Log log(Log::Level::ALL);
-                                log << idString << "Argument 2: ";
-                                argument2.dump(log);
-                            }
-
-                            streamId = static_cast<uint32_t>(argument2.asDouble());
+                            streamId = static_cast<uint32_t>(newStreamId);
 
                             if (direction == Direction::INPUT)
                             {
@@ -1664,7 +2102,7 @@ namespace relay
                                 sendPublish();
                             }
 
-                            Log(Log::Level::ALL) << idString << "Created stream " << streamId;
+                            LOG(Log::Level::ALL) << idString << "Created stream " << streamId;
                         }
                         else if (i->second == "deleteStream")
                         {
@@ -1672,9 +2110,13 @@ namespace relay
 
                         invokes.erase(i);
                     }
+                    else if (Connection* carriedConnection = findCarriedConnection(static_cast<uint32_t>(transactionId)))
+                    {
+                        return carriedConnection->handlePacket(packet);
+                    }
                     else
                     {
-                        Log(Log::Level::ALL) << idString << "Invalid _result received, transaction ID: " << static_cast<uint32_t>(transactionId.asDouble());
+                        LOG(Log::Level::ALL) << idString << "Invalid _result received, transaction ID: " << static_cast<uint32_t>(transactionId);
                     }
                 }
                 break;
@@ -1683,23 +2125,136 @@ namespace relay
             case rtmp::MessageType::AMF0_SHARED_OBJECT:
             case rtmp::MessageType::AMF3_SHARED_OBJECT:
             {
-                Log(Log::Level::ALL) << idString << "Received shared object";
+                LOG(Log::Level::ALL) << idString << "Received shared object";
                 break;
             }
 
             case rtmp::MessageType::AGGREGATE:
             {
-                Log(Log::Level::ALL) << idString << "Received aggregated messages";
+                LOG(Log::Level::ALL) << idString << "Received aggregated messages";
+                break;
+            }
+
+            default:
+            {
+                Log(Log::Level::ERR) << idString << "Unhandled message: " << static_cast<uint32_t>(packet.messageType);
                 break;
             }
+        }
+
+        return true;
+    }
+
+    void Connection::takeFromPool(Stream& newStream)
+    {
+        pooled = false;
+        setStream(&newStream);
+
+        Log(Log::Level::INFO) << idString << "Taken from the connection pool";
+
+        // otherwise the stream is published once connect completes
+        if (connected) startStream();
+    }
+
+    void Connection::startStream()
+    {
+        if (streamName.empty()) return;
+
+        if (direction == Direction::OUTPUT)
+        {
+            LOG(Log::Level::ALL) << idString << "Publishing stream " << streamName;
+
+            sendReleaseStream();
+            sendFCPublish();
+        }
+        else if (direction == Direction::INPUT)
+        {
+            LOG(Log::Level::ALL) << idString << "Subscribing to stream " << streamName;
+
+            sendFCSubscribe();
+        }
+
+        sendCreateStream();
+    }
+
+    void Connection::addCarriedConnection(Connection& connection)
+    {
+        // every stream gets its own audio, video and data chunk streams, packed densely so
+        // that they stay in the two byte basic header form as long as possible
+        uint32_t channelBase = CARRIED_CHANNEL_BASE;
+        bool used = true;
+
+        while (used)
+        {
+            used = false;
+
+            for (Connection* carriedConnection : carriedConnections)
+            {
+                if (carriedConnection->channelBase == channelBase) used = true;
+            }
+
+            if (used) channelBase += CHANNELS_PER_STREAM;
+        }
+
+        connection.carrier = this;
+        connection.channelBase = channelBase;
+        carriedConnections.push_back(&connection);
+
+        Log(Log::Level::INFO) << connection.idString << "Sharing connection " << id << " (" << static_cast<uint32_t>(carriedConnections.size()) << " stream(s))";
+    }
+
+    void Connection::removeCarriedConnection(Connection& connection)
+    {
+        auto i = std::find(carriedConnections.begin(), carriedConnections.end(), &connection);
+        if (i != carriedConnections.end()) carriedConnections.erase(i);
+
+        connection.carrier = nullptr;
+    }
+
+    Connection* Connection::findCarriedConnection(uint32_t transactionId) const
+    {
+        for (Connection* carriedConnection : carriedConnections)
+        {
+            if (carriedConnection->invokes.find(transactionId) != carriedConnection->invokes.end())
+            {
+                return carriedConnection;
+            }
+        }
+
+        return nullptr;
+    }
+
+    uint32_t Connection::nextInvokeId()
+    {
+        // transaction IDs have to be unique on the shared connection
+        invokeId = carrier ? ++carrier->invokeId : invokeId + 1;
+
+        return invokeId;
+    }
+
+    bool Connection::sendPacket(rtmp::Packet& packet)
+    {
+        if (carrier)
+        {
+            if (packet.channel == rtmp::Channel::AUDIO) packet.channel = channelBase;
+            else if (packet.channel == rtmp::Channel::VIDEO) packet.channel = channelBase + 1;
+            else if (packet.channel > rtmp::Channel::SYSTEM) packet.channel = channelBase + 2;
 
-            default:
-            {
-                Log(Log::Level::ERR) << idString << "Unhandled message: " << static_cast<uint32_t>(packet.messageType);
-                break;
-            }
+            return carrier->writePacket(packet, metricsSeries);
         }
 
+        return writePacket(packet, metricsSeries);
+    }
+
+    bool Connection::writePacket(rtmp::Packet& packet, uint32_t series)
+    {
+        std::vector<uint8_t> buffer;
+        packet.encode(buffer, outChunkSize, sentPackets);
+
+        if (!socket.send(buffer)) return false;
+
+        Metrics::add(series, Metrics::Counter::SENT_BYTES, buffer.size());
+
         return true;
     }
 
@@ -1778,12 +2333,9 @@ namespace relay
 
         encodeIntBE(packet.data, 4, serverBandwidth);
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending SERVER_BANDWIDTH";
+        LOG(Log::Level::ALL) << idString << "Sending SERVER_BANDWIDTH";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendClientBandwidth()
@@ -1796,12 +2348,9 @@ namespace relay
         encodeIntBE(packet.data, 4, serverBandwidth);
         encodeIntBE(packet.data, 1, 2); // dynamic
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending CLIENT_BANDWIDTH";
+        LOG(Log::Level::ALL) << idString << "Sending CLIENT_BANDWIDTH";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendUserControl(rtmp::UserControlType userControlType, uint64_t timestamp, uint32_t parameter1, uint32_t parameter2)
@@ -1815,26 +2364,26 @@ namespace relay
         encodeIntBE(packet.data, 4, parameter1); // parameter 1
         if (parameter2 != 0) encodeIntBE(packet.data, 4, parameter2); // parameter 2
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        if (Log::isEnabled(Log::Level::ALL))
+        {
+            Log log(Log::Level::ALL);
+            log << idString << "Sending USER_CONTROL of type: ";
 
-        Log log(Log::Level::ALL);
-        log << idString << "Sending USER_CONTROL of type: ";
+            switch (userControlType)
+            {
+                case rtmp::UserControlType::CLEAR_STREAM: log << "CLEAR_STREAM"; break;
+                case rtmp::UserControlType::CLEAR_BUFFER: log << "CLEAR_BUFFER"; break;
+                case rtmp::UserControlType::CLIENT_BUFFER_TIME: log << "CLIENT_BUFFER_TIME"; break;
+                case rtmp::UserControlType::RESET_STREAM: log << "RESET_STREAM"; break;
+                case rtmp::UserControlType::PING: log << "PING"; break;
+                case rtmp::UserControlType::PONG: log << "PONG"; break;
+            }
 
-        switch (userControlType)
-        {
-            case rtmp::UserControlType::CLEAR_STREAM: log << "CLEAR_STREAM"; break;
-            case rtmp::UserControlType::CLEAR_BUFFER: log << "CLEAR_BUFFER"; break;
-            case rtmp::UserControlType::CLIENT_BUFFER_TIME: log << "CLIENT_BUFFER_TIME"; break;
-            case rtmp::UserControlType::RESET_STREAM: log << "RESET_STREAM"; break;
-            case rtmp::UserControlType::PING: log << "PING"; break;
-            case rtmp::UserControlType::PONG: log << "PONG"; break;
+            log << ", parameter 1: " << parameter1;
+            if (parameter2 != 0) log << ", parameter 2: " << parameter2;
         }
 
-        log << ", parameter 1: " << parameter1;
-        if (parameter2 != 0) log << ", parameter 2: " << parameter2;
-
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendSetChunkSize()
@@ -1846,12 +2395,9 @@ namespace relay
 
         encodeIntBE(packet.data, 4, outChunkSize);
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending SET_CHUNK_SIZE";
+        LOG(Log::Level::ALL) << idString << "Sending SET_CHUNK_SIZE";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendOnBWDone()
@@ -1870,26 +2416,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onBWDone");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        ON_BW_DONE.encode(packet.data, {static_cast<double>(nextInvokeId())});
 
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onBWDone, transaction ID: " << invokeId;
 
-        amf::Node argument2 = 0.0;
-        argument2.encode(amf::Version::AMF0, packet.data);
+        if (!sendPacket(packet)) return false;
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
-
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "onBWDone";
 
         return true;
     }
@@ -1910,23 +2443,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_checkbw");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        CHECK_BW.encode(packet.data, {static_cast<double>(nextInvokeId())});
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _checkbw, transaction ID: " << invokeId;
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "_checkbw";
 
         return true;
     }
@@ -1947,21 +2470,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_result");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        RESULT.encode(packet.data, {transactionId});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _result";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendCreateStream()
@@ -1980,23 +2493,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("createStream");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        CREATE_STREAM.encode(packet.data, {static_cast<double>(nextInvokeId())});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE createStream, transaction ID: " << invokeId;
 
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "createStream";
 
         return true;
     }
@@ -2017,30 +2520,17 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_result");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
         ++streamId;
         if (streamId == 0 || streamId == 2) // streams 0 and 2 are reserved
         {
             ++streamId;
         }
 
-        amf::Node argument2 = static_cast<double>(streamId);
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        RESULT_NUMBER.encode(packet.data, {transactionId, static_cast<double>(streamId)});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _result";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendReleaseStream()
@@ -2059,26 +2549,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("releaseStream");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
+        RELEASE_STREAM.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE releaseStream, transaction ID: " << invokeId;
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "releaseStream";
 
         return true;
     }
@@ -2099,21 +2576,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_result");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        RESULT.encode(packet.data, {transactionId});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _result";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendDeleteStream()
@@ -2132,26 +2599,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("deleteStream");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = static_cast<double>(streamId);
-        argument2.encode(amf::Version::AMF0, packet.data);
+        DELETE_STREAM.encode(packet.data, {static_cast<double>(nextInvokeId()), static_cast<double>(streamId)});
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE deleteStream, transaction ID: " << invokeId;
         
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
         
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "deleteStream";
 
         return true;
     }
@@ -2174,29 +2628,16 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("connect");
-        commandName.encode(amf::Version::AMF0, packet.data);
+        CONNECT.encode(packet.data, {static_cast<double>(nextInvokeId()),
+                                     applicationName,
+                                     (amfVersion == amf::Version::AMF3) ? 3.0 : 0.0,
+                                     "rtmp://" + endpoint->addresses[addressIndex].url + "/" + applicationName});
 
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE connect, transaction ID: " << invokeId;
 
-        amf::Node argument1;
-        argument1["app"] = applicationName;
-        argument1["type"] = std::string("nonprivate");
-        argument1["flashVer"] = std::string("FMLE/3.0 (compatible; Lavf56.16.0)");
-        argument1["tcUrl"] = "rtmp://" + endpoint->addresses[addressIndex].url + "/" + applicationName;
-        argument1["objectEncoding"] = (amfVersion == amf::Version::AMF3) ? 3.0 : 0.0;
+        if (!sendPacket(packet)) return false;
 
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
-
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "connect";
         timeSinceLastData = 0;
 
         return true;
@@ -2218,32 +2659,12 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_result");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        CONNECT_RESULT.encode(packet.data, {transactionId, (amfVersion == amf::Version::AMF3) ? 3.0 : 0.0});
 
-        amf::Node argument1;
-        argument1["fmsVer"] = std::string("FMS/3,5,7,7009");
-        argument1["capabilities"] = 31.0;
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["level"] = std::string("status");
-        argument2["code"] = std::string("NetConnection.Connect.Success");
-        argument2["description"] = std::string("Connection succeeded.");
-        argument2["objectEncoding"] = (amfVersion == amf::Version::AMF3) ? 3.0 : 0.0;
-
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _result";
 
         timeSinceLastData = 0;
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendFCPublish()
@@ -2262,26 +2683,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("FCPublish");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        FC_PUBLISH.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE FCPublish, transaction ID: " << invokeId;
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "FCPublish";
 
         return true;
     }
@@ -2302,15 +2710,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onFCPublish");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        ON_FC_PUBLISH.encode(packet.data);
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onFCPublish";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendFCUnpublish()
@@ -2329,26 +2733,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("FCUnpublish");
-        commandName.encode(amf::Version::AMF0, packet.data);
+        FC_UNPUBLISH.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE FCUnpublish, transaction ID: " << invokeId;
 
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        if (!sendPacket(packet)) return false;
 
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
-
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "FCUnpublish";
 
         close();
 
@@ -2371,15 +2762,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onFCUnpublish");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        ON_FC_UNPUBLISH.encode(packet.data);
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onFCUnpublish";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendFCSubscribe()
@@ -2398,26 +2785,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("FCSubscribe");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        FC_SUBSCRIBE.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE FCSubscribe, transaction ID: " << invokeId;
 
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "FCSubscribe";
 
         return true;
     }
@@ -2438,25 +2812,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onFCSubscribe");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["clientid"] = std::string("Lavf57.1.0");
-        argument2["code"] = std::string("NetStream.Play.Start");
-        argument2["description"] = "Subscribed to " + streamName;
-        argument2["level"] = std::string("status");
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        ON_FC_SUBSCRIBE.encode(packet.data, {streamName});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onFCSubscribe";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendFCUnsubscribe()
@@ -2475,26 +2835,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("FCUnsubscribe");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        FC_UNSUBSCRIBE.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE FCUnsubscribe, transaction ID: " << invokeId;
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "FCUnsubscribe";
 
         return true;
     }
@@ -2515,15 +2862,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onFCUnsubscribe");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        ON_FC_UNSUBSCRIBE.encode(packet.data);
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onFCUnsubscribe";
 
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendPublish()
@@ -2543,29 +2886,13 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("publish");
-        commandName.encode(amf::Version::AMF0, packet.data);
+        PUBLISH.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE publish, transaction ID: " << invokeId;
 
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument3 = std::string("live");
-        argument3.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString() << ", transaction ID: " << invokeId;
-
-        if (!socket.send(buffer)) return false;
+        if (!sendPacket(packet)) return false;
 
-        invokes[invokeId] = commandName.asString();
+        invokes[invokeId] = "publish";
 
         Log(Log::Level::INFO) << idString << "Published stream \"" << streamName << "\" (ID: " << streamId << ") to " << ipToString(socket.getRemoteIPAddress()) << ":" << socket.getRemotePort();
 
@@ -2589,29 +2916,28 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onStatus");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["clientid"] = std::string("Lavf57.1.0");
-        argument2["code"] = std::string("NetStream.Publish.Start");
-        argument2["description"] = streamName + " is now published";
-        argument2["details"] = streamName;
-        argument2["level"] = std::string("status");
-        argument2.encode((amfVersion == amf::Version::AMF3) ? amf::Version::AMF3 : amf::Version::AMF0, packet.data);
+        if (amfVersion == amf::Version::AMF0)
+        {
+            PUBLISH_STATUS.encode(packet.data, {transactionId, streamName, streamName});
+        }
+        else
+        {
+            // the status object is the only value encoded as AMF3
+            ON_STATUS.encode(packet.data, {transactionId});
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+            amf::Node argument2;
+            argument2["clientid"] = std::string("Lavf57.1.0");
+            argument2["code"] = std::string("NetStream.Publish.Start");
+            argument2["description"] = streamName + " is now published";
+            argument2["details"] = streamName;
+            argument2["level"] = std::string("status");
+            packet.data.push_back(static_cast<uint8_t>(amf::AMF0Marker::SwitchToAMF3));
+            argument2.encode(amf::Version::AMF3, packet.data);
+        }
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onStatus";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendUnublishStatus(double transactionId)
@@ -2630,29 +2956,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onStatus");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["clientid"] = std::string("Lavf57.1.0");
-        argument2["code"] = std::string("NetStream.Unpublish.Success");
-        argument2["description"] = streamName + " stopped publishing";
-        argument2["details"] = streamName;
-        argument2["level"] = std::string("status");
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        UNPUBLISH_STATUS.encode(packet.data, {transactionId, streamName, streamName});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onStatus";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendAudioHeader(const std::vector<uint8_t>& headerData)
@@ -2694,76 +3002,136 @@ namespace relay
             return sendVideoData(timestamp, frameData);
         }
 
+        // the output starts at a key frame
+        if (endpoint->videoStream) Metrics::add(metricsSeries, Metrics::Counter::DROPPED_FRAMES);
+
         return true;
     }
 
-    bool Connection::sendMetaData(const amf::Node& newMetaData)
+    bool Connection::isMetaDataFiltered(const std::string& key) const
     {
-        if (state != State::HANDSHAKE_DONE) return false;
+        // not in the blacklist
+        if (endpoint->metaDataBlacklist.find(key) != endpoint->metaDataBlacklist.end()) return true;
+
+        // don't send audio meta data if audio stream is disabled
+        if (!endpoint->audioStream && (key == "audiocodecid" ||
+                                       key == "audiodatarate")) return true;
+
+        // don't send video meta data if video stream is disabled
+        if (!endpoint->videoStream && (key == "fps" ||
+                                       key == "framerate" ||
+                                       key == "gopsize" ||
+                                       key == "level" ||
+                                       key == "profile" ||
+                                       key == "videocodecid" ||
+                                       key == "videodatarate")) return true;
+
+        return false;
+    }
 
-        if (!endpoint) return false;
+    std::string Connection::getMetaDataProfile() const
+    {
+        std::string profile = (amfVersion == amf::Version::AMF3) ? "amf3" : "amf0";
 
-        if (newMetaData.getType() == amf::Node::Type::Dictionary ||
-            newMetaData.getType() == amf::Node::Type::Object)
+        if (endpoint)
         {
-            metaData = amf::Node::Type::Dictionary;
+            profile += endpoint->audioStream ? " audio" : " -";
+            profile += endpoint->videoStream ? " video" : " -";
 
-            for (const std::pair<std::string, amf::Node>& value : newMetaData.asMap())
+            for (const std::string& key : endpoint->metaDataBlacklist)
             {
-                // not in the blacklist
-                if (endpoint->metaDataBlacklist.find(value.first) != endpoint->metaDataBlacklist.end()) continue;
-
-                // don't send audio meta data if audio stream is disabled
-                if (!endpoint->audioStream && (value.first == "audiocodecid" ||
-                                               value.first == "audiodatarate")) continue;
-
-                // don't send video meta data if video stream is disabled
-                if (!endpoint->videoStream && (value.first == "fps" ||
-                                               value.first == "framerate" ||
-                                               value.first == "gopsize" ||
-                                               value.first == "level" ||
-                                               value.first == "profile" ||
-                                               value.first == "videocodecid" ||
-                                               value.first == "videodatarate")) continue;
-
-                metaData[value.first] = value.second;
+                profile.push_back('\0');
+                profile += key;
             }
+        }
 
-            rtmp::Packet packet;
-            packet.channel = rtmp::Channel::AUDIO;
-            packet.messageStreamId = streamId;
-            packet.timestamp = 0;
+        return profile;
+    }
 
-            if (amfVersion == amf::Version::AMF0)
+    amf::Node Connection::filterMetaData(const amf::Node& newMetaData) const
+    {
+        if (!endpoint ||
+            (newMetaData.getType() != amf::Node::Type::Dictionary &&
+             newMetaData.getType() != amf::Node::Type::Object))
+        {
+            return newMetaData;
+        }
+
+        bool filtered = false;
+
+        for (const amf::Node::Member& value : newMetaData.asObject())
+        {
+            if (isMetaDataFiltered(value.first))
             {
-                packet.messageType = rtmp::MessageType::AMF0_DATA;
+                filtered = true;
+                break;
             }
-            else if (amfVersion == amf::Version::AMF3)
+        }
+
+        amf::Node result;
+
+        if (filtered)
+        {
+            result = amf::Node::Type::Dictionary;
+
+            for (const amf::Node::Member& value : newMetaData.asObject())
             {
-                packet.messageType = rtmp::MessageType::AMF3_DATA;
-                packet.data.push_back(0); // using AMF0
+                if (!isMetaDataFiltered(value.first)) result[value.first] = value.second;
             }
+        }
+        else
+        {
+            // share the values with the stream instead of copying them
+            result = newMetaData;
+            result.setType(amf::Node::Type::Dictionary);
+        }
 
-            amf::Node commandName = std::string("@setDataFrame");
-            commandName.encode(amf::Version::AMF0, packet.data);
+        return result;
+    }
 
-            amf::Node argument1 = std::string("onMetaData");
-            argument1.encode(amf::Version::AMF0, packet.data);
+    void Connection::encodeMetaData(const amf::Node& filteredMetaData, std::vector<uint8_t>& data) const
+    {
+        if (amfVersion == amf::Version::AMF3)
+        {
+            data.push_back(0); // using AMF0
+        }
+
+        amf::Node commandName = std::string("@setDataFrame");
+        commandName.encode(amf::Version::AMF0, data);
+
+        amf::Node argument1 = std::string("onMetaData");
+        argument1.encode(amf::Version::AMF0, data);
+
+        filteredMetaData.encode(amf::Version::AMF0, data);
+    }
+
+    bool Connection::sendMetaData(const amf::Node& filteredMetaData, const std::vector<uint8_t>& data)
+    {
+        if (state != State::HANDSHAKE_DONE) return false;
+
+        if (!endpoint) return false;
 
-            amf::Node argument2 = metaData;
-            argument2.encode(amf::Version::AMF0, packet.data);
+        if (filteredMetaData.getType() == amf::Node::Type::Dictionary ||
+            filteredMetaData.getType() == amf::Node::Type::Object)
+        {
+            metaData = filteredMetaData;
 
-            std::vector<uint8_t> buffer;
-            packet.encode(buffer, outChunkSize, sentPackets);
+            rtmp::Packet packet;
+            packet.channel = rtmp::Channel::AUDIO;
+            packet.messageStreamId = streamId;
+            packet.timestamp = 0;
+            packet.messageType = (amfVersion == amf::Version::AMF3) ? rtmp::MessageType::AMF3_DATA : rtmp::MessageType::AMF0_DATA;
+            packet.data = data;
 
+            if (Log::isEnabled(Log::Level::ALL))
             {
                 Log log(Log::Level::ALL);
-                log << idString << "Sending meta data " << commandName.asString() << ": ";
-                argument2.dump(log);
+                log << idString << "Sending meta data @setDataFrame: ";
+                metaData.dump(log);
             }
 
             timeSinceLastData = 0;
-            return socket.send(buffer);
+            return sendPacket(packet);
         }
 
         return true;
@@ -2796,9 +3164,7 @@ namespace relay
             amf::Node argument1 = textData;
             argument1.encode(amf::Version::AMF0, packet.data);
 
-            std::vector<uint8_t> buffer;
-            packet.encode(buffer, outChunkSize, sentPackets);
-
+            if (Log::isEnabled(Log::Level::ALL))
             {
                 Log log(Log::Level::ALL);
                 log << idString << "Sending text data: ";
@@ -2806,7 +3172,7 @@ namespace relay
             }
 
             timeSinceLastData = 0;
-            return socket.send(buffer);
+            return sendPacket(packet);
         }
 
         return true;
@@ -2828,24 +3194,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("getStreamLength");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        GET_STREAM_LENGTH.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE getStreamLength";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendGetStreamLengthResult(double transactionId)
@@ -2864,24 +3217,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("_result");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = 0.0;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        RESULT_NUMBER.encode(packet.data, {transactionId, 0.0});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE _result";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendPlay()
@@ -2901,25 +3241,12 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("play");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        PLAY.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE play";
 
         timeSinceLastData = 0;
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendPlayStatus(double transactionId)
@@ -2938,29 +3265,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onStatus");
-        commandName.encode(amf::Version::AMF0, packet.data);
+        PLAY_STATUS.encode(packet.data, {transactionId, streamName, streamName});
 
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onStatus";
 
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["clientid"] = std::string("Lavf57.1.0");
-        argument2["code"] = std::string("NetStream.Play.Start");
-        argument2["description"] = streamName + " is now playing";
-        argument2["details"] = streamName;
-        argument2["level"] = std::string("status");
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
-
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendStop()
@@ -2979,24 +3288,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("stop");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = static_cast<double>(++invokeId);
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
+        STOP.encode(packet.data, {static_cast<double>(nextInvokeId()), streamName});
 
-        amf::Node argument2 = streamName;
-        argument2.encode(amf::Version::AMF0, packet.data);
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE stop";
 
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
-
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
-
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendStopStatus(double transactionId)
@@ -3015,29 +3311,11 @@ namespace relay
             packet.data.push_back(0); // using AMF0
         }
 
-        amf::Node commandName = std::string("onStatus");
-        commandName.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node transactionIdNode = transactionId;
-        transactionIdNode.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument1(amf::Node::Type::Null);
-        argument1.encode(amf::Version::AMF0, packet.data);
-
-        amf::Node argument2;
-        argument2["clientid"] = std::string("Lavf57.1.0");
-        argument2["code"] = std::string("NetStream.Play.Stop");
-        argument2["description"] = streamName + " is now stopped";
-        argument2["details"] = streamName;
-        argument2["level"] = std::string("status");
-        argument2.encode(amf::Version::AMF0, packet.data);
-
-        std::vector<uint8_t> buffer;
-        packet.encode(buffer, outChunkSize, sentPackets);
+        STOP_STATUS.encode(packet.data, {transactionId, streamName, streamName});
 
-        Log(Log::Level::ALL) << idString << "Sending INVOKE " << commandName.asString();
+        LOG(Log::Level::ALL) << idString << "Sending INVOKE onStatus";
         
-        return socket.send(buffer);
+        return sendPacket(packet);
     }
 
     bool Connection::sendAudioData(uint64_t timestamp, const std::vector<uint8_t>& audioData)
@@ -3054,12 +3332,16 @@ namespace relay
 
             packet.data = audioData;
 
-            std::vector<uint8_t> buffer;
-            packet.encode(buffer, outChunkSize, sentPackets);
+            LOG(Log::Level::ALL) << idString << "Sending audio packet";
 
-            Log(Log::Level::ALL) << idString << "Sending audio packet";
+            if (!sendPacket(packet))
+            {
+                Metrics::add(metricsSeries, Metrics::Counter::DROPPED_FRAMES);
+                return false;
+            }
 
-            return socket.send(buffer);
+            Metrics::add(metricsSeries, Metrics::Counter::SENT_FRAMES);
+            return true;
         }
 
         return true;
@@ -3079,12 +3361,16 @@ namespace relay
 
             packet.data = videoData;
 
-            std::vector<uint8_t> buffer;
-            packet.encode(buffer, outChunkSize, sentPackets);
+            LOG(Log::Level::ALL) << idString << "Sending video packet";
 
-            Log(Log::Level::ALL) << idString << "Sending video packet";
-            
-            return socket.send(buffer);
+            if (!sendPacket(packet))
+            {
+                Metrics::add(metricsSeries, Metrics::Counter::DROPPED_FRAMES);
+                return false;
+            }
+
+            Metrics::add(metricsSeries, Metrics::Counter::SENT_FRAMES);
+            return true;
         }
 
         return true;
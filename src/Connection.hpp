@@ -4,7 +4,9 @@
 
 #pragma once
 
+#include <chrono>
 #include <map>
+#include <memory>
 #include <set>
 #include "Socket.hpp"
 #include "RTMP.hpp"
@@ -51,6 +53,10 @@ namespace relay
         Connection(Relay& aRelay,
                    Stream& aStream,
                    const Endpoint& aEndpoint);
+        // connection that connects before it has a stream (pooled or shared by several streams)
+        Connection(Relay& aRelay,
+                   const Endpoint& aEndpoint,
+                   const std::string& aApplicationName);
 
         Connection(const Connection&) = delete;
         Connection(Connection&&) = delete;
@@ -78,25 +84,66 @@ namespace relay
 
         void connect();
 
+        bool isPooled() const { return pooled; }
+        void setPooled(bool newPooled) { pooled = newPooled; }
+        void takeFromPool(Stream& newStream);
+        // a lost connection is not retried any more, used while the relay drains
+        void stopReconnecting() { reconnecting = false; }
+
+        // streams of a multiplexed endpoint publish over one shared connection
+        void addCarriedConnection(Connection& connection);
+        void removeCarriedConnection(Connection& connection);
+
         void setStream(Stream* aStream);
         Stream* getStream() { return stream; }
+        const Endpoint* getEndpoint() const { return endpoint; }
         void unpublishStream();
 
         bool sendAudioHeader(const std::vector<uint8_t>& headerData);
         bool sendVideoHeader(const std::vector<uint8_t>& headerData);
         bool sendAudioFrame(uint64_t timestamp, const std::vector<uint8_t>& frameData);
         bool sendVideoFrame(uint64_t timestamp, const std::vector<uint8_t>& frameData, VideoFrameType frameType);
-        bool sendMetaData(const amf::Node& newMetaData);
+        // outputs with the same meta data profile send the same meta data bytes, the stream
+        // filters and encodes the meta data once per profile
+        std::string getMetaDataProfile() const;
+        amf::Node filterMetaData(const amf::Node& newMetaData) const;
+        void encodeMetaData(const amf::Node& filteredMetaData, std::vector<uint8_t>& data) const;
+        bool sendMetaData(const amf::Node& filteredMetaData, const std::vector<uint8_t>& data);
         bool sendTextData(uint64_t timestamp, const amf::Node& textData);
 
         bool isDependable();
 
+        // bytes waiting to be written, multiplexed streams share the queue of their carrier
+        size_t getQueuedBytes() const { return carrier ? carrier->socket.getOutDataSize() : socket.getOutDataSize(); }
+        bool isCarried() const { return carrier != nullptr; }
+        // reading is paused while the outputs of the stream can't keep up
+        bool isReadPaused() const { return socket.isReadPaused(); }
+
+        // metrics series of the application, stream and endpoint of the connection
+        uint32_t getMetricsSeries() const { return metricsSeries; }
+
     private:
         void resolveStreamName();
         void updateIdString();
+        void initClient();
+        void startStream();
+        Connection* findCarriedConnection(uint32_t transactionId) const;
+        uint32_t nextInvokeId();
+        bool sendPacket(rtmp::Packet& packet);
+        // encodes the packet on the connection that owns the socket, the bytes are counted for the series of the sender
+        bool writePacket(rtmp::Packet& packet, uint32_t series);
+        bool isMetaDataFiltered(const std::string& key) const;
 
         void handleConnect(Socket&);
         void handleConnectError(Socket&);
+        void handleRacingConnect(Socket&);
+        void handleResolve(uint32_t index, bool racing, bool success, const std::pair<uint32_t, uint16_t>& ipAddress);
+
+        void resolveAddress(uint32_t index, bool racing);
+        void updateRacingConnects(float delta);
+        void closeRacingConnects();
+        void finishConnect(bool success);
+        void cancelConnect();
         void handleRead(Socket&, const std::vector<uint8_t>& newData);
         void handleClose(Socket&);
 
@@ -161,6 +208,24 @@ namespace relay
         uint32_t connectCount = 0;
         uint32_t addressIndex = 0;
 
+        // a connect attempt holds a slot of the connect scheduler until the handshake is done or it fails
+        bool connectPending = false;
+        std::string connectAddress;
+        bool retryScheduled = false;
+        float retryInterval = 0.0f;
+        bool reconnecting = true;
+
+        // parallel connects to the other addresses of the endpoint, paired with the address index
+        std::vector<std::pair<uint32_t, std::unique_ptr<Socket>>> racingSockets;
+        uint32_t startedConnects = 0;
+        float timeSinceConnectStart = 0.0f;
+
+        std::chrono::steady_clock::time_point connectStartTime;
+        std::chrono::steady_clock::time_point handshakeStartTime;
+
+        std::vector<uint64_t> resolveRequests;
+        uint32_t pendingResolves = 0;
+
         std::vector<uint8_t> data;
 
         uint32_t inChunkSize = 128;
@@ -180,6 +245,13 @@ namespace relay
         std::string streamName;
         bool connected = false;
         bool closed = false;
+        bool pooled = false;
+        bool congested = false;
+
+        Connection* carrier = nullptr;
+        std::vector<Connection*> carriedConnections;
+        // first chunk stream of the stream on the shared connection
+        uint32_t channelBase = 0;
         bool streaming = false;
 
         bool videoFrameSent = false;
@@ -196,5 +268,6 @@ namespace relay
         amf::Version amfVersion = amf::Version::AMF0;
 
         std::string idString;
+        uint32_t metricsSeries = 0;
     };
 }
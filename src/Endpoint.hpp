@@ -5,6 +5,7 @@
 #pragma once
 
 #include <cstdint>
+#include <set>
 #include <vector>
 #include "Connection.hpp"
 #include "Stream.hpp"
@@ -22,13 +23,29 @@ namespace relay
         {
             std::string url;
             std::pair<uint32_t, uint16_t> ipAddresses;
+
+            bool operator==(const Address& other) const
+            {
+                return url == other.url && ipAddresses == other.ipAddresses;
+            }
         };
         std::vector<Address> addresses;
         float connectionTimeout = 5.0f;
         float reconnectInterval = 5.0f;
         uint32_t reconnectCount = 0;
+        float connectStagger = 0.0f;
+        bool fastOpen = false;
         float pingInterval = 60.0f;
         uint32_t bufferSize = 3000;
+        uint32_t poolSize = 0;
+        bool multiplex = false;
+        float lingerTime = 0.0f;
+        uint32_t backupInputs = 0;
+        float stallTimeout = 2.0f;
+        float pacingHeadroom = 0.0f;
+        uint64_t maxIngestRate = 0;
+        uint32_t maxIngestBuffer = 0;
+        SocketOptions socketOptions;
         amf::Version amfVersion = amf::Version::AMF0;
 
         bool videoStream = true;
@@ -38,10 +55,67 @@ namespace relay
         std::string streamName;
         std::set<std::string> metaDataBlacklist;
 
+        bool operator==(const Endpoint& other) const
+        {
+            return connectionType == other.connectionType &&
+                direction == other.direction &&
+                addresses == other.addresses &&
+                connectionTimeout == other.connectionTimeout &&
+                reconnectInterval == other.reconnectInterval &&
+                reconnectCount == other.reconnectCount &&
+                connectStagger == other.connectStagger &&
+                fastOpen == other.fastOpen &&
+                pingInterval == other.pingInterval &&
+                bufferSize == other.bufferSize &&
+                poolSize == other.poolSize &&
+                multiplex == other.multiplex &&
+                lingerTime == other.lingerTime &&
+                backupInputs == other.backupInputs &&
+                stallTimeout == other.stallTimeout &&
+                pacingHeadroom == other.pacingHeadroom &&
+                maxIngestRate == other.maxIngestRate &&
+                maxIngestBuffer == other.maxIngestBuffer &&
+                socketOptions == other.socketOptions &&
+                amfVersion == other.amfVersion &&
+                videoStream == other.videoStream &&
+                audioStream == other.audioStream &&
+                dataStream == other.dataStream &&
+                applicationName == other.applicationName &&
+                streamName == other.streamName &&
+                metaDataBlacklist == other.metaDataBlacklist;
+        }
+
+        bool operator!=(const Endpoint& other) const
+        {
+            return !(*this == other);
+        }
+
         bool isNameKnown() const
         {
             return !applicationName.empty() && !streamName.empty() &&
                 isValidName(applicationName) && isValidName(streamName);
         }
+
+        // input endpoints that would pull the same media from the same place
+        bool isSameSource(const Endpoint& other) const
+        {
+            return connectionType == Connection::Type::CLIENT &&
+                direction == Connection::Direction::INPUT &&
+                connectionType == other.connectionType &&
+                direction == other.direction &&
+                addresses == other.addresses &&
+                amfVersion == other.amfVersion &&
+                applicationName == other.applicationName &&
+                streamName == other.streamName &&
+                isNameKnown();
+        }
+
+        // connections can be made before the stream is known only if the application name does not depend on it
+        bool canPool() const
+        {
+            return connectionType == Connection::Type::CLIENT &&
+                direction == Connection::Direction::OUTPUT &&
+                !applicationName.empty() && isValidName(applicationName);
+        }
     };
 }
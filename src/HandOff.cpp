@@ -0,0 +1,285 @@
+//
+//  rtmp_relay
+//
+
+#ifndef _WIN32
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <sys/time.h>
+#  include <poll.h>
+#  include <unistd.h>
+#endif
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include "HandOff.hpp"
+#include "Log.hpp"
+
+namespace relay
+{
+#ifndef _WIN32
+    static const size_t MAX_SOCKETS = 64;
+
+    static bool getUnixAddress(const std::string& path, sockaddr_un& address)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            Log(Log::Level::ERR) << "Hand-off socket path " << path << " is too long";
+            return false;
+        }
+
+        memcpy(address.sun_path, path.c_str(), path.size());
+
+        return true;
+    }
+
+    bool HandOff::send(const std::string& path, const std::map<std::string, socket_t>& sockets)
+    {
+        if (sockets.size() > MAX_SOCKETS)
+        {
+            Log(Log::Level::ERR) << "Too many sockets to hand off: " << sockets.size();
+            return false;
+        }
+
+        sockaddr_un address;
+        if (!getUnixAddress(path, address)) return false;
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to create hand-off socket, error: " << errno;
+            return false;
+        }
+
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to connect to " << path << ", error: " << errno;
+            ::close(fd);
+            return false;
+        }
+
+        // the first line is the socket count, followed by the address of every socket
+        // in the same order as the descriptors in the control message
+        std::string data = std::to_string(sockets.size()) + "\n";
+        std::vector<int> fds;
+
+        for (const auto& socket : sockets)
+        {
+            data += socket.first + "\n";
+            fds.push_back(socket.second);
+        }
+
+        std::vector<char> buffer(data.begin(), data.end());
+        std::vector<char> control(fds.empty() ? 0 : CMSG_SPACE(sizeof(int) * fds.size()));
+
+        iovec iov;
+        iov.iov_base = buffer.data();
+        iov.iov_len = buffer.size();
+
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+
+        if (!fds.empty())
+        {
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+
+            cmsghdr* header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+        }
+
+        ssize_t size = sendmsg(fd, &message, 0);
+
+        if (size < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to send sockets to " << path << ", error: " << errno;
+            ::close(fd);
+            return false;
+        }
+
+        for (size_t offset = static_cast<size_t>(size); offset < buffer.size();)
+        {
+            size = ::send(fd, buffer.data() + offset, buffer.size() - offset, 0);
+
+            if (size < 0)
+            {
+                Log(Log::Level::ERR) << "Failed to send socket addresses to " << path << ", error: " << errno;
+                ::close(fd);
+                return false;
+            }
+
+            offset += static_cast<size_t>(size);
+        }
+
+        ::close(fd);
+
+        return true;
+    }
+
+    HandOff::HandOff(const std::string& aPath):
+        path(aPath)
+    {
+    }
+
+    HandOff::~HandOff()
+    {
+        if (listenFd >= 0)
+        {
+            ::close(listenFd);
+            unlink(path.c_str());
+        }
+    }
+
+    bool HandOff::listen()
+    {
+        sockaddr_un address;
+        if (!getUnixAddress(path, address)) return false;
+
+        unlink(path.c_str());
+
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listenFd < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to create hand-off socket, error: " << errno;
+            return false;
+        }
+
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(listenFd, 1) < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to listen on " << path << ", error: " << errno;
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool HandOff::receive(float timeout, std::map<std::string, socket_t>& sockets)
+    {
+        int timeoutMs = static_cast<int>(timeout * 1000);
+
+        pollfd pollFd;
+        pollFd.fd = listenFd;
+        pollFd.events = POLLIN;
+        pollFd.revents = 0;
+
+        if (listenFd < 0 || poll(&pollFd, 1, timeoutMs) <= 0)
+        {
+            Log(Log::Level::ERR) << "Timed out waiting for the sockets of the running relay";
+            return false;
+        }
+
+        int fd = accept(listenFd, nullptr, nullptr);
+
+        if (fd < 0)
+        {
+            Log(Log::Level::ERR) << "Failed to accept hand-off connection, error: " << errno;
+            return false;
+        }
+
+        timeval tv;
+        tv.tv_sec = timeoutMs / 1000;
+        tv.tv_usec = (timeoutMs % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        std::string data;
+        std::vector<int> fds;
+        bool result = true;
+
+        for (;;)
+        {
+            char buffer[1024];
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_SOCKETS));
+
+            iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = sizeof(buffer);
+
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+
+            ssize_t size = recvmsg(fd, &message, 0);
+
+            if (size < 0)
+            {
+                Log(Log::Level::ERR) << "Failed to receive sockets, error: " << errno;
+                result = false;
+                break;
+            }
+
+            for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            {
+                if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+                {
+                    size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int* received = reinterpret_cast<const int*>(CMSG_DATA(header));
+                    fds.insert(fds.end(), received, received + count);
+                }
+            }
+
+            if (message.msg_flags & MSG_CTRUNC)
+            {
+                Log(Log::Level::ERR) << "Hand-off control message truncated";
+                result = false;
+            }
+
+            if (size == 0) break;
+
+            data.append(buffer, static_cast<size_t>(size));
+        }
+
+        ::close(fd);
+
+        std::istringstream stream(data);
+        std::string line;
+        std::vector<std::string> addresses;
+        size_t count = 0;
+
+        if (result && std::getline(stream, line))
+        {
+            count = static_cast<size_t>(strtoul(line.c_str(), nullptr, 10));
+
+            while (std::getline(stream, line))
+            {
+                addresses.push_back(line);
+            }
+        }
+
+        if (!result || count != fds.size() || count != addresses.size())
+        {
+            Log(Log::Level::ERR) << "Invalid hand-off message, expected " << count << " socket(s), got " << fds.size();
+
+            for (int receivedFd : fds)
+            {
+                ::close(receivedFd);
+            }
+
+            return false;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            sockets[addresses[i]] = fds[i];
+        }
+
+        return true;
+    }
+#endif
+}
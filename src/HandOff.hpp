@@ -0,0 +1,35 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <map>
+#include <string>
+#include "Socket.hpp"
+
+namespace relay
+{
+    // passes listening sockets from a running relay to the process replacing it
+    // over a Unix domain socket (SCM_RIGHTS)
+    class HandOff
+    {
+    public:
+        static bool send(const std::string& path, const std::map<std::string, socket_t>& sockets);
+
+        HandOff(const std::string& aPath);
+        ~HandOff();
+
+        HandOff(const HandOff&) = delete;
+        HandOff& operator=(const HandOff&) = delete;
+        HandOff(HandOff&&) = delete;
+        HandOff& operator=(HandOff&&) = delete;
+
+        bool listen();
+        bool receive(float timeout, std::map<std::string, socket_t>& sockets);
+
+    private:
+        std::string path;
+        int listenFd = -1;
+    };
+}
@@ -2,16 +2,10 @@
 //  rtmp_relay
 //
 
-#include <chrono>
-#include <iostream>
+#include <cstdlib>
 #include <string>
-#ifdef _WIN32
-#  include <windows.h>
-#  include <strsafe.h>
-#elif defined(LOG_SYSLOG)
-#  include <sys/syslog.h>
-#endif
 #include "Log.hpp"
+#include "LogWriter.hpp"
 
 namespace relay
 {
@@ -27,42 +21,48 @@ namespace relay
     bool Log::syslogEnabled = false;
 #endif
 
+    static LogWriter& getWriter()
+    {
+        // never destroyed, objects can log while they are destroyed at exit
+        static LogWriter* writer = new LogWriter();
+        return *writer;
+    }
+
+    void Log::startThread()
+    {
+        static bool registered = false;
+
+        // the messages in the ring are written when the process exits
+        if (!registered)
+        {
+            std::atexit(stopThread);
+            registered = true;
+        }
+
+        getWriter().start();
+    }
+
+    void Log::stopThread()
+    {
+        getWriter().stop();
+    }
+
+    size_t Log::getQueueLength()
+    {
+        return getWriter().getQueueLength();
+    }
+
     void Log::flush()
     {
         if (!s.empty())
         {
-            auto n = std::chrono::system_clock::now();
-            auto t = std::chrono::system_clock::to_time_t(n);
-            tm* time = localtime(&t);
-            char buffer[32];
-            strftime(buffer, sizeof(buffer), "%Y.%m.%d %H:%M:%S", time);
-
-            if (level == Level::ERR ||
-                level == Level::WARN)
-                std::cerr << buffer << ": " << s << std::endl;
-            else
-                std::cout << buffer << ": " << s << std::endl;
+            LogWriter& writer = getWriter();
 
-#ifdef _WIN32
-            wchar_t szBuffer[MAX_PATH];
-            MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, szBuffer, MAX_PATH);
-            StringCchCatW(szBuffer, sizeof(szBuffer), L"\n");
-            OutputDebugStringW(szBuffer);
-#elif defined(LOG_SYSLOG)
-            if (syslogEnabled)
+            if (!writer.push(level, s))
             {
-                int priority = 0;
-                switch (level)
-                {
-                    case Level::ERR: priority = LOG_ERR; break;
-                    case Level::WARN: priority = LOG_WARNING; break;
-                    case Level::INFO: priority = LOG_INFO; break;
-                    case Level::ALL: priority = LOG_DEBUG; break;
-                    default: break;
-                }
-                syslog(priority, "%s", s.c_str());
+                writer.write(level, s);
             }
-#endif
+
             s.clear();
         }
     }
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 namespace relay
@@ -23,6 +24,22 @@ namespace relay
         static Level threshold;
         static bool syslogEnabled;
 
+        // builds with LOG_STRIP_ALL never write messages of the ALL level, so
+        // the compiler drops their call sites
+        static bool isEnabled(Level aLevel)
+        {
+#ifdef LOG_STRIP_ALL
+            if (aLevel == Level::ALL) return false;
+#endif
+            return aLevel <= threshold;
+        }
+
+        // moves the writing of the messages to a background thread, messages are
+        // written right away before it is started and after it is stopped
+        static void startThread();
+        static void stopThread();
+        static size_t getQueueLength();
+
         Log()
         {
         }
@@ -113,3 +130,7 @@ namespace relay
         std::string s;
     };
 }
+
+// the arguments are evaluated only if the level is enabled:
+// LOG(Log::Level::ALL) << "Received " << size << " bytes";
+#define LOG(level) if (!relay::Log::isEnabled(level)) {} else relay::Log(level)
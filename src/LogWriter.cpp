@@ -0,0 +1,305 @@
+//
+//  rtmp_relay
+//
+
+#include <iostream>
+#ifdef _WIN32
+#  include <windows.h>
+#  include <strsafe.h>
+#else
+#  include <pthread.h>
+#  include <signal.h>
+#  if defined(LOG_SYSLOG)
+#    include <sys/syslog.h>
+#  endif
+#endif
+#include "LogWriter.hpp"
+
+namespace relay
+{
+    static const size_t RING_SIZE = 8192; // must be a power of two
+    static const size_t BATCH_SIZE = 256;
+    static const std::chrono::milliseconds WAIT_TIME(100);
+    static const std::chrono::seconds REPEAT_INTERVAL(1);
+
+    LogWriter::LogWriter():
+        slots(new Slot[RING_SIZE]),
+        mask(RING_SIZE - 1)
+    {
+        for (size_t i = 0; i < RING_SIZE; ++i)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    LogWriter::~LogWriter()
+    {
+        stop();
+    }
+
+    void LogWriter::start()
+    {
+        if (running) return;
+
+        running = true;
+
+#ifndef _WIN32
+        // signals are handled by the main thread only, the thread inherits the blocked mask
+        sigset_t blocked;
+        sigset_t previous;
+        sigfillset(&blocked);
+        pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+#endif
+
+        thread = std::thread(&LogWriter::run, this);
+
+#ifndef _WIN32
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+#endif
+    }
+
+    void LogWriter::stop()
+    {
+        if (!running) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+            condition.notify_all();
+        }
+
+        if (thread.joinable()) thread.join();
+
+        // messages that were pushed while the thread was finishing
+        std::lock_guard<std::mutex> lock(writeMutex);
+        Record record;
+        while (pop(record)) append(record.level, record.time, record.message);
+        writeRepeats(true);
+        flush();
+    }
+
+    bool LogWriter::push(Log::Level level, std::string& message)
+    {
+        if (!running.load(std::memory_order_relaxed)) return false;
+
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        Slot* slot;
+
+        while (true)
+        {
+            slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0)
+            {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            }
+            else if (difference < 0)
+            {
+                // the ring is full, don't block the caller
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            else
+            {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->record.level = level;
+        slot->record.time = std::chrono::system_clock::now();
+        slot->record.message.swap(message);
+        slot->sequence.store(position + 1, std::memory_order_release);
+
+        // the writer wakes up on its own, only wake it up early if the ring fills up
+        if (position - dequeuePosition.load(std::memory_order_relaxed) >= RING_SIZE / 4)
+        {
+            condition.notify_one();
+        }
+
+        return true;
+    }
+
+    bool LogWriter::pop(Record& record)
+    {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        Slot& slot = slots[position & mask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+        // empty or the producer of the position has not finished yet
+        if (sequence != position + 1) return false;
+
+        record.level = slot.record.level;
+        record.time = slot.record.time;
+        record.message.swap(slot.record.message);
+        slot.sequence.store(position + RING_SIZE, std::memory_order_release);
+        dequeuePosition.store(position + 1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    void LogWriter::run()
+    {
+        std::vector<Record> records(BATCH_SIZE);
+
+        while (true)
+        {
+            bool stopping = !running;
+            size_t count = 0;
+
+            while (count < records.size() && pop(records[count])) ++count;
+
+            {
+                std::lock_guard<std::mutex> lock(writeMutex);
+
+                if (count > 0) writeBatch(records, count);
+
+                writeRepeats(false);
+
+                uint64_t droppedCount = dropped.exchange(0);
+                if (droppedCount > 0)
+                {
+                    append(Log::Level::WARN, std::chrono::system_clock::now(), std::to_string(droppedCount) + " log messages were dropped");
+                }
+
+                flush();
+            }
+
+            if (count == records.size()) continue;
+            if (stopping) break;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (running) condition.wait_for(lock, WAIT_TIME);
+        }
+    }
+
+    void LogWriter::writeBatch(std::vector<Record>& records, size_t count)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            Record& record = records[i];
+
+            // debug messages are always written
+            if (record.level != Log::Level::ALL)
+            {
+                auto repeat = repeats.find(record.message);
+
+                if (repeat != repeats.end())
+                {
+                    ++repeat->second.count;
+                    continue;
+                }
+
+                Repeat& newRepeat = repeats[record.message];
+                newRepeat.level = record.level;
+                newRepeat.until = now + REPEAT_INTERVAL;
+            }
+
+            append(record.level, record.time, record.message);
+        }
+    }
+
+    void LogWriter::writeRepeats(bool all)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto i = repeats.begin(); i != repeats.end();)
+        {
+            if (all || now >= i->second.until)
+            {
+                if (i->second.count > 0)
+                {
+                    append(i->second.level, std::chrono::system_clock::now(),
+                           i->first + " (repeated " + std::to_string(i->second.count) + " times)");
+
+                    // keep collapsing the message while it keeps repeating
+                    if (!all)
+                    {
+                        i->second.count = 0;
+                        i->second.until = now + REPEAT_INTERVAL;
+                        ++i;
+                        continue;
+                    }
+                }
+
+                i = repeats.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+
+    void LogWriter::write(Log::Level level, const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        append(level, std::chrono::system_clock::now(), message);
+        flush();
+    }
+
+    void LogWriter::append(Log::Level level, std::chrono::system_clock::time_point time, const std::string& message)
+    {
+        std::time_t t = std::chrono::system_clock::to_time_t(time);
+
+        // the time is formatted once per second
+        if (t != lastTime || timeString[0] == '\0')
+        {
+            std::tm tm;
+#ifdef _WIN32
+            localtime_s(&tm, &t);
+#else
+            localtime_r(&t, &tm);
+#endif
+            strftime(timeString, sizeof(timeString), "%Y.%m.%d %H:%M:%S", &tm);
+            lastTime = t;
+        }
+
+        std::string& stream = (level == Log::Level::ERR || level == Log::Level::WARN) ? err : out;
+        stream += timeString;
+        stream += ": ";
+        stream += message;
+        stream += '\n';
+
+#ifdef _WIN32
+        wchar_t szBuffer[MAX_PATH];
+        MultiByteToWideChar(CP_UTF8, 0, message.c_str(), -1, szBuffer, MAX_PATH);
+        StringCchCatW(szBuffer, sizeof(szBuffer), L"\n");
+        OutputDebugStringW(szBuffer);
+#elif defined(LOG_SYSLOG)
+        if (Log::syslogEnabled)
+        {
+            int priority = 0;
+            switch (level)
+            {
+                case Log::Level::ERR: priority = LOG_ERR; break;
+                case Log::Level::WARN: priority = LOG_WARNING; break;
+                case Log::Level::INFO: priority = LOG_INFO; break;
+                case Log::Level::ALL: priority = LOG_DEBUG; break;
+                default: break;
+            }
+            syslog(priority, "%s", message.c_str());
+        }
+#endif
+    }
+
+    void LogWriter::flush()
+    {
+        if (!err.empty())
+        {
+            std::cerr.write(err.data(), static_cast<std::streamsize>(err.size()));
+            std::cerr.flush();
+            err.clear();
+        }
+
+        if (!out.empty())
+        {
+            std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+            std::cout.flush();
+            out.clear();
+        }
+    }
+}
@@ -0,0 +1,105 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Log.hpp"
+
+namespace relay
+{
+    // writes the log messages on a background thread: messages are passed through a
+    // lock-free ring, written in batches and an identical message is written at most
+    // once per repeat interval followed by a "repeated N times" summary
+    class LogWriter
+    {
+    public:
+        LogWriter();
+        ~LogWriter();
+
+        LogWriter(const LogWriter&) = delete;
+        LogWriter& operator=(const LogWriter&) = delete;
+        LogWriter(LogWriter&&) = delete;
+        LogWriter& operator=(LogWriter&&) = delete;
+
+        void start();
+        // writes the queued messages and joins the thread
+        void stop();
+
+        // takes the message (leaves an empty string with some capacity in its place),
+        // returns false if the thread is not running and the message has to be written
+        // by the caller, messages that don't fit in the ring are dropped and counted
+        bool push(Log::Level level, std::string& message);
+
+        // writes a message on the calling thread
+        void write(Log::Level level, const std::string& message);
+
+        // messages in the ring waiting for the thread
+        size_t getQueueLength() const
+        {
+            size_t dequeued = dequeuePosition.load(std::memory_order_relaxed);
+            return enqueuePosition.load(std::memory_order_relaxed) - dequeued;
+        }
+
+    private:
+        struct Record
+        {
+            Log::Level level = Log::Level::INFO;
+            std::chrono::system_clock::time_point time;
+            std::string message;
+        };
+
+        struct Slot
+        {
+            std::atomic<size_t> sequence;
+            Record record;
+        };
+
+        struct Repeat
+        {
+            Log::Level level;
+            std::chrono::steady_clock::time_point until;
+            uint32_t count = 0;
+        };
+
+        bool pop(Record& record);
+        void run();
+        void writeBatch(std::vector<Record>& records, size_t count);
+        void writeRepeats(bool all);
+        void append(Log::Level level, std::chrono::system_clock::time_point time, const std::string& message);
+        void flush();
+
+        // the ring is a bounded multi-producer queue: the sequence of a slot tells whether it
+        // is free for the producer of the position or filled for the consumer of the position
+        std::unique_ptr<Slot[]> slots;
+        size_t mask = 0;
+        std::atomic<size_t> enqueuePosition{0};
+        std::atomic<size_t> dequeuePosition{0};
+
+        std::atomic<bool> running{false};
+        std::atomic<uint64_t> dropped{0};
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        // the thread and the callers of write don't write at the same time
+        std::mutex writeMutex;
+        // only used while writeMutex is locked
+        std::unordered_map<std::string, Repeat> repeats;
+        std::string out;
+        std::string err;
+        std::time_t lastTime = 0;
+        char timeString[32] = "";
+    };
+}
@@ -0,0 +1,413 @@
+//
+//  rtmp_relay
+//
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "Metrics.hpp"
+#include "Log.hpp"
+
+namespace relay
+{
+    static const uint32_t BLOCK_SIZE = 64;
+    static const uint32_t MAX_BLOCKS = 1024;
+    static const uint32_t MAX_SERIES = BLOCK_SIZE * MAX_BLOCKS;
+    static const uint32_t MAX_BUCKETS = 16;
+    static const uint32_t COUNTER_COUNT = static_cast<uint32_t>(Metrics::Counter::COUNT);
+    static const uint32_t HISTOGRAM_COUNT = static_cast<uint32_t>(Metrics::Histogram::COUNT);
+
+    struct CounterInfo
+    {
+        const char* name;
+        const char* help;
+    };
+
+    struct HistogramInfo
+    {
+        const char* name;
+        const char* help;
+        // upper bounds of the buckets in seconds, the +Inf bucket is not listed
+        std::vector<double> bounds;
+    };
+
+    static const CounterInfo COUNTERS[COUNTER_COUNT] = {
+        {"rtmp_relay_received_bytes_total", "Bytes received"},
+        {"rtmp_relay_sent_bytes_total", "Bytes queued for sending"},
+        {"rtmp_relay_received_frames_total", "Audio and video messages received, codec headers included"},
+        {"rtmp_relay_sent_frames_total", "Audio and video messages sent, codec headers included"},
+        {"rtmp_relay_dropped_frames_total", "Audio and video messages that were not sent to an output"}
+    };
+
+    static const HistogramInfo HISTOGRAMS[HISTOGRAM_COUNT] = {
+        {"rtmp_relay_connect_duration_seconds", "Time from the start of a connect to the established TCP connection",
+            {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0}},
+        {"rtmp_relay_handshake_duration_seconds", "Time from the established TCP connection to the completed RTMP handshake",
+            {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0}},
+        {"rtmp_relay_loop_duration_seconds", "Time of an event loop iteration without the sleep",
+            {0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.1}}
+    };
+
+    // only the owning thread writes the values, a load and a store are enough instead of
+    // a locked increment and the scraping thread still never reads a torn value
+    static inline void increment(std::atomic<uint64_t>& value, uint64_t amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    struct Block
+    {
+        Block()
+        {
+            for (auto& series : values)
+                for (auto& value : series) value.store(0, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> values[BLOCK_SIZE][COUNTER_COUNT];
+    };
+
+    // the counters of one thread, the series are stored in blocks that are never moved, so
+    // the scraping thread can read them while the owner adds new ones
+    struct Shard
+    {
+        Shard()
+        {
+            for (auto& block : blocks) block.store(nullptr, std::memory_order_relaxed);
+
+            for (uint32_t i = 0; i < HISTOGRAM_COUNT; ++i)
+            {
+                for (auto& bucket : buckets[i]) bucket.store(0, std::memory_order_relaxed);
+                sums[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ~Shard()
+        {
+            for (auto& block : blocks) delete block.load(std::memory_order_relaxed);
+        }
+
+        std::atomic<Block*> blocks[MAX_BLOCKS];
+        // the last bucket is +Inf
+        std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][MAX_BUCKETS + 1];
+        // nanoseconds
+        std::atomic<uint64_t> sums[HISTOGRAM_COUNT];
+    };
+
+    typedef std::tuple<std::string, std::string, std::string> Labels;
+
+    struct Registry
+    {
+        Registry()
+        {
+            // shared by the series past the limit
+            labels.push_back(Labels());
+            series[labels.back()] = 0;
+            references.push_back(0);
+            idleQueued.push_back(false);
+            bases.resize(COUNTER_COUNT);
+        }
+
+        std::mutex mutex;
+        std::map<Labels, uint32_t> series;
+        std::vector<Labels> labels;
+        // connections that count in the series
+        std::vector<uint32_t> references;
+        // series without connections in the order they were left, taken over by new labels at the limit
+        std::deque<uint32_t> idle;
+        std::vector<bool> idleQueued;
+        // the counts of the previous labels of a series that was taken over, subtracted from the totals
+        std::vector<uint64_t> bases;
+        bool limitLogged = false;
+        // the shards of threads that have exited are kept, their counts are still part of the totals
+        std::vector<std::unique_ptr<Shard>> shards;
+    };
+
+    static Registry& getRegistry()
+    {
+        // never destroyed, threads can count while objects are destroyed at exit
+        static Registry* registry = new Registry();
+        return *registry;
+    }
+
+    static Shard& getShard()
+    {
+        static thread_local Shard* shard = nullptr;
+
+        if (!shard)
+        {
+            Registry& registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.shards.emplace_back(new Shard());
+            shard = registry.shards.back().get();
+        }
+
+        return *shard;
+    }
+
+    static void appendEscaped(std::string& str, const std::string& value)
+    {
+        for (char c : value)
+        {
+            switch (c)
+            {
+                case '\\': str += "\\\\"; break;
+                case '"': str += "\\\""; break;
+                case '\n': str += "\\n"; break;
+                default: str += c; break;
+            }
+        }
+    }
+
+    static void appendLabels(std::string& str, const Labels& labels)
+    {
+        str += "{application=\"";
+        appendEscaped(str, std::get<0>(labels));
+        str += "\",stream=\"";
+        appendEscaped(str, std::get<1>(labels));
+        str += "\",endpoint=\"";
+        appendEscaped(str, std::get<2>(labels));
+        str += "\"}";
+    }
+
+    static std::string doubleToString(double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.9g", value);
+        return buffer;
+    }
+
+    // sum of the counters of a series over all shards, the registry has to be locked
+    static void getTotals(const Registry& registry, uint32_t series, uint64_t* totals)
+    {
+        for (uint32_t c = 0; c < COUNTER_COUNT; ++c) totals[c] = 0;
+
+        for (const auto& shard : registry.shards)
+        {
+            const Block* block = shard->blocks[series / BLOCK_SIZE].load(std::memory_order_acquire);
+            if (!block) continue;
+
+            for (uint32_t c = 0; c < COUNTER_COUNT; ++c)
+            {
+                totals[c] += block->values[series % BLOCK_SIZE][c].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    uint32_t Metrics::getSeries(const std::string& applicationName,
+                                const std::string& streamName,
+                                const std::string& endpoint)
+    {
+        Registry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        Labels labels(applicationName, streamName, endpoint);
+        auto i = registry.series.find(labels);
+
+        if (i != registry.series.end())
+        {
+            ++registry.references[i->second];
+            return i->second;
+        }
+
+        uint32_t index;
+
+        if (registry.labels.size() < MAX_SERIES)
+        {
+            index = static_cast<uint32_t>(registry.labels.size());
+            registry.labels.push_back(labels);
+            registry.references.push_back(0);
+            registry.idleQueued.push_back(false);
+            registry.bases.resize(registry.bases.size() + COUNTER_COUNT);
+        }
+        else
+        {
+            // the series that has been idle the longest, entries of series that were taken again are skipped
+            while (!registry.idle.empty() && registry.references[registry.idle.front()] > 0)
+            {
+                registry.idleQueued[registry.idle.front()] = false;
+                registry.idle.pop_front();
+            }
+
+            if (registry.idle.empty())
+            {
+                if (!registry.limitLogged)
+                {
+                    registry.limitLogged = true;
+                    Log(Log::Level::WARN) << "Metrics series limit of " << MAX_SERIES << " reached, new connections are counted without labels";
+                }
+
+                return 0;
+            }
+
+            index = registry.idle.front();
+            registry.idle.pop_front();
+            registry.idleQueued[index] = false;
+
+            registry.series.erase(registry.labels[index]);
+            registry.labels[index] = labels;
+            getTotals(registry, index, &registry.bases[index * COUNTER_COUNT]);
+        }
+
+        registry.series[labels] = index;
+        registry.references[index] = 1;
+
+        return index;
+    }
+
+    void Metrics::releaseSeries(uint32_t series)
+    {
+        // the series without labels is never taken over
+        if (series == 0) return;
+
+        Registry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        if (series >= registry.references.size() || registry.references[series] == 0) return;
+
+        if (--registry.references[series] == 0 && !registry.idleQueued[series])
+        {
+            registry.idleQueued[series] = true;
+            registry.idle.push_back(series);
+        }
+    }
+
+    void Metrics::add(uint32_t series, Counter counter, uint64_t value)
+    {
+        Shard& shard = getShard();
+        std::atomic<Block*>& blockPointer = shard.blocks[series / BLOCK_SIZE];
+        Block* block = blockPointer.load(std::memory_order_relaxed);
+
+        if (!block)
+        {
+            block = new Block();
+            blockPointer.store(block, std::memory_order_release);
+        }
+
+        increment(block->values[series % BLOCK_SIZE][static_cast<uint32_t>(counter)], value);
+    }
+
+    void Metrics::observe(Histogram histogram, std::chrono::steady_clock::duration duration)
+    {
+        uint32_t index = static_cast<uint32_t>(histogram);
+        const std::vector<double>& bounds = HISTOGRAMS[index].bounds;
+
+        int64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        if (nanoseconds < 0) nanoseconds = 0;
+
+        double seconds = nanoseconds / 1000000000.0;
+        size_t bucket = 0;
+        while (bucket < bounds.size() && seconds > bounds[bucket]) ++bucket;
+
+        Shard& shard = getShard();
+        increment(shard.buckets[index][bucket], 1);
+        increment(shard.sums[index], static_cast<uint64_t>(nanoseconds));
+    }
+
+    void Metrics::write(std::string& str)
+    {
+        Registry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        size_t seriesCount = registry.labels.size();
+        std::vector<uint64_t> totals(seriesCount * COUNTER_COUNT);
+        uint64_t buckets[HISTOGRAM_COUNT][MAX_BUCKETS + 1] = {};
+        uint64_t sums[HISTOGRAM_COUNT] = {};
+
+        for (const auto& shard : registry.shards)
+        {
+            for (uint32_t b = 0; b * BLOCK_SIZE < seriesCount; ++b)
+            {
+                const Block* block = shard->blocks[b].load(std::memory_order_acquire);
+                if (!block) continue;
+
+                for (uint32_t i = 0; i < BLOCK_SIZE && b * BLOCK_SIZE + i < seriesCount; ++i)
+                {
+                    for (uint32_t c = 0; c < COUNTER_COUNT; ++c)
+                    {
+                        totals[(b * BLOCK_SIZE + i) * COUNTER_COUNT + c] += block->values[i][c].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            for (uint32_t h = 0; h < HISTOGRAM_COUNT; ++h)
+            {
+                for (uint32_t i = 0; i <= MAX_BUCKETS; ++i)
+                {
+                    buckets[h][i] += shard->buckets[h][i].load(std::memory_order_relaxed);
+                }
+
+                sums[h] += shard->sums[h].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (uint32_t c = 0; c < COUNTER_COUNT; ++c)
+        {
+            str += std::string("# HELP ") + COUNTERS[c].name + " " + COUNTERS[c].help + "\n" +
+                "# TYPE " + COUNTERS[c].name + " counter\n";
+
+            for (size_t s = 0; s < seriesCount; ++s)
+            {
+                // the series that never counted anything of the kind
+                uint64_t total = totals[s * COUNTER_COUNT + c] - registry.bases[s * COUNTER_COUNT + c];
+                if (total == 0) continue;
+
+                str += COUNTERS[c].name;
+                appendLabels(str, registry.labels[s]);
+                str += " " + std::to_string(total) + "\n";
+            }
+        }
+
+        for (uint32_t h = 0; h < HISTOGRAM_COUNT; ++h)
+        {
+            const HistogramInfo& info = HISTOGRAMS[h];
+
+            str += std::string("# HELP ") + info.name + " " + info.help + "\n" +
+                "# TYPE " + info.name + " histogram\n";
+
+            // the buckets of the text format are cumulative
+            uint64_t count = 0;
+
+            for (size_t i = 0; i < info.bounds.size(); ++i)
+            {
+                count += buckets[h][i];
+                str += std::string(info.name) + "_bucket{le=\"" + doubleToString(info.bounds[i]) + "\"} " + std::to_string(count) + "\n";
+            }
+
+            count += buckets[h][info.bounds.size()];
+
+            str += std::string(info.name) + "_bucket{le=\"+Inf\"} " + std::to_string(count) + "\n" +
+                info.name + "_sum " + doubleToString(sums[h] / 1000000000.0) + "\n" +
+                info.name + "_count " + std::to_string(count) + "\n";
+        }
+    }
+
+    void Metrics::writeGauge(std::string& str, const char* name, const char* help, uint64_t value)
+    {
+        str += std::string("# HELP ") + name + " " + help + "\n" +
+            "# TYPE " + name + " gauge\n" +
+            name + " " + std::to_string(value) + "\n";
+    }
+
+    void Metrics::writeGauge(std::string& str, const char* name, const char* help,
+                             const std::map<uint32_t, uint64_t>& values)
+    {
+        Registry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        str += std::string("# HELP ") + name + " " + help + "\n" +
+            "# TYPE " + name + " gauge\n";
+
+        for (const auto& value : values)
+        {
+            if (value.first >= registry.labels.size()) continue;
+
+            str += name;
+            appendLabels(str, registry.labels[value.first]);
+            str += " " + std::to_string(value.second) + "\n";
+        }
+    }
+}
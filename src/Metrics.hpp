@@ -0,0 +1,56 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace relay
+{
+    // counters and histograms of the /metrics page: every thread updates a copy of its own
+    // without locking and the copies are summed up only when the metrics are scraped
+    class Metrics
+    {
+    public:
+        enum class Counter
+        {
+            RECEIVED_BYTES,
+            SENT_BYTES,
+            RECEIVED_FRAMES,
+            SENT_FRAMES,
+            DROPPED_FRAMES,
+            COUNT
+        };
+
+        enum class Histogram
+        {
+            CONNECT_TIME,
+            HANDSHAKE_TIME,
+            LOOP_TIME,
+            COUNT
+        };
+
+        // the counters of an application, stream and endpoint, every call takes a reference that is
+        // returned with releaseSeries, a series without references keeps its counts (and stays
+        // monotonic if its labels come back) until the limit is reached and new labels take it over,
+        // series past the limit share the first one (with empty labels)
+        static uint32_t getSeries(const std::string& applicationName,
+                                  const std::string& streamName,
+                                  const std::string& endpoint);
+        static void releaseSeries(uint32_t series);
+
+        static void add(uint32_t series, Counter counter, uint64_t value = 1);
+        static void observe(Histogram histogram, std::chrono::steady_clock::duration duration);
+
+        // Prometheus text format
+        static void write(std::string& str);
+        static void writeGauge(std::string& str, const char* name, const char* help, uint64_t value);
+        // values of series, written with the labels of the series
+        static void writeGauge(std::string& str, const char* name, const char* help,
+                               const std::map<uint32_t, uint64_t>& values);
+    };
+}
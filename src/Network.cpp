@@ -67,7 +67,8 @@ namespace relay
             {
                 pollfd pollFd;
                 pollFd.fd = socket->socketFd;
-                pollFd.events = POLLIN | POLLOUT;
+                // sockets that are over their read limit are only polled for writing
+                pollFd.events = socket->wantsRead() ? (POLLIN | POLLOUT) : POLLOUT;
 
                 pollFds.push_back(pollFd);
             }
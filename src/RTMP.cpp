@@ -4,7 +4,9 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstring>
 #include "Log.hpp"
 #include "RTMP.hpp"
 #include "Utils.hpp"
@@ -13,7 +15,7 @@ namespace relay
 {
     namespace rtmp
     {
-        static std::string messageTypeToString(MessageType messageType)
+        static const char* messageTypeToString(MessageType messageType)
         {
             switch (messageType)
             {
@@ -35,50 +37,80 @@ namespace relay
             };
         }
 
+        static const char* headerTypeToString(Header::Type type)
+        {
+            switch (type)
+            {
+                case Header::Type::TWELVE_BYTE: return "TWELVE_BYTE";
+                case Header::Type::EIGHT_BYTE: return "EIGHT_BYTE";
+                case Header::Type::FOUR_BYTE: return "FOUR_BYTE";
+                case Header::Type::ONE_BYTE: return "ONE_BYTE";
+                default: return "invalid header type";
+            };
+        }
+
+        // only the fields that are in the chunk header are logged
+        static void logHeader(const Header& header, bool extendedTimestamp)
+        {
+            Log log(Log::Level::ALL);
+            log << "Header type: " << headerTypeToString(header.type) << "(" << static_cast<uint32_t>(header.type) << "), channel: " << static_cast<uint32_t>(header.channel);
+
+            if (header.type != Header::Type::ONE_BYTE)
+            {
+                log << ", ts: " << header.ts;
+
+                if (header.ts == 0xffffff)
+                {
+                    log << " (extended)";
+                }
+
+                if (header.type != Header::Type::FOUR_BYTE)
+                {
+                    log << ", data length: " << header.length;
+                    log << ", message type: " << messageTypeToString(header.messageType) << "(" << static_cast<uint32_t>(header.messageType) << ")";
+
+                    if (header.type != Header::Type::EIGHT_BYTE)
+                    {
+                        log << ", message stream ID: " << header.messageStreamId;
+                    }
+                }
+            }
+
+            if (extendedTimestamp)
+            {
+                log << ", extended timestamp";
+            }
+
+            log << ", final timestamp: " << header.timestamp;
+        }
+
         static uint32_t decodeHeader(const std::vector<uint8_t>& data, uint32_t offset, Header& header, std::map<uint32_t, rtmp::Header>& previousPackets)
         {
-            uint32_t originalOffset = offset;
+            ByteReader reader(data, offset);
+
+            uint8_t headerData;
 
-            if (data.size() - offset < 1)
+            if (!reader.readBE<1>(headerData))
             {
                 return 0;
             }
 
-            uint8_t headerData = *(data.data() + offset);
-            offset += 1;
-
             header.channel = static_cast<uint32_t>(headerData & 0x3F);
             header.type = static_cast<Header::Type>(headerData >> 6);
 
             if (header.channel < 2)
             {
                 uint32_t newChannel;
-                uint32_t ret = decodeIntBE(data, offset, header.channel + 1, newChannel);
 
-                if (!ret)
+                // the two byte form is little-endian
+                if (!((header.channel == 0) ? reader.readBE<1>(newChannel) : reader.readLE<2>(newChannel)))
                 {
-                    return false;
+                    return 0;
                 }
 
-                offset += ret;
-
                 header.channel = 64 + newChannel;
             }
 
-            Log log(Log::Level::ALL);
-            log << "Header type: ";
-
-            switch (header.type)
-            {
-                case Header::Type::TWELVE_BYTE: log << "TWELVE_BYTE"; break;
-                case Header::Type::EIGHT_BYTE: log << "EIGHT_BYTE"; break;
-                case Header::Type::FOUR_BYTE: log << "FOUR_BYTE"; break;
-                case Header::Type::ONE_BYTE: log << "ONE_BYTE"; break;
-                default: log << "invalid header type"; break;
-            };
-
-            log << "(" << static_cast<uint32_t>(header.type) << "), channel: " << static_cast<uint32_t>(header.channel);
-
             header.length  = previousPackets[header.channel].length;
             header.messageType  = previousPackets[header.channel].messageType;
             header.messageStreamId = previousPackets[header.channel].messageStreamId;
@@ -86,62 +118,29 @@ namespace relay
 
             if (header.type != Header::Type::ONE_BYTE)
             {
-                uint32_t ret = decodeIntBE(data, offset, 3, header.ts);
-
-                if (!ret)
+                if (!reader.readBE<3>(header.ts))
                 {
                     return 0;
                 }
 
-                offset += ret;
-
-                log << ", ts: " << header.ts;
-
-                if (header.ts == 0xffffff)
-                {
-                    log << " (extended)";
-                }
-
                 if (header.type != Header::Type::FOUR_BYTE)
                 {
-                    ret = decodeIntBE(data, offset, 3, header.length);
-
-                    if (!ret)
-                    {
-                        return 0;
-                    }
-
-                    offset += ret;
+                    uint8_t messageType;
 
-                    log << ", data length: " << header.length;
-
-                    if (data.size() - offset < 1)
+                    if (!reader.readBE<3>(header.length) ||
+                        !reader.readBE<1>(messageType))
                     {
                         return 0;
                     }
 
-                    header.messageType = static_cast<MessageType>(*(data.data() + offset));
-                    offset += 1;
-
-                    log << ", message type: " << messageTypeToString(header.messageType) << "(" << static_cast<uint32_t>(header.messageType) << ")";
+                    header.messageType = static_cast<MessageType>(messageType);
 
                     if (header.type != Header::Type::EIGHT_BYTE)
                     {
-                        if (data.size() - offset < 4)
-                        {
-                            return 0;
-                        }
-
-                        ret = decodeIntLE(data, offset, 4, header.messageStreamId);
-
-                        if (!ret)
+                        if (!reader.readLE<4>(header.messageStreamId))
                         {
                             return 0;
                         }
-
-                        offset += ret;
-
-                        log << ", message stream ID: " << header.messageStreamId;
                     }
                 }
             }
@@ -149,16 +148,10 @@ namespace relay
             // extended timestamp
             if (header.ts == 0xffffff)
             {
-                uint32_t ret = decodeIntBE(data, offset, 4, header.timestamp);
-
-                if (!ret)
+                if (!reader.readBE<4>(header.timestamp))
                 {
                     return 0;
                 }
-
-                offset += ret;
-
-                log << ", extended timestamp: " << header.timestamp;
             }
             else
             {
@@ -171,9 +164,9 @@ namespace relay
                 header.timestamp += previousPackets[header.channel].timestamp;
             }
 
-            log << ", final timestamp: " << header.timestamp;
+            if (Log::isEnabled(Log::Level::ALL)) logHeader(header, header.ts == 0xffffff);
 
-            return offset - originalOffset;
+            return static_cast<uint32_t>(reader.getOffset()) - offset;
         }
 
         uint32_t Packet::decode(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t chunkSize, std::map<uint32_t, rtmp::Header>& previousPackets)
@@ -227,7 +220,7 @@ namespace relay
 
                 if (packetSize + offset > buffer.size())
                 {
-                    Log(Log::Level::ALL) << "Not enough data to read";
+                    LOG(Log::Level::ALL) << "Not enough data to read";
 
                     return 0;
                 }
@@ -294,99 +287,56 @@ namespace relay
                 header.type = rtmp::Header::Type::TWELVE_BYTE;
             }
 
+            // basic header, message header and extended timestamp
+            ByteWriter writer(data, 3 + 11 + 4);
+
             uint8_t headerData = static_cast<uint8_t>(static_cast<uint8_t>(header.type) << 6);
 
             if (header.channel < 64)
             {
                 headerData |= static_cast<uint8_t>(header.channel);
-                data.push_back(headerData);
+                writer.writeBE<1>(headerData);
             }
             else if (static_cast<uint32_t>(header.channel) < 64 + 256)
             {
                 headerData |= 0;
-                data.push_back(headerData);
-                encodeIntBE(data, 1, header.channel - 64);
+                writer.writeBE<1>(headerData);
+                writer.writeBE<1>(header.channel - 64);
             }
             else
             {
                 headerData |= 1;
-                data.push_back(headerData);
-                encodeIntBE(data, 2, header.channel - 64);
+                writer.writeBE<1>(headerData);
+                writer.writeLE<2>(header.channel - 64);
             }
 
-            Log log(Log::Level::ALL);
-            log << "Header type: ";
-
-            switch (header.type)
-            {
-                case Header::Type::TWELVE_BYTE: log << "TWELVE_BYTE"; break;
-                case Header::Type::EIGHT_BYTE: log << "EIGHT_BYTE"; break;
-                case Header::Type::FOUR_BYTE: log << "FOUR_BYTE"; break;
-                case Header::Type::ONE_BYTE: log << "ONE_BYTE"; break;
-                default: log << "invalid header type"; break;
-            };
-
-            log << "(" << static_cast<uint32_t>(header.type) << "), channel: " << static_cast<uint32_t>(header.channel);
-
             if (header.type != Header::Type::ONE_BYTE)
             {
-                uint32_t ret = encodeIntBE(data, 3, header.ts);
-
-                if (!ret)
-                {
-                    return 0;
-                }
-
-                log << ", ts: " << header.ts;
-
-                if (header.ts == 0xffffff)
-                {
-                    log << " (extended)";
-                }
+                writer.writeBE<3>(header.ts);
 
                 if (header.type != Header::Type::FOUR_BYTE)
                 {
-                    ret = encodeIntBE(data, 3, header.length);
-
-                    if (!ret)
-                    {
-                        return 0;
-                    }
-
-                    data.insert(data.end(), static_cast<uint8_t>(header.messageType));
-
-                    log << ", data length: " << header.length;
-                    log << ", message type: " << messageTypeToString(header.messageType) << "(" << static_cast<uint32_t>(header.messageType) << ")";
+                    writer.writeBE<3>(header.length);
+                    writer.writeBE<1>(static_cast<uint8_t>(header.messageType));
 
                     if (header.type != Header::Type::EIGHT_BYTE)
                     {
-                        ret = encodeIntLE(data, 4, header.messageStreamId);
-
-                        if (!ret)
-                        {
-                            return 0;
-                        }
-
-                        log << ", message stream ID: " << header.messageStreamId;
+                        writer.writeLE<4>(header.messageStreamId);
                     }
                 }
             }
 
-            if (header.ts == 0xffffff || (header.type == Header::Type::ONE_BYTE && previousPackets[header.channel].ts == 0xffffff))
-            {
-                uint32_t ret = encodeIntBE(data, 4, timestamp);
-
-                if (!ret)
-                {
-                    return 0;
-                }
+            bool extendedTimestamp = header.ts == 0xffffff ||
+                (header.type == Header::Type::ONE_BYTE && previousPackets[header.channel].ts == 0xffffff);
 
-                log << ", extended timestamp: " << header.timestamp;
+            if (extendedTimestamp)
+            {
+                writer.writeBE<4>(timestamp);
             }
 
-            log << ", final timestamp: " << header.timestamp;
+            if (Log::isEnabled(Log::Level::ALL)) logHeader(header, extendedTimestamp);
 
-            return static_cast<uint32_t>(data.size()) - originalSize;
+            return static_cast<uint32_t>(writer.getSize()) - originalSize;
         }
 
         uint32_t Packet::encode(std::vector<uint8_t>& buffer, uint32_t chunkSize, std::map<uint32_t, rtmp::Header>& previousPackets) const
@@ -403,6 +353,9 @@ namespace relay
             header.timestamp = timestamp;
             header.length = static_cast<uint32_t>(data.size());
 
+            // the data and the largest header for every chunk
+            buffer.reserve(buffer.size() + data.size() + (data.size() / chunkSize + 1) * (3 + 11 + 4));
+
             while (remainingBytes > 0)
             {
                 if (!encodeHeader(buffer, header, previousPackets))
@@ -427,5 +380,82 @@ namespace relay
 
             return static_cast<uint32_t>(buffer.size()) - originalSize;
         }
+
+        struct CommandName
+        {
+            const char* name;
+            Command command;
+        };
+
+        static const CommandName COMMAND_NAMES[] = {
+            {"connect", Command::CONNECT},
+            {"onBWDone", Command::ON_BW_DONE},
+            {"_checkbw", Command::CHECK_BW},
+            {"createStream", Command::CREATE_STREAM},
+            {"releaseStream", Command::RELEASE_STREAM},
+            {"deleteStream", Command::DELETE_STREAM},
+            {"FCPublish", Command::FC_PUBLISH},
+            {"onFCPublish", Command::ON_FC_PUBLISH},
+            {"FCUnpublish", Command::FC_UNPUBLISH},
+            {"onFCUnpublish", Command::ON_FC_UNPUBLISH},
+            {"FCSubscribe", Command::FC_SUBSCRIBE},
+            {"onFCSubscribe", Command::ON_FC_SUBSCRIBE},
+            {"FCUnsubscribe", Command::FC_UNSUBSCRIBE},
+            {"onFCUnsubscribe", Command::ON_FC_UNSUBSCRIBE},
+            {"publish", Command::PUBLISH},
+            {"unpublish", Command::UNPUBLISH},
+            {"play", Command::PLAY},
+            {"getStreamLength", Command::GET_STREAM_LENGTH},
+            {"stop", Command::STOP},
+            {"onStatus", Command::ON_STATUS},
+            {"_error", Command::CALL_ERROR},
+            {"_result", Command::CALL_RESULT},
+            {"@setDataFrame", Command::SET_DATA_FRAME},
+            {"onMetaData", Command::ON_META_DATA},
+            {"onTextData", Command::ON_TEXT_DATA}
+        };
+
+        static const uint32_t COMMAND_TABLE_SIZE = 64;
+
+        // the multipliers are picked so that no two command names share a slot
+        static uint32_t hashCommand(const char* name, uint32_t length)
+        {
+            return (length +
+                    3 * static_cast<uint8_t>(name[0]) +
+                    5 * static_cast<uint8_t>(name[2]) +
+                    static_cast<uint8_t>(name[length - 1])) % COMMAND_TABLE_SIZE;
+        }
+
+        static std::vector<const CommandName*> createCommandTable()
+        {
+            std::vector<const CommandName*> table(COMMAND_TABLE_SIZE, nullptr);
+
+            for (const CommandName& commandName : COMMAND_NAMES)
+            {
+                const CommandName*& slot = table[hashCommand(commandName.name, static_cast<uint32_t>(strlen(commandName.name)))];
+                assert(!slot); // a new command name collides, the multipliers have to be changed
+                slot = &commandName;
+            }
+
+            return table;
+        }
+
+        static const std::vector<const CommandName*> COMMAND_TABLE = createCommandTable();
+
+        Command getCommand(const char* name, uint32_t length)
+        {
+            if (length < 3) return Command::UNKNOWN;
+
+            const CommandName* commandName = COMMAND_TABLE[hashCommand(name, length)];
+
+            if (commandName &&
+                strlen(commandName->name) == length &&
+                memcmp(commandName->name, name, length) == 0)
+            {
+                return commandName->command;
+            }
+
+            return Command::UNKNOWN;
+        }
     }
 }
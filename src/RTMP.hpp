@@ -102,5 +102,39 @@ namespace relay
             uint8_t version[4];
             uint8_t randomBytes[1528];
         };
+
+        // names of the invoke and notify commands the relay handles
+        enum class Command
+        {
+            UNKNOWN,
+            CONNECT,
+            ON_BW_DONE,
+            CHECK_BW,
+            CREATE_STREAM,
+            RELEASE_STREAM,
+            DELETE_STREAM,
+            FC_PUBLISH,
+            ON_FC_PUBLISH,
+            FC_UNPUBLISH,
+            ON_FC_UNPUBLISH,
+            FC_SUBSCRIBE,
+            ON_FC_SUBSCRIBE,
+            FC_UNSUBSCRIBE,
+            ON_FC_UNSUBSCRIBE,
+            PUBLISH,
+            UNPUBLISH,
+            PLAY,
+            GET_STREAM_LENGTH,
+            STOP,
+            ON_STATUS,
+            CALL_ERROR,
+            CALL_RESULT,
+            SET_DATA_FRAME,
+            ON_META_DATA,
+            ON_TEXT_DATA
+        };
+
+        // perfect hash lookup, one string compare per command
+        Command getCommand(const char* name, uint32_t length);
     }
 }
@@ -2,6 +2,7 @@
 //  rtmp_relay
 //
 
+#include <cstdlib>
 #include <ctime>
 #include <memory>
 #include <algorithm>
@@ -13,11 +14,16 @@
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
 #include "yaml-cpp/yaml.h"
 #include "Log.hpp"
+#include "HandOff.hpp"
 #include "Relay.hpp"
 #include "Status.hpp"
 #include "Connection.hpp"
+#include "Metrics.hpp"
 
 namespace relay
 {
@@ -25,7 +31,8 @@ namespace relay
 
     Relay::Relay(Network& aNetwork):
         generator(static_cast<unsigned int>(std::chrono::high_resolution_clock::now().time_since_epoch().count())),
-        network(aNetwork)
+        network(aNetwork),
+        connectScheduler(generator)
     {
         previousTime = std::chrono::steady_clock::now();
     }
@@ -43,26 +50,189 @@ namespace relay
         }
     }
 
-    bool Relay::init(const std::string& config)
+    bool Relay::init(const std::string& aConfigFile)
     {
-        servers.clear();
+        Config config;
+
+        if (!readConfig(aConfigFile, config))
+        {
+            return false;
+        }
+
+        configFile = aConfigFile;
+
         connections.clear();
+        servers.clear();
+        acceptors.clear();
         status.reset();
 
+        applyLogConfig(config);
+
+        if (config.hasTimeout)
+        {
+            timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(config.timeout * 1000));
+            hasTimeout = true;
+        }
+
+        drainTimeout = config.drainTimeout;
+        resolver.setCacheTime(config.dnsCacheTime);
+        connectScheduler.setMaxConnecting(config.maxConnecting);
+        connectScheduler.setMaxRetryInterval(config.maxReconnectInterval);
+        connectScheduler.setCircuitBreaker(config.circuitBreakerThreshold, config.circuitBreakerTime);
+        listenBacklog = config.listenBacklog;
+        acceptLimit = config.acceptLimit;
+        statusPageAddress = config.statusPageAddress;
+
+        if (!statusPageAddress.empty())
+        {
+            status.reset(new Status(network, *this, statusPageAddress));
+        }
+
+        for (const std::vector<Endpoint>& endpoints : config.servers)
+        {
+            std::unique_ptr<Server> server(new Server(*this, network));
+            server->start(endpoints);
+            servers.push_back(std::move(server));
+        }
+
+        for (const auto& listenAddress : config.listenAddresses)
+        {
+            startAcceptor(listenAddress.first, listenAddress.second);
+        }
+
+#ifndef _WIN32
+        // sockets of the previous process that are not in the configuration anymore
+        for (const auto& inheritedAcceptor : inheritedAcceptors)
+        {
+            Log(Log::Level::INFO) << "Closing inherited socket of " << inheritedAcceptor.first;
+            ::close(inheritedAcceptor.second);
+        }
+
+        inheritedAcceptors.clear();
+#endif
+
+        return true;
+    }
+
+    bool Relay::reload()
+    {
+        Config config;
+
+        if (!readConfig(configFile, config))
+        {
+            Log(Log::Level::ERR) << "Failed to reload " << configFile << ", keeping the current configuration";
+            return false;
+        }
+
+        applyLogConfig(config);
+
+        drainTimeout = config.drainTimeout;
+        resolver.setCacheTime(config.dnsCacheTime);
+        connectScheduler.setMaxConnecting(config.maxConnecting);
+        connectScheduler.setMaxRetryInterval(config.maxReconnectInterval);
+        connectScheduler.setCircuitBreaker(config.circuitBreakerThreshold, config.circuitBreakerTime);
+
+        if (config.statusPageAddress != statusPageAddress)
+        {
+            statusPageAddress = config.statusPageAddress;
+            status.reset();
+
+            if (!statusPageAddress.empty())
+            {
+                status.reset(new Status(network, *this, statusPageAddress));
+            }
+        }
+
+        // servers are matched by their position in the configuration,
+        // only the endpoints that differ from the running ones are restarted
+        for (size_t serverIndex = 0; serverIndex < config.servers.size(); ++serverIndex)
+        {
+            if (serverIndex < servers.size())
+            {
+                servers[serverIndex]->reload(config.servers[serverIndex]);
+            }
+            else
+            {
+                std::unique_ptr<Server> server(new Server(*this, network));
+                server->start(config.servers[serverIndex]);
+                servers.push_back(std::move(server));
+            }
+        }
+
+        for (size_t serverIndex = config.servers.size(); serverIndex < servers.size(); ++serverIndex)
+        {
+            servers[serverIndex]->stop();
+        }
+
+        // host connections of the removed endpoints must not outlive them
+        for (auto i = connections.begin(); i != connections.end();)
+        {
+            i = ((*i)->isClosed() ? connections.erase(i) : i + 1);
+        }
+
+        if (servers.size() > config.servers.size())
+        {
+            servers.erase(servers.begin() + static_cast<std::ptrdiff_t>(config.servers.size()), servers.end());
+        }
+
+        bool backlogChanged = (config.listenBacklog != listenBacklog);
+        listenBacklog = config.listenBacklog;
+        acceptLimit = config.acceptLimit;
+
+        for (auto i = acceptors.begin(); i != acceptors.end();)
+        {
+            auto listenAddress = config.listenAddresses.find(i->first);
+
+            if (listenAddress == config.listenAddresses.end())
+            {
+                Log(Log::Level::INFO) << "Stop listening on " << i->first;
+                i = acceptors.erase(i);
+            }
+            else
+            {
+                if (backlogChanged) i->second.setListenBacklog(listenBacklog);
+                i->second.setAcceptLimit(acceptLimit);
+                i->second.setOptions(listenAddress->second);
+                ++i;
+            }
+        }
+
+        for (const auto& listenAddress : config.listenAddresses)
+        {
+            if (acceptors.find(listenAddress.first) == acceptors.end())
+            {
+                startAcceptor(listenAddress.first, listenAddress.second);
+            }
+        }
+
+        Log(Log::Level::INFO) << "Configuration reloaded from " << configFile;
+
+        return true;
+    }
+
+    bool Relay::readConfig(const std::string& file, Config& config) const
+    {
+        config.logThreshold = Log::threshold;
+        config.syslogEnabled = Log::syslogEnabled;
+#ifndef _WIN32
+        config.syslogIdent = syslogIdent;
+        config.syslogFacility = syslogFacility;
+#endif
+
         YAML::Node document;
 
         try
         {
-            document = YAML::LoadFile(config);
+            document = YAML::LoadFile(file);
         }
         catch (YAML::BadFile)
         {
-            Log(Log::Level::ERR) << "Failed to open " << config;
+            Log(Log::Level::ERR) << "Failed to open " << file;
             return false;
         }
         catch (YAML::ParserException& e)
         {
-            Log(Log::Level::ERR) << "Failed to parse " << config << ", " << e.msg << " on line " << e.mark.line << " column " << e.mark.column;
+            Log(Log::Level::ERR) << "Failed to parse " << file << ", " << e.msg << " on line " << e.mark.line << " column " << e.mark.column;
             return false;
         }
 
@@ -72,44 +242,81 @@ namespace relay
 
             if (logObject["level"])
             {
-                Log::threshold = static_cast<Log::Level>(logObject["level"].as<uint32_t>());
+                config.logThreshold = static_cast<Log::Level>(logObject["level"].as<uint32_t>());
             }
 
 #ifndef _WIN32
             if (logObject["syslogEnabled"])
             {
-                Log::syslogEnabled = logObject["syslogEnabled"].as<bool>();
+                config.syslogEnabled = logObject["syslogEnabled"].as<bool>();
             }
 
             if (logObject["syslogIdent"])
             {
-                syslogIdent = logObject["syslogIdent"].as<std::string>();
+                config.syslogIdent = logObject["syslogIdent"].as<std::string>();
             }
 
             if (logObject["syslogFacility"])
             {
                 std::string facility = logObject["syslogFacility"].as<std::string>();
 
-                if (facility == "LOG_USER") syslogFacility = LOG_USER;
-                else if (facility == "LOG_LOCAL0") syslogFacility = LOG_LOCAL0;
-                else if (facility == "LOG_LOCAL1") syslogFacility = LOG_LOCAL1;
-                else if (facility == "LOG_LOCAL2") syslogFacility = LOG_LOCAL2;
-                else if (facility == "LOG_LOCAL3") syslogFacility = LOG_LOCAL3;
-                else if (facility == "LOG_LOCAL4") syslogFacility = LOG_LOCAL4;
-                else if (facility == "LOG_LOCAL5") syslogFacility = LOG_LOCAL5;
-                else if (facility == "LOG_LOCAL6") syslogFacility = LOG_LOCAL6;
-                else if (facility == "LOG_LOCAL7") syslogFacility = LOG_LOCAL7;
+                if (facility == "LOG_USER") config.syslogFacility = LOG_USER;
+                else if (facility == "LOG_LOCAL0") config.syslogFacility = LOG_LOCAL0;
+                else if (facility == "LOG_LOCAL1") config.syslogFacility = LOG_LOCAL1;
+                else if (facility == "LOG_LOCAL2") config.syslogFacility = LOG_LOCAL2;
+                else if (facility == "LOG_LOCAL3") config.syslogFacility = LOG_LOCAL3;
+                else if (facility == "LOG_LOCAL4") config.syslogFacility = LOG_LOCAL4;
+                else if (facility == "LOG_LOCAL5") config.syslogFacility = LOG_LOCAL5;
+                else if (facility == "LOG_LOCAL6") config.syslogFacility = LOG_LOCAL6;
+                else if (facility == "LOG_LOCAL7") config.syslogFacility = LOG_LOCAL7;
             }
 #endif
         }
 
-        openLog();
-
         if (document["timeout"])
         {
-            float ts = document["timeout"].as<float>();
-            timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(ts * 1000));
-            hasTimeout = true;
+            config.timeout = document["timeout"].as<float>();
+            config.hasTimeout = true;
+        }
+
+        if (document["drainTimeout"])
+        {
+            config.drainTimeout = document["drainTimeout"].as<float>();
+        }
+
+        if (document["dnsCacheTime"])
+        {
+            config.dnsCacheTime = document["dnsCacheTime"].as<float>();
+        }
+
+        if (document["maxConnecting"])
+        {
+            config.maxConnecting = document["maxConnecting"].as<uint32_t>();
+        }
+
+        if (document["maxReconnectInterval"])
+        {
+            config.maxReconnectInterval = document["maxReconnectInterval"].as<float>();
+        }
+
+        if (document["circuitBreakerThreshold"])
+        {
+            config.circuitBreakerThreshold = document["circuitBreakerThreshold"].as<uint32_t>();
+        }
+
+        if (document["circuitBreakerTime"])
+        {
+            config.circuitBreakerTime = document["circuitBreakerTime"].as<float>();
+        }
+
+        if (document["listenBacklog"])
+        {
+            config.listenBacklog = document["listenBacklog"].as<int>();
+        }
+
+        if (document["acceptLimit"])
+        {
+            config.acceptLimit = document["acceptLimit"].as<uint32_t>();
         }
 
         if (document["statusPage"])
@@ -118,11 +325,27 @@ namespace relay
 
             if (statusPageObject["address"])
             {
-                status.reset(new Status(network, *this, statusPageObject["address"].as<std::string>()));
+                config.statusPageAddress = statusPageObject["address"].as<std::string>();
             }
         }
 
-        std::set<std::string> listenAddresses;
+        std::map<std::string, SocketOptions> socketProfiles;
+
+        if (document["socketProfiles"])
+        {
+            for (const auto& socketProfileObject : document["socketProfiles"])
+            {
+                SocketOptions& options = socketProfiles[socketProfileObject.first.as<std::string>()];
+                const YAML::Node& optionsObject = socketProfileObject.second;
+
+                if (optionsObject["noDelay"]) options.noDelay = optionsObject["noDelay"].as<bool>();
+                if (optionsObject["sendBuffer"]) options.sendBuffer = optionsObject["sendBuffer"].as<int>();
+                if (optionsObject["receiveBuffer"]) options.receiveBuffer = optionsObject["receiveBuffer"].as<int>();
+                if (optionsObject["notSentLowat"]) options.notSentLowat = optionsObject["notSentLowat"].as<int>();
+                if (optionsObject["keepAlive"]) options.keepAlive = optionsObject["keepAlive"].as<int>();
+                if (optionsObject["cork"]) options.cork = optionsObject["cork"].as<bool>();
+            }
+        }
 
         const YAML::Node& serversArray = document["servers"];
 
@@ -154,6 +377,19 @@ namespace relay
                     if (endpointObject["direction"].as<std::string>() == "input") endpoint.direction = Connection::Direction::INPUT;
                     else if (endpointObject["direction"].as<std::string>() == "output") endpoint.direction = Connection::Direction::OUTPUT;
 
+                    if (endpointObject["socketProfile"])
+                    {
+                        auto socketProfile = socketProfiles.find(endpointObject["socketProfile"].as<std::string>());
+
+                        if (socketProfile == socketProfiles.end())
+                        {
+                            Log(Log::Level::ERR) << "Unknown socket profile \"" << endpointObject["socketProfile"].as<std::string>() << "\"";
+                            return false;
+                        }
+
+                        endpoint.socketOptions = socketProfile->second;
+                    }
+
                     if (endpointObject["address"].IsSequence())
                     {
                         const YAML::Node& addressArray = endpointObject["address"];
@@ -161,8 +397,11 @@ namespace relay
                         for (size_t addressIndex = 0; addressIndex < addressArray.size(); ++addressIndex)
                         {
                             std::string address = addressArray[addressIndex].as<std::string>();
-                            std::pair<uint32_t, uint16_t> addr;
-                            if (!Socket::getAddress(address, addr))
+                            std::pair<uint32_t, uint16_t> addr(ANY_ADDRESS, ANY_PORT);
+
+                            // client addresses are resolved by the resolver on every connect
+                            if (endpoint.connectionType == Connection::Type::HOST &&
+                                !Socket::getAddress(address, addr))
                             {
                                 return false;
                             }
@@ -174,15 +413,17 @@ namespace relay
 
                             if (endpoint.connectionType == Connection::Type::HOST)
                             {
-                                listenAddresses.insert(address);
+                                config.listenAddresses.insert(std::make_pair(address, endpoint.socketOptions));
                             }
                         }
                     }
                     else
                     {
                         std::string address = endpointObject["address"].as<std::string>();
-                        std::pair<uint32_t, uint16_t> addr;
-                        if (!Socket::getAddress(address, addr))
+                        std::pair<uint32_t, uint16_t> addr(ANY_ADDRESS, ANY_PORT);
+
+                        if (endpoint.connectionType == Connection::Type::HOST &&
+                            !Socket::getAddress(address, addr))
                         {
                             return false;
                         }
@@ -196,8 +437,18 @@ namespace relay
                     if (endpointObject["connectionTimeout"]) endpoint.connectionTimeout = endpointObject["connectionTimeout"].as<float>();
                     if (endpointObject["reconnectInterval"]) endpoint.reconnectInterval = endpointObject["reconnectInterval"].as<float>();
                     if (endpointObject["reconnectCount"]) endpoint.reconnectCount = endpointObject["reconnectCount"].as<uint32_t>();
+                    if (endpointObject["connectStagger"]) endpoint.connectStagger = endpointObject["connectStagger"].as<float>();
+                    if (endpointObject["fastOpen"]) endpoint.fastOpen = endpointObject["fastOpen"].as<bool>();
                     if (endpointObject["pingInterval"]) endpoint.pingInterval = endpointObject["pingInterval"].as<float>();
                     if (endpointObject["bufferSize"]) endpoint.bufferSize = endpointObject["bufferSize"].as<uint32_t>();
+                    if (endpointObject["poolSize"]) endpoint.poolSize = endpointObject["poolSize"].as<uint32_t>();
+                    if (endpointObject["multiplex"]) endpoint.multiplex = endpointObject["multiplex"].as<bool>();
+                    if (endpointObject["lingerTime"]) endpoint.lingerTime = endpointObject["lingerTime"].as<float>();
+                    if (endpointObject["backupInputs"]) endpoint.backupInputs = endpointObject["backupInputs"].as<uint32_t>();
+                    if (endpointObject["stallTimeout"]) endpoint.stallTimeout = endpointObject["stallTimeout"].as<float>();
+                    if (endpointObject["pacingHeadroom"]) endpoint.pacingHeadroom = endpointObject["pacingHeadroom"].as<float>();
+                    if (endpointObject["maxIngestRate"]) endpoint.maxIngestRate = endpointObject["maxIngestRate"].as<uint64_t>();
+                    if (endpointObject["maxIngestBuffer"]) endpoint.maxIngestBuffer = endpointObject["maxIngestBuffer"].as<uint32_t>();
 
                     if (endpointObject["applicationName"]) endpoint.applicationName = endpointObject["applicationName"].as<std::string>();
                     if (endpointObject["streamName"]) endpoint.streamName = endpointObject["streamName"].as<std::string>();
@@ -228,6 +479,45 @@ namespace relay
 
                     }
 
+                    if (endpoint.multiplex &&
+                        (endpoint.connectionType != Connection::Type::CLIENT || endpoint.direction != Connection::Direction::OUTPUT))
+                    {
+                        Log(Log::Level::WARN) << "Only client output endpoints can be multiplexed, ignoring multiplex";
+                        endpoint.multiplex = false;
+                    }
+
+                    if (endpoint.lingerTime > 0.0f &&
+                        (endpoint.connectionType != Connection::Type::CLIENT || endpoint.direction != Connection::Direction::INPUT || endpoint.isNameKnown()))
+                    {
+                        Log(Log::Level::WARN) << "Only client input endpoints that are pulled on demand can linger, ignoring lingerTime";
+                        endpoint.lingerTime = 0.0f;
+                    }
+
+                    if (endpoint.backupInputs > 0 && endpoint.direction != Connection::Direction::INPUT)
+                    {
+                        Log(Log::Level::WARN) << "Only input endpoints can have backup inputs, ignoring backupInputs";
+                        endpoint.backupInputs = 0;
+                    }
+
+                    if ((endpoint.maxIngestRate > 0 || endpoint.maxIngestBuffer > 0) && endpoint.direction != Connection::Direction::INPUT)
+                    {
+                        Log(Log::Level::WARN) << "Only input endpoints can limit ingest, ignoring maxIngestRate and maxIngestBuffer";
+                        endpoint.maxIngestRate = 0;
+                        endpoint.maxIngestBuffer = 0;
+                    }
+
+                    if (endpoint.pacingHeadroom > 0.0f && endpoint.pacingHeadroom < 1.0f)
+                    {
+                        Log(Log::Level::WARN) << "Pacing below the stream bitrate would never catch up, using pacingHeadroom 1.0";
+                        endpoint.pacingHeadroom = 1.0f;
+                    }
+
+                    if (endpoint.poolSize > 0 && (!endpoint.canPool() || endpoint.multiplex))
+                    {
+                        Log(Log::Level::WARN) << "Connection pool needs a client output endpoint with a fixed application name that is not multiplexed, ignoring poolSize";
+                        endpoint.poolSize = 0;
+                    }
+
                     endpoints.push_back(endpoint);
                 }
             }
@@ -249,23 +539,100 @@ namespace relay
                 }
             }
 
-            // start the server
-            std::unique_ptr<Server> server(new Server(*this, network));
-            server->start(endpoints);
-            servers.push_back(std::move(server));
+            config.servers.push_back(endpoints);
         }
 
-        for (const std::string& address : listenAddresses)
+        return true;
+    }
+
+    void Relay::applyLogConfig(const Config& config)
+    {
+        Log::threshold = config.logThreshold;
+        Log::syslogEnabled = config.syslogEnabled;
+#ifndef _WIN32
+        syslogIdent = config.syslogIdent;
+        syslogFacility = config.syslogFacility;
+#endif
+
+        openLog();
+    }
+
+    void Relay::startAcceptor(const std::string& address, const SocketOptions& options)
+    {
+        Socket acceptor(network);
+        acceptor.setAcceptCallback(std::bind(&Relay::handleAccept, this, std::placeholders::_1, std::placeholders::_2));
+        acceptor.setListenBacklog(listenBacklog);
+        acceptor.setAcceptLimit(acceptLimit);
+        acceptor.setOptions(options);
+
+#ifndef _WIN32
+        auto inheritedAcceptor = inheritedAcceptors.find(address);
+
+        if (inheritedAcceptor != inheritedAcceptors.end())
+        {
+            acceptor.startAccept(inheritedAcceptor->second);
+            inheritedAcceptors.erase(inheritedAcceptor);
+        }
+        else
+#endif
         {
-            Socket acceptor(network);
-            acceptor.setAcceptCallback(std::bind(&Relay::handleAccept, this, std::placeholders::_1, std::placeholders::_2));
             acceptor.startAccept(address);
-            acceptors.push_back(std::move(acceptor));
         }
 
-        return true;
+        acceptors.emplace(address, std::move(acceptor));
     }
 
+#ifndef _WIN32
+    void Relay::handOff()
+    {
+        if (draining || handOffPath.empty()) return;
+
+        std::map<std::string, socket_t> sockets;
+
+        for (const auto& acceptor : acceptors)
+        {
+            sockets[acceptor.first] = acceptor.second.getSocketFd();
+        }
+
+        // the status page is not handed off, free its address for the new process
+        status.reset();
+
+        if (!HandOff::send(handOffPath, sockets))
+        {
+            Log(Log::Level::ERR) << "Failed to hand off listening sockets, keeping them";
+
+            if (!statusPageAddress.empty())
+            {
+                status.reset(new Status(network, *this, statusPageAddress));
+            }
+
+            return;
+        }
+
+        // the new process waits for the lock before it takes over the pid file
+        if (lockFd != -1)
+        {
+            ::close(lockFd);
+            lockFd = -1;
+        }
+
+        // the new process owns the listening sockets now, close our copies
+        acceptors.clear();
+        statusPageAddress.clear();
+
+        draining = true;
+
+        for (const auto& server : servers)
+        {
+            server->drain();
+        }
+
+        drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(drainTimeout * 1000));
+
+        Log(Log::Level::INFO) << "Handed off " << sockets.size() << " listening socket(s), draining " << connections.size() << " connection(s)";
+    }
+#endif
+
     std::vector<std::pair<Server*, const Endpoint*>> Relay::getEndpoints(const std::pair<uint32_t, uint16_t>& address,
                                                                          Connection::Direction direction,
                                                                          const std::string& applicationName,
@@ -275,15 +642,17 @@ namespace relay
 
         for (const std::unique_ptr<Server>& server : servers)
         {
-            for (const Endpoint& endpoint : server->getEndpoints())
+            for (const auto& endpointPtr : server->getEndpoints())
             {
+                const Endpoint& endpoint = *endpointPtr;
+
                 try
                 {
                     if (endpoint.connectionType == Connection::Type::HOST &&
                         (endpoint.applicationName.empty() || std::regex_match(applicationName, std::regex(endpoint.applicationName))) &&
                         (endpoint.streamName.empty() || std::regex_match(streamName, std::regex(endpoint.streamName))))
                     {
-                        Log(Log::Level::ALL) << "Application \"" << applicationName << "\", stream \"" << streamName << "\" matched endpoint application \"" << endpoint.applicationName << "\", stream \"" << endpoint.streamName << "\"";
+                        LOG(Log::Level::ALL) << "Application \"" << applicationName << "\", stream \"" << streamName << "\" matched endpoint application \"" << endpoint.applicationName << "\", stream \"" << endpoint.streamName << "\"";
 
                         if (endpoint.direction == direction)
                         {
@@ -296,14 +665,14 @@ namespace relay
                                      endpointAddress.ipAddresses.first == address.first) &&
                                     endpointAddress.ipAddresses.second == address.second)
                                 {
-                                    Log(Log::Level::ALL) << "Address " << ipToString(address.first) << ":" << address.second << " matched address " << ipToString(endpointAddress.ipAddresses.first) << ":" << endpointAddress.ipAddresses.second;
+                                    LOG(Log::Level::ALL) << "Address " << ipToString(address.first) << ":" << address.second << " matched address " << ipToString(endpointAddress.ipAddresses.first) << ":" << endpointAddress.ipAddresses.second;
 
                                     found = true;
                                     break;
                                 }
                                 else
                                 {
-                                    Log(Log::Level::ALL) << "Address " << ipToString(address.first) << ":" << address.second << " did not match address " << ipToString(endpointAddress.ipAddresses.first) << ":" << endpointAddress.ipAddresses.second;
+                                    LOG(Log::Level::ALL) << "Address " << ipToString(address.first) << ":" << address.second << " did not match address " << ipToString(endpointAddress.ipAddresses.first) << ":" << endpointAddress.ipAddresses.second;
                                 }
                             }
 
@@ -315,7 +684,7 @@ namespace relay
                     }
                     else
                     {
-                        Log(Log::Level::ALL) << "Application: \"" << applicationName << "\", stream: \"" << streamName << "\" did not match endpoint application: \"" << endpoint.applicationName << "\", stream: \"" << endpoint.streamName << "\"";
+                        LOG(Log::Level::ALL) << "Application: \"" << applicationName << "\", stream: \"" << streamName << "\" did not match endpoint application: \"" << endpoint.applicationName << "\", stream: \"" << endpoint.streamName << "\"";
                     }
                 }
                 catch (std::regex_error e)
@@ -329,6 +698,32 @@ namespace relay
         return result;
     }
 
+    void Relay::closeConnections(const Endpoint& endpoint)
+    {
+        for (const auto& connection : connections)
+        {
+            if (connection->getEndpoint() == &endpoint)
+            {
+                connection->close(true);
+            }
+        }
+    }
+
+    Stream* Relay::findInputStream(const Endpoint& endpoint, const Server& excludedServer) const
+    {
+        for (const std::unique_ptr<Server>& server : servers)
+        {
+            if (server.get() == &excludedServer) continue;
+
+            if (Stream* stream = server->findInputStream(endpoint))
+            {
+                return stream;
+            }
+        }
+
+        return nullptr;
+    }
+
     void Relay::close()
     {
         connections.clear();
@@ -342,16 +737,64 @@ namespace relay
 
         while (active)
         {
+            if (stopRequested.exchange(false))
+            {
+                // shutdown the server
+                close();
+                Log::stopThread();
+                closeLog();
+                exit(EXIT_SUCCESS);
+            }
+
+            if (statsRequested.exchange(false))
+            {
+                std::string str;
+                getStats(str, ReportType::TEXT);
+                Log(Log::Level::INFO) << str;
+            }
+
+            if (brokenPipe.exchange(false))
+            {
+                Log(Log::Level::ERR) << "Received SIGPIPE";
+            }
+
+            if (reloadRequested.exchange(false) && !draining)
+            {
+                reload();
+            }
+
+#ifndef _WIN32
+            if (handOffRequested.exchange(false))
+            {
+                handOff();
+            }
+#endif
+
             auto currentTime = std::chrono::steady_clock::now();
             if (hasTimeout && currentTime > timeout)
             {
                 break;
             }
 
+            if (draining)
+            {
+                if (connections.empty())
+                {
+                    Log(Log::Level::INFO) << "All connections drained, exiting";
+                    break;
+                }
+                else if (currentTime > drainDeadline)
+                {
+                    Log(Log::Level::INFO) << "Drain timeout reached, closing " << connections.size() << " connection(s)";
+                    break;
+                }
+            }
+
             float delta = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - previousTime).count() / 1000.0f;
             previousTime = currentTime;
 
             network.update();
+            resolver.update();
 
             if (status) status->update(delta);
 
@@ -377,10 +820,41 @@ namespace relay
                 server->update(delta);
             }
 
+            Metrics::observe(Metrics::Histogram::LOOP_TIME, std::chrono::steady_clock::now() - currentTime);
+
             std::this_thread::sleep_for(sleepTime);
         }
     }
 
+    void Relay::getMetrics(std::string& str) const
+    {
+        std::map<Connection*, Stream*> cons;
+
+        for (auto& c : connections)
+        {
+            cons[c.get()] = c->getStream();
+        }
+
+        for (auto& s : servers)
+        {
+            s->getConnections(cons);
+        }
+
+        // multiplexed streams share the queue of their carrier, which is counted on its own
+        std::map<uint32_t, uint64_t> queuedBytes;
+
+        for (const auto& c : cons)
+        {
+            if (!c.first->isCarried()) queuedBytes[c.first->getMetricsSeries()] += c.first->getQueuedBytes();
+        }
+
+        Metrics::write(str);
+        Metrics::writeGauge(str, "rtmp_relay_queued_bytes", "Bytes waiting to be written to the network", queuedBytes);
+        Metrics::writeGauge(str, "rtmp_relay_connections", "Open connections", cons.size());
+        Metrics::writeGauge(str, "rtmp_relay_connecting", "Connects and handshakes in flight", connectScheduler.getConnecting());
+        Metrics::writeGauge(str, "rtmp_relay_queued_log_messages", "Log messages waiting for the log thread", Log::getQueueLength());
+    }
+
     void Relay::getStats(std::string& str, ReportType reportType) const
     {
         std::map<Connection*, Stream*> cons;
@@ -391,9 +865,15 @@ namespace relay
             cons[c.get()] = c->getStream();
         }
 
+        Server::PullStats pullStats;
+
         for (auto& s : servers)
         {
             s->getConnections(cons);
+
+            pullStats.hits += s->getPullStats().hits;
+            pullStats.misses += s->getPullStats().misses;
+            pullStats.expired += s->getPullStats().expired;
         }
 
         switch (reportType)
@@ -453,11 +933,24 @@ namespace relay
                     }
                 }
 
+                str += "\nListeners:\n";
+                for (const auto& acceptor : acceptors)
+                {
+                    str += acceptor.first + " accepted: " + std::to_string(acceptor.second.getAcceptedCount()) +
+                        ", rejected: " + std::to_string(acceptor.second.getAcceptOverflowCount()) + "\n";
+                }
+
+                connectScheduler.getStats(str, reportType);
+
+                str += "\nPulled inputs:\nhits: " + std::to_string(pullStats.hits) +
+                    ", misses: " + std::to_string(pullStats.misses) +
+                    ", expired: " + std::to_string(pullStats.expired) + "\n";
+
                 break;
             }
             case ReportType::HTML:
             {
-                auto header = "<table border=\"1\" cellspacing=\"0\" cellpadding=\"5\"><tr><th>ID</th><th>Name</th><th>Application</th><th>Status</th><th>Address</th><th>Connection</th><th>State</th><th>Direction</th><th>Server ID</th><th>Meta data</th></tr>";
+                auto header = "<table border=\"1\" cellspacing=\"0\" cellpadding=\"5\"><tr><th>ID</th><th>Name</th><th>Application</th><th>Status</th><th>Address</th><th>Connection</th><th>State</th><th>Direction</th><th>Server ID</th><th>TCP</th><th>Meta data</th></tr>";
 
                 str = "<html><title>Status</title><body>";
 
@@ -548,7 +1041,22 @@ namespace relay
                         str += "]}";
                     }
                 }
-                str += "]}";
+                str += "], \"listeners\":[";
+                first = true;
+                for (const auto& acceptor : acceptors)
+                {
+                    if (!first) str += ",";
+                    first = false;
+                    str += "{\"address\":\"" + acceptor.first + "\"," +
+                        "\"accepted\":" + std::to_string(acceptor.second.getAcceptedCount()) + "," +
+                        "\"rejected\":" + std::to_string(acceptor.second.getAcceptOverflowCount()) + "}";
+                }
+                str += "], \"reconnects\":";
+                connectScheduler.getStats(str, reportType);
+                str += ", \"pulls\":{\"hits\":" + std::to_string(pullStats.hits) + "," +
+                    "\"misses\":" + std::to_string(pullStats.misses) + "," +
+                    "\"expired\":" + std::to_string(pullStats.expired) + "}";
+                str += "}";
                 
                 break;
             }
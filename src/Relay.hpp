@@ -4,8 +4,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <map>
 #include <memory>
 #include <random>
+#include <set>
 #include <vector>
 #include <utility>
 #include <chrono>
@@ -14,6 +17,9 @@
 #include "Status.hpp"
 #include "Server.hpp"
 #include "Endpoint.hpp"
+#include "Resolver.hpp"
+#include "ConnectScheduler.hpp"
+#include "Log.hpp"
 
 #ifndef _WIN32
 #  include <sys/syslog.h>
@@ -38,13 +44,30 @@ namespace relay
 
         std::mt19937& getGenerator() { return generator; }
         Network& getNetwork() { return network; }
-
-        bool init(const std::string& config);
+        Resolver& getResolver() { return resolver; }
+        ConnectScheduler& getConnectScheduler() { return connectScheduler; }
+
+        bool init(const std::string& aConfigFile);
+        bool reload();
+        void requestReload() { reloadRequested = true; }
+        // called from signal handlers, the work is done in the main loop
+        void requestStop() { stopRequested = true; }
+        void requestStats() { statsRequested = true; }
+        void reportBrokenPipe() { brokenPipe = true; }
         void close();
 
+#ifndef _WIN32
+        // the lock file is released once the listening sockets are handed off
+        void setHandOffPath(const std::string& path, int aLockFd) { handOffPath = path; lockFd = aLockFd; }
+        void requestHandOff() { handOffRequested = true; }
+        void inheritAcceptors(const std::map<std::string, socket_t>& sockets) { inheritedAcceptors = sockets; }
+#endif
+
         void run();
 
         void getStats(std::string& str, ReportType reportType) const;
+        // counters, histograms and queue depths in Prometheus text format
+        void getMetrics(std::string& str) const;
 
         void openLog();
         void closeLog();
@@ -54,14 +77,58 @@ namespace relay
                                                                       const std::string& apyplicationName,
                                                                       const std::string& streamName) const;
 
+        void closeConnections(const Endpoint& endpoint);
+
+        // stream of another server that already pulls the same source as the endpoint
+        Stream* findInputStream(const Endpoint& endpoint, const Server& excludedServer) const;
+
     private:
+        struct Config
+        {
+            Log::Level logThreshold;
+            bool syslogEnabled;
+#ifndef _WIN32
+            std::string syslogIdent;
+            int syslogFacility;
+#endif
+            bool hasTimeout = false;
+            float timeout = 0.0f;
+            float drainTimeout = 60.0f;
+            float dnsCacheTime = 60.0f;
+            uint32_t maxConnecting = 64;
+            float maxReconnectInterval = 60.0f;
+            uint32_t circuitBreakerThreshold = 10;
+            float circuitBreakerTime = 30.0f;
+            int listenBacklog = 0;
+            uint32_t acceptLimit = 0;
+            std::string statusPageAddress;
+            std::vector<std::vector<Endpoint>> servers;
+            // listen addresses with the socket options of the first host endpoint on them
+            std::map<std::string, SocketOptions> listenAddresses;
+        };
+
+        bool readConfig(const std::string& file, Config& config) const;
+        void applyLogConfig(const Config& config);
+        void startAcceptor(const std::string& address, const SocketOptions& options);
+#ifndef _WIN32
+        void handOff();
+#endif
+
         void handleAccept(Socket& acceptor, Socket& clientSocket);
 
         static uint64_t currentId;
         std::mt19937 generator;
         bool active = true;
+        std::atomic<bool> reloadRequested{false};
+        std::atomic<bool> stopRequested{false};
+        std::atomic<bool> statsRequested{false};
+        std::atomic<bool> brokenPipe{false};
+        std::string configFile;
+        std::string statusPageAddress;
 
         Network& network;
+        Resolver resolver;
+        ConnectScheduler connectScheduler;
         std::unique_ptr<Status> status;
         std::chrono::steady_clock::time_point previousTime;
         std::chrono::steady_clock::time_point timeout;
@@ -70,7 +137,20 @@ namespace relay
         std::vector<std::unique_ptr<Server>> servers;
         std::vector<std::unique_ptr<Connection>> connections;
 
-        std::vector<Socket> acceptors;
+        std::map<std::string, Socket> acceptors;
+        int listenBacklog = 0;
+        uint32_t acceptLimit = 0;
+
+        float drainTimeout = 60.0f;
+        bool draining = false;
+        std::chrono::steady_clock::time_point drainDeadline;
+
+#ifndef _WIN32
+        std::atomic<bool> handOffRequested{false};
+        std::string handOffPath;
+        int lockFd = -1;
+        std::map<std::string, socket_t> inheritedAcceptors;
+#endif
 
 #ifndef _WIN32
         std::string syslogIdent;
@@ -0,0 +1,197 @@
+//
+//  rtmp_relay
+//
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  undef NOMINMAX
+#  undef WIN32_LEAN_AND_MEAN
+#else
+#  include <sys/socket.h>
+#  include <netinet/in.h>
+#  include <netdb.h>
+#endif
+#include <cstring>
+#include <thread>
+#include "Resolver.hpp"
+#include "Socket.hpp"
+#include "Log.hpp"
+
+namespace relay
+{
+    Resolver::Resolver():
+        queue(std::make_shared<Queue>())
+    {
+    }
+
+    Resolver::~Resolver()
+    {
+        // the worker is detached, it exits after its current lookup
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->running = false;
+        queue->addresses.clear();
+        queue->condition.notify_all();
+    }
+
+    uint64_t Resolver::resolve(const std::string& address, const Callback& callback)
+    {
+        auto cacheEntry = cache.find(address);
+
+        if (cacheEntry != cache.end() && cacheEntry->second.expiry > std::chrono::steady_clock::now())
+        {
+            callback(true, cacheEntry->second.ipAddress);
+            return 0;
+        }
+
+        uint64_t requestId = ++lastRequestId;
+        Request& request = requests[requestId];
+        request.address = address;
+        request.callback = callback;
+
+        // one lookup per address no matter how many connections wait for it
+        if (pendingAddresses.insert(address).second)
+        {
+            if (!started)
+            {
+                std::thread(&Resolver::run, queue).detach();
+                started = true;
+            }
+
+            LOG(Log::Level::ALL) << "Resolving " << address;
+
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->addresses.push_back(address);
+            queue->condition.notify_one();
+        }
+
+        return requestId;
+    }
+
+    void Resolver::cancel(uint64_t requestId)
+    {
+        requests.erase(requestId);
+    }
+
+    void Resolver::update()
+    {
+        std::vector<Result> results;
+
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->results.empty()) return;
+            results.swap(queue->results);
+        }
+
+        for (const Result& result : results)
+        {
+            pendingAddresses.erase(result.address);
+
+            bool success = result.success;
+            std::pair<uint32_t, uint16_t> ipAddress = result.ipAddress;
+            auto cacheEntry = cache.find(result.address);
+
+            if (success)
+            {
+                CacheEntry& entry = cache[result.address];
+
+                if (cacheEntry != cache.end() && entry.ipAddress != ipAddress)
+                {
+                    Log(Log::Level::INFO) << result.address << " now resolves to " << ipToString(ipAddress.first);
+                }
+
+                entry.ipAddress = ipAddress;
+                entry.expiry = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(cacheTime * 1000));
+            }
+            else if (cacheEntry != cache.end())
+            {
+                // keep using the last known address while the resolver is failing
+                Log(Log::Level::WARN) << "Failed to resolve " << result.address << ", using the cached address " << ipToString(cacheEntry->second.ipAddress.first);
+                success = true;
+                ipAddress = cacheEntry->second.ipAddress;
+            }
+            else
+            {
+                Log(Log::Level::ERR) << "Failed to resolve " << result.address;
+            }
+
+            // callbacks can start new requests, collect them first
+            std::vector<Callback> callbacks;
+
+            for (auto i = requests.begin(); i != requests.end();)
+            {
+                if (i->second.address == result.address)
+                {
+                    callbacks.push_back(i->second.callback);
+                    i = requests.erase(i);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+
+            for (const Callback& callback : callbacks)
+            {
+                callback(success, ipAddress);
+            }
+        }
+    }
+
+    void Resolver::run(std::shared_ptr<Queue> queue)
+    {
+        for (;;)
+        {
+            std::string address;
+
+            {
+                std::unique_lock<std::mutex> lock(queue->mutex);
+                queue->condition.wait(lock, [&queue]() { return !queue->running || !queue->addresses.empty(); });
+
+                if (!queue->running) break;
+
+                address = queue->addresses.front();
+                queue->addresses.pop_front();
+            }
+
+            Result result;
+            result.address = address;
+            result.success = getAddress(address, result.ipAddress);
+
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->results.push_back(result);
+        }
+    }
+
+    bool Resolver::getAddress(const std::string& address, std::pair<uint32_t, uint16_t>& result)
+    {
+        result.first = ANY_ADDRESS;
+        result.second = ANY_PORT;
+
+        size_t i = address.find(':');
+        std::string addressStr = address.substr(0, i);
+        std::string portStr = (i != std::string::npos) ? address.substr(i + 1) : std::string();
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* info;
+
+        if (getaddrinfo(addressStr.c_str(), portStr.empty() ? nullptr : portStr.c_str(), &hints, &info) != 0)
+        {
+            return false;
+        }
+
+        sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(info->ai_addr);
+        result.first = addr->sin_addr.s_addr;
+        result.second = ntohs(addr->sin_port);
+
+        freeaddrinfo(info);
+
+        return true;
+    }
+}
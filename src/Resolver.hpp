@@ -0,0 +1,88 @@
+//
+//  rtmp_relay
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace relay
+{
+    // resolves "host:port" addresses on a worker thread, results are cached
+    // and delivered to the callbacks from update on the main thread
+    class Resolver
+    {
+    public:
+        typedef std::function<void(bool, const std::pair<uint32_t, uint16_t>&)> Callback;
+
+        Resolver();
+        ~Resolver();
+
+        Resolver(const Resolver&) = delete;
+        Resolver& operator=(const Resolver&) = delete;
+        Resolver(Resolver&&) = delete;
+        Resolver& operator=(Resolver&&) = delete;
+
+        void setCacheTime(float newCacheTime) { cacheTime = newCacheTime; }
+
+        // calls the callback right away on a cache hit and returns 0,
+        // otherwise returns the id of the request that can be cancelled
+        uint64_t resolve(const std::string& address, const Callback& callback);
+        void cancel(uint64_t requestId);
+
+        void update();
+
+    private:
+        struct Result
+        {
+            std::string address;
+            bool success;
+            std::pair<uint32_t, uint16_t> ipAddress;
+        };
+
+        // shared with the worker thread, which may outlive the resolver
+        struct Queue
+        {
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool running = true;
+            std::deque<std::string> addresses;
+            std::vector<Result> results;
+        };
+
+        struct Request
+        {
+            std::string address;
+            Callback callback;
+        };
+
+        struct CacheEntry
+        {
+            std::pair<uint32_t, uint16_t> ipAddress;
+            std::chrono::steady_clock::time_point expiry;
+        };
+
+        static void run(std::shared_ptr<Queue> queue);
+        static bool getAddress(const std::string& address, std::pair<uint32_t, uint16_t>& result);
+
+        float cacheTime = 60.0f;
+        uint64_t lastRequestId = 0;
+        std::map<uint64_t, Request> requests;
+        std::map<std::string, CacheEntry> cache;
+        std::set<std::string> pendingAddresses;
+
+        std::shared_ptr<Queue> queue;
+        bool started = false;
+    };
+}
@@ -2,8 +2,10 @@
 //  rtmp_relay
 //
 
+#include <algorithm>
 #include "Server.hpp"
 #include "Relay.hpp"
+#include "Log.hpp"
 
 namespace relay
 {
@@ -26,6 +28,38 @@ namespace relay
         {
             c->close(true);
         }
+
+        for (auto& c : carriers)
+        {
+            c->close(true);
+        }
+
+        for (const auto& endpoint : endpoints)
+        {
+            relay.closeConnections(*endpoint);
+        }
+    }
+
+    void Server::drain()
+    {
+        draining = true;
+
+        // the new process pulls and pushes the streams that no host connection uses
+        for (const auto& stream : streams)
+        {
+            if (!stream->isClosed() && !stream->hasHostConnections()) stream->close();
+        }
+
+        for (const auto& connection : connections)
+        {
+            if (connection->isPooled()) connection->close(true);
+            else connection->stopReconnecting();
+        }
+
+        for (const auto& carrier : carriers)
+        {
+            carrier->stopReconnecting();
+        }
     }
 
     Stream* Server::findStream(const std::string& applicationName,
@@ -44,16 +78,112 @@ namespace relay
         return nullptr;
     }
 
+    Stream* Server::findInputStream(const Endpoint& endpoint) const
+    {
+        for (const auto& connection : connections)
+        {
+            if (!connection->isClosed() &&
+                connection->getStream() &&
+                connection->getEndpoint() &&
+                connection->getEndpoint()->isSameSource(endpoint))
+            {
+                return connection->getStream();
+            }
+        }
+
+        return nullptr;
+    }
+
+    void Server::inputLost(const Stream& stream)
+    {
+        for (const auto& endpoint : endpoints)
+        {
+            if (endpoint->connectionType == Connection::Type::CLIENT &&
+                endpoint->direction == Connection::Direction::INPUT &&
+                endpoint->isNameKnown() &&
+                endpoint->applicationName == stream.getApplicationName() &&
+                endpoint->streamName == stream.getStreamName() &&
+                std::find(lostInputs.begin(), lostInputs.end(), endpoint.get()) == lostInputs.end() &&
+                std::none_of(connections.begin(), connections.end(), [&endpoint](const std::unique_ptr<Connection>& c) {
+                    return c->getEndpoint() == endpoint.get() && !c->isClosed();
+                }))
+            {
+                lostInputs.push_back(endpoint.get());
+            }
+        }
+    }
+
     Connection* Server::createConnection(Stream& stream,
                                          const Endpoint& endpoint)
     {
+        if (endpoint.poolSize > 0)
+        {
+            for (const auto& connection : connections)
+            {
+                if (connection->isPooled() &&
+                    connection->getEndpoint() == &endpoint &&
+                    connection->isConnected())
+                {
+                    connection->takeFromPool(stream);
+                    return connection.get();
+                }
+            }
+        }
+
         std::unique_ptr<Connection> connection(new Connection(relay, stream, endpoint));
         Connection* connectionPtr = connection.get();
         connections.push_back(std::move(connection));
 
+        if (draining) connectionPtr->stopReconnecting();
+        connectionPtr->connect();
+
         return connectionPtr;
     }
 
+    Connection& Server::getCarrier(const Endpoint& endpoint,
+                                   const std::string& applicationName)
+    {
+        for (const auto& carrier : carriers)
+        {
+            if (!carrier->isClosed() &&
+                carrier->getEndpoint() == &endpoint &&
+                carrier->getApplicationName() == applicationName)
+            {
+                return *carrier;
+            }
+        }
+
+        std::unique_ptr<Connection> carrier(new Connection(relay, endpoint, applicationName));
+        Connection& carrierRef = *carrier;
+        carriers.push_back(std::move(carrier));
+
+        if (draining) carrierRef.stopReconnecting();
+        carrierRef.connect();
+
+        return carrierRef;
+    }
+
+    void Server::fillPools()
+    {
+        for (const auto& endpoint : endpoints)
+        {
+            if (endpoint->poolSize == 0) continue;
+
+            uint32_t pooledConnections = static_cast<uint32_t>(std::count_if(connections.begin(), connections.end(),
+                [&endpoint](const std::unique_ptr<Connection>& connection) {
+                    return connection->isPooled() && connection->getEndpoint() == endpoint.get();
+                }));
+
+            for (; pooledConnections < endpoint->poolSize; ++pooledConnections)
+            {
+                std::unique_ptr<Connection> connection(new Connection(relay, *endpoint, endpoint->applicationName));
+                connection->setPooled(true);
+                connection->connect();
+                connections.push_back(std::move(connection));
+            }
+        }
+    }
+
     void Server::deleteConnection(Connection* connection)
     {
         for (auto i = connections.begin(); i != connections.end();)
@@ -96,32 +226,168 @@ namespace relay
 
     void Server::start(const std::vector<Endpoint>& aEndpoints)
     {
-        endpoints = aEndpoints;
+        endpoints.clear();
+
+        for (const Endpoint& endpoint : aEndpoints)
+        {
+            endpoints.push_back(std::unique_ptr<Endpoint>(new Endpoint(endpoint)));
+        }
 
-        for (const Endpoint& endpoint : endpoints)
+        for (const auto& endpoint : endpoints)
         {
-            if (endpoint.connectionType == Connection::Type::CLIENT &&
-                endpoint.direction == Connection::Direction::INPUT &&
-                endpoint.isNameKnown())
+            startEndpoint(*endpoint);
+        }
+    }
+
+    void Server::reload(const std::vector<Endpoint>& newEndpoints)
+    {
+        // index of the running endpoint that is identical to the new one (endpoints.size() if there is none)
+        std::vector<size_t> sources(newEndpoints.size(), endpoints.size());
+        std::vector<bool> kept(endpoints.size(), false);
+
+        for (size_t newIndex = 0; newIndex < newEndpoints.size(); ++newIndex)
+        {
+            for (size_t index = 0; index < endpoints.size(); ++index)
             {
-                Socket socket(network);
+                if (!kept[index] && *endpoints[index] == newEndpoints[newIndex])
+                {
+                    kept[index] = true;
+                    sources[newIndex] = index;
+                    break;
+                }
+            }
+        }
 
-                Stream* stream = createStream(endpoint.applicationName,
-                                              endpoint.streamName);
+        // endpoints that were removed or changed have to drop their connections before they are deleted
+        for (size_t index = 0; index < endpoints.size(); ++index)
+        {
+            if (!kept[index])
+            {
+                removeEndpoint(*endpoints[index]);
+            }
+        }
 
-                std::unique_ptr<Connection> connection(new Connection(relay,
-                                                                      *stream,
-                                                                      endpoint));
+        std::vector<std::unique_ptr<Endpoint>> reloadedEndpoints;
+        std::vector<const Endpoint*> addedEndpoints;
 
-                connection->setStream(stream);
+        for (size_t newIndex = 0; newIndex < newEndpoints.size(); ++newIndex)
+        {
+            if (sources[newIndex] < endpoints.size())
+            {
+                reloadedEndpoints.push_back(std::move(endpoints[sources[newIndex]]));
+            }
+            else
+            {
+                reloadedEndpoints.push_back(std::unique_ptr<Endpoint>(new Endpoint(newEndpoints[newIndex])));
+                addedEndpoints.push_back(reloadedEndpoints.back().get());
+            }
+        }
 
-                connection->connect();
+        endpoints = std::move(reloadedEndpoints);
 
-                connections.push_back(std::move(connection));
+        for (const Endpoint* endpoint : addedEndpoints)
+        {
+            startEndpoint(*endpoint);
+
+            for (const auto& stream : streams)
+            {
+                stream->addEndpoint(*endpoint);
+            }
+        }
+
+        Log(Log::Level::INFO) << "Server " << id << " reloaded, " << static_cast<uint32_t>(addedEndpoints.size()) << " endpoint(s) started, " << static_cast<uint32_t>(std::count(kept.begin(), kept.end(), false)) << " endpoint(s) stopped";
+    }
+
+    void Server::startEndpoint(const Endpoint& endpoint)
+    {
+        if (draining) return;
+
+        if (endpoint.connectionType == Connection::Type::CLIENT &&
+            endpoint.direction == Connection::Direction::INPUT &&
+            endpoint.isNameKnown())
+        {
+            Stream* stream = findStream(endpoint.applicationName,
+                                        endpoint.streamName);
+
+            if (!stream)
+            {
+                stream = createStream(endpoint.applicationName,
+                                      endpoint.streamName);
+            }
+
+            // another server already pulls this input, follow its stream instead of connecting twice
+            if (Stream* sharedStream = relay.findInputStream(endpoint, *this))
+            {
+                if (!stream->getLeader())
+                {
+                    Log(Log::Level::INFO) << "Server " << id << " sharing input " << endpoint.applicationName << "/" << endpoint.streamName << " of stream " << sharedStream->getId();
+                    sharedStream->addFollower(*stream);
+                }
+
+                return;
             }
+
+            std::unique_ptr<Connection> connection(new Connection(relay,
+                                                                  *stream,
+                                                                  endpoint));
+
+            connection->setStream(stream);
+
+            connection->connect();
+
+            connections.push_back(std::move(connection));
         }
     }
 
+    void Server::removeEndpoint(const Endpoint& endpoint)
+    {
+        auto lostInput = std::find(lostInputs.begin(), lostInputs.end(), &endpoint);
+        if (lostInput != lostInputs.end()) lostInputs.erase(lostInput);
+
+        if (endpoint.connectionType == Connection::Type::CLIENT &&
+            endpoint.direction == Connection::Direction::INPUT &&
+            endpoint.isNameKnown())
+        {
+            if (Stream* stream = findStream(endpoint.applicationName, endpoint.streamName))
+            {
+                stream->unfollow();
+            }
+        }
+
+        for (const auto& stream : streams)
+        {
+            stream->removeEndpoint(endpoint);
+        }
+
+        for (auto i = connections.begin(); i != connections.end();)
+        {
+            if ((*i)->getEndpoint() == &endpoint)
+            {
+                (*i)->close(true);
+                i = connections.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        for (auto i = carriers.begin(); i != carriers.end();)
+        {
+            if ((*i)->getEndpoint() == &endpoint)
+            {
+                (*i)->close(true);
+                i = carriers.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        relay.closeConnections(endpoint);
+    }
+
     void Server::update(float delta)
     {
         for (auto i = connections.begin(); i != connections.end();)
@@ -134,6 +400,38 @@ namespace relay
             si = ((*si)->isClosed() ? streams.erase(si) : si + 1);
         }
 
+        for (const auto& stream : streams)
+        {
+            stream->update(delta);
+        }
+
+        // replace the pooled connections that were taken by streams
+        if (!draining) fillPools();
+
+        if (!lostInputs.empty())
+        {
+            std::vector<const Endpoint*> endpointsToStart;
+            endpointsToStart.swap(lostInputs);
+
+            for (const Endpoint* endpoint : endpointsToStart)
+            {
+                startEndpoint(*endpoint);
+            }
+        }
+
+        for (auto i = carriers.begin(); i != carriers.end();)
+        {
+            if ((*i)->isClosed())
+            {
+                i = carriers.erase(i);
+            }
+            else
+            {
+                (*i)->update(delta);
+                ++i;
+            }
+        }
+
         // update connections
         for (auto i = connections.begin(); i != connections.end();)
         {
@@ -155,6 +453,11 @@ namespace relay
 
     void Server::getConnections(std::map<Connection*, Stream*>& cons)
     {
+        for (auto& c : carriers)
+        {
+            cons[c.get()] = nullptr;
+        }
+
         for (auto& c : connections)
         {
             cons[c.get()] = c->getStream();
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 #include "Connection.hpp"
 #include "Endpoint.hpp"
@@ -14,6 +15,14 @@ namespace relay
     class Server
     {
     public:
+        // on-demand inputs: viewers that found a lingering input, inputs that had to be pulled and lingering inputs that timed out
+        struct PullStats
+        {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t expired = 0;
+        };
+
         Server(Relay& aRelay, Network& aNetwork);
 
         Server(const Server&) = delete;
@@ -23,38 +32,62 @@ namespace relay
 
         uint64_t getId() const { return id; }
 
+        // creates and connects a connection, or takes a connected one from the pool of the endpoint
         Connection* createConnection(Stream& stream,
                                      const Endpoint& endpoint);
+        // connection shared by the streams of a multiplexed endpoint with the same application name
+        Connection& getCarrier(const Endpoint& endpoint,
+                               const std::string& applicationName);
 
         Stream* findStream(const std::string& applicationName,
                            const std::string& streamName) const;
         Stream* createStream(const std::string& applicationName,
                              const std::string& streamName);
         void deleteStream(Stream* stream);
+        // stream fed by an input connection of this server that pulls the same source as the endpoint
+        Stream* findInputStream(const Endpoint& endpoint) const;
+        // the stream was following a stream of another server that stopped pulling the input
+        void inputLost(const Stream& stream);
 
         void start(const std::vector<Endpoint>& aEndpoints);
+        void reload(const std::vector<Endpoint>& newEndpoints);
 
         void update(float delta);
         void getStats(std::string& str, ReportType reportType) const;
 
-        const std::vector<Endpoint>& getEndpoints() const { return endpoints; }
+        const std::vector<std::unique_ptr<Endpoint>>& getEndpoints() const { return endpoints; }
         void cleanup() { needsCleanup = true; }
+        PullStats& getPullStats() { return pullStats; }
+        const PullStats& getPullStats() const { return pullStats; }
         void getConnections(std::map<Connection*, Stream*>& cons);
 
         void stop();
+        // stops what the server opened itself, only the host connections are left to finish
+        void drain();
 
     private:
         Relay& relay;
         const uint64_t id;
 
         Network& network;
-        std::vector<Endpoint> endpoints;
+        std::vector<std::unique_ptr<Endpoint>> endpoints;
 
         std::vector<std::unique_ptr<Stream>> streams;
+        // destroyed after the connections they carry
+        std::vector<std::unique_ptr<Connection>> carriers;
         std::vector<std::unique_ptr<Connection>> connections;
 
+        // endpoints that were following another server and have to start their own input
+        std::vector<const Endpoint*> lostInputs;
+
         bool needsCleanup = false;
+        bool draining = false;
+        PullStats pullStats;
 
         void deleteConnection(Connection* connection);
+
+        void startEndpoint(const Endpoint& endpoint);
+        void fillPools();
+        void removeEndpoint(const Endpoint& endpoint);
     };
 }
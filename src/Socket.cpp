@@ -11,10 +11,15 @@
 #  undef WIN32_LEAN_AND_MEAN
 #else
 #  include <sys/socket.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <unistd.h>
 #endif
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <limits>
 #include <fcntl.h>
 #include "Socket.hpp"
 #include "Network.hpp"
@@ -22,7 +27,11 @@
 
 namespace relay
 {
-    static const int WAITING_QUEUE_SIZE = 5;
+    static const uint64_t MIN_PACING_RATE = 16384; // bytes per second
+    static const size_t MIN_PACING_BURST = 16384;
+    // seconds of queued data after which an output counts as congested
+    static const float MAX_BACKLOG_DELAY = 0.5f;
+
     static uint8_t TEMP_BUFFER[65536];
 
 #ifdef _WIN32
@@ -116,7 +125,7 @@ namespace relay
     {
         network.removeSocket(*this);
 
-        writeData();
+        writeData(false);
         closeSocketFd();
     }
 
@@ -132,6 +141,29 @@ namespace relay
         timeSinceConnect(other.timeSinceConnect),
         accepting(other.accepting),
         connecting(other.connecting),
+        fastOpen(other.fastOpen),
+        options(other.options),
+        defaultSendBuffer(other.defaultSendBuffer),
+        defaultReceiveBuffer(other.defaultReceiveBuffer),
+        listenBacklog(other.listenBacklog),
+        acceptLimit(other.acceptLimit),
+        acceptedCount(other.acceptedCount),
+        acceptOverflowCount(other.acceptOverflowCount),
+        pacingHeadroom(other.pacingHeadroom),
+        pacingRate(other.pacingRate),
+        pacingTokens(other.pacingTokens),
+        pacingTime(other.pacingTime),
+        measureTime(other.measureTime),
+        queuedBytes(other.queuedBytes),
+        writtenBytes(other.writtenBytes),
+        sendRate(other.sendRate),
+        readRate(other.readRate),
+        readTokens(other.readTokens),
+        readTime(other.readTime),
+        readPaused(other.readPaused),
+        tcpInfo(other.tcpInfo),
+        tcpInfoTime(other.tcpInfoTime),
+        congested(other.congested),
         readCallback(std::move(other.readCallback)),
         closeCallback(std::move(other.closeCallback)),
         acceptCallback(std::move(other.acceptCallback)),
@@ -152,6 +184,13 @@ namespace relay
         other.connecting = false;
         other.connectTimeout = 10.0f;
         other.timeSinceConnect = 0.0f;
+        // the pacing rate was set on the moved descriptor
+        other.pacingRate = 0;
+        other.pacingTokens = 0.0;
+        other.queuedBytes = 0;
+        other.writtenBytes = 0;
+        other.sendRate = 0;
+        other.readTokens = 0.0;
     }
 
     Socket& Socket::operator=(Socket&& other)
@@ -168,6 +207,29 @@ namespace relay
         timeSinceConnect = other.timeSinceConnect;
         accepting = other.accepting;
         connecting = other.connecting;
+        fastOpen = other.fastOpen;
+        options = other.options;
+        defaultSendBuffer = other.defaultSendBuffer;
+        defaultReceiveBuffer = other.defaultReceiveBuffer;
+        listenBacklog = other.listenBacklog;
+        acceptLimit = other.acceptLimit;
+        acceptedCount = other.acceptedCount;
+        acceptOverflowCount = other.acceptOverflowCount;
+        pacingHeadroom = other.pacingHeadroom;
+        pacingRate = other.pacingRate;
+        pacingTokens = other.pacingTokens;
+        pacingTime = other.pacingTime;
+        measureTime = other.measureTime;
+        queuedBytes = other.queuedBytes;
+        writtenBytes = other.writtenBytes;
+        sendRate = other.sendRate;
+        readRate = other.readRate;
+        readTokens = other.readTokens;
+        readTime = other.readTime;
+        readPaused = other.readPaused;
+        tcpInfo = other.tcpInfo;
+        tcpInfoTime = other.tcpInfoTime;
+        congested = other.congested;
         readCallback = std::move(other.readCallback);
         closeCallback = std::move(other.closeCallback);
         acceptCallback = std::move(other.acceptCallback);
@@ -187,6 +249,13 @@ namespace relay
         other.connecting = false;
         other.connectTimeout = 10.0f;
         other.timeSinceConnect = 0.0f;
+        // the pacing rate was set on the moved descriptor
+        other.pacingRate = 0;
+        other.pacingTokens = 0.0;
+        other.queuedBytes = 0;
+        other.writtenBytes = 0;
+        other.sendRate = 0;
+        other.readTokens = 0.0;
 
         return *this;
     }
@@ -199,7 +268,7 @@ namespace relay
         {
             if (ready && !forceClose)
             {
-                writeData();
+                writeData(false);
             }
 
             if (!closeSocketFd())
@@ -215,6 +284,8 @@ namespace relay
         ready = false;
         accepting = false;
         connecting = false;
+        defaultSendBuffer = 0;
+        defaultReceiveBuffer = 0;
         outData.clear();
         inData.clear();
 
@@ -241,6 +312,16 @@ namespace relay
                 }
             }
         }
+        else if (ready && !accepting && socketFd != INVALID_SOCKET)
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            if (now - tcpInfoTime >= std::chrono::seconds(1))
+            {
+                sampleTcpInfo();
+                tcpInfoTime = now;
+            }
+        }
     }
 
     bool Socket::startRead()
@@ -308,7 +389,7 @@ namespace relay
             return false;
         }
 
-        if (listen(socketFd, WAITING_QUEUE_SIZE) < 0)
+        if (listen(socketFd, listenBacklog > 0 ? listenBacklog : SOMAXCONN) < 0)
         {
             int error = getLastError();
             Log(Log::Level::ERR) << "Failed to listen on " << ipToString(localIPAddress) << ":" << localPort << ", error: " << error;
@@ -323,6 +404,71 @@ namespace relay
         return true;
     }
 
+    bool Socket::startAccept(socket_t listenSocketFd)
+    {
+        ready = false;
+
+        if (socketFd != INVALID_SOCKET)
+        {
+            close();
+        }
+
+        socketFd = listenSocketFd;
+
+        sockaddr_in address;
+#ifdef _WIN32
+        int addressLength = static_cast<int>(sizeof(address));
+#else
+        socklen_t addressLength = sizeof(address);
+#endif
+
+        if (getsockname(socketFd, reinterpret_cast<sockaddr*>(&address), &addressLength) < 0)
+        {
+            int error = getLastError();
+            Log(Log::Level::ERR) << "Failed to get the address of the listening socket, error: " << error;
+            return false;
+        }
+
+        localIPAddress = address.sin_addr.s_addr;
+        localPort = ntohs(address.sin_port);
+
+        // the descriptor may come from another process, make sure it does not block
+#ifdef _WIN32
+        unsigned long mode = 1;
+        if (ioctlsocket(socketFd, FIONBIO, &mode) != 0)
+            return false;
+#else
+        int flags = fcntl(socketFd, F_GETFL, 0);
+        if (flags < 0) return false;
+        flags |= O_NONBLOCK;
+
+        if (fcntl(socketFd, F_SETFL, flags) != 0)
+            return false;
+#endif
+
+        applyOptions(true);
+
+        Log(Log::Level::INFO) << "Server listening on " << ipToString(localIPAddress) << ":" << localPort << " (inherited)";
+
+        accepting = true;
+        ready = true;
+
+        return true;
+    }
+
+    void Socket::setListenBacklog(int backlog)
+    {
+        listenBacklog = backlog;
+
+        // listen can be called again to resize the queue of an active socket
+        if (accepting && socketFd != INVALID_SOCKET &&
+            listen(socketFd, listenBacklog > 0 ? listenBacklog : SOMAXCONN) < 0)
+        {
+            int error = getLastError();
+            Log(Log::Level::WARN) << "Failed to change the backlog of " << ipToString(localIPAddress) << ":" << localPort << ", error: " << error;
+        }
+    }
+
     bool Socket::connect(const std::string& address)
     {
         ready = false;
@@ -357,6 +503,20 @@ namespace relay
 
         remoteAddressString = ipToString(remoteIPAddress) + ":" + std::to_string(remotePort);
 
+#ifdef TCP_FASTOPEN_CONNECT
+        // connect returns right away and the first send goes out with the SYN if a cookie is cached
+        if (fastOpen)
+        {
+            int value = 1;
+
+            if (setsockopt(socketFd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &value, sizeof(value)) < 0)
+            {
+                int error = getLastError();
+                Log(Log::Level::WARN) << "setsockopt(TCP_FASTOPEN_CONNECT) failed, error: " << error;
+            }
+        }
+#endif
+
         Log(Log::Level::INFO) << "Connecting to " << remoteAddressString;
 
         sockaddr_in addr;
@@ -494,9 +654,94 @@ namespace relay
         }
 #endif
 
+        applyOptions(false);
+
         return true;
     }
 
+    void Socket::setOptions(const SocketOptions& newOptions)
+    {
+        if (newOptions == options) return;
+
+        options = newOptions;
+
+        if (socketFd != INVALID_SOCKET) applyOptions(true);
+    }
+
+    static void setOption(socket_t socketFd, int level, int option, int value, const char* name)
+    {
+        if (setsockopt(socketFd, level, option, reinterpret_cast<const char*>(&value), sizeof(value)) < 0)
+        {
+            int error = getLastError();
+            Log(Log::Level::WARN) << "setsockopt(" << name << ") failed, error: " << error;
+        }
+    }
+
+    // the buffer size the kernel reports, Linux reports (and takes) twice the size that is set
+    static int getBufferSize(socket_t socketFd, int option)
+    {
+        int value = 0;
+        socklen_t length = sizeof(value);
+
+        if (getsockopt(socketFd, SOL_SOCKET, option, reinterpret_cast<char*>(&value), &length) < 0) return 0;
+
+#ifdef __linux__
+        value /= 2;
+#endif
+        return value;
+    }
+
+    void Socket::applyOptions(bool changed)
+    {
+        // a new socket already has the defaults
+        if (changed || options.noDelay) setOption(socketFd, IPPROTO_TCP, TCP_NODELAY, options.noDelay ? 1 : 0, "TCP_NODELAY");
+
+        // buffers of listening sockets are inherited by the accepted ones, which is the only way to
+        // get a receive window scale that fits a large receive buffer
+        if (options.sendBuffer > 0)
+        {
+            if (defaultSendBuffer == 0) defaultSendBuffer = getBufferSize(socketFd, SO_SNDBUF);
+            setOption(socketFd, SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF");
+        }
+        else if (changed && defaultSendBuffer > 0)
+        {
+            // Linux does not tune the size of the buffer again once it has been set
+            Log(Log::Level::INFO) << "Restoring the send buffer size to " << defaultSendBuffer << ", automatic tuning stays off until restart";
+            setOption(socketFd, SOL_SOCKET, SO_SNDBUF, defaultSendBuffer, "SO_SNDBUF");
+            defaultSendBuffer = 0;
+        }
+
+        if (options.receiveBuffer > 0)
+        {
+            if (defaultReceiveBuffer == 0) defaultReceiveBuffer = getBufferSize(socketFd, SO_RCVBUF);
+            setOption(socketFd, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer, "SO_RCVBUF");
+        }
+        else if (changed && defaultReceiveBuffer > 0)
+        {
+            Log(Log::Level::INFO) << "Restoring the receive buffer size to " << defaultReceiveBuffer << ", automatic tuning stays off until restart";
+            setOption(socketFd, SOL_SOCKET, SO_RCVBUF, defaultReceiveBuffer, "SO_RCVBUF");
+            defaultReceiveBuffer = 0;
+        }
+
+#ifdef TCP_NOTSENT_LOWAT
+        if (changed || options.notSentLowat > 0) setOption(socketFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat > 0 ? options.notSentLowat : -1, "TCP_NOTSENT_LOWAT");
+#endif
+
+        if (changed || options.keepAlive > 0)
+        {
+            setOption(socketFd, SOL_SOCKET, SO_KEEPALIVE, options.keepAlive > 0 ? 1 : 0, "SO_KEEPALIVE");
+
+            if (options.keepAlive > 0)
+            {
+#if defined(TCP_KEEPIDLE)
+                setOption(socketFd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepAlive, "TCP_KEEPIDLE");
+#elif defined(TCP_KEEPALIVE)
+                setOption(socketFd, IPPROTO_TCP, TCP_KEEPALIVE, options.keepAlive, "TCP_KEEPALIVE");
+#endif
+            }
+        }
+    }
+
     bool Socket::closeSocketFd()
     {
         if (socketFd != INVALID_SOCKET)
@@ -531,50 +776,277 @@ namespace relay
         }
 
         outData.insert(outData.end(), buffer.begin(), buffer.end());
+        queuedBytes += buffer.size();
 
         return true;
     }
 
+    float Socket::getPacingDelay() const
+    {
+        if (pacingRate == 0) return 0.0f;
+
+        return static_cast<float>(outData.size()) / static_cast<float>(pacingRate);
+    }
+
+    void Socket::sampleTcpInfo()
+    {
+#ifdef __linux__
+        // the layout of the kernel's struct tcp_info up to tcpi_delivery_rate, the one in
+        // netinet/tcp.h stops before the fields that are needed here
+        struct
+        {
+            uint8_t state;
+            uint8_t caState;
+            uint8_t retransmits;
+            uint8_t probes;
+            uint8_t backoff;
+            uint8_t options;
+            uint8_t windowScale;
+            uint8_t flags; // bit 0: delivery rate application limited
+
+            uint32_t rto;
+            uint32_t ato;
+            uint32_t sendMss;
+            uint32_t receiveMss;
+
+            uint32_t unacked;
+            uint32_t sacked;
+            uint32_t lost;
+            uint32_t retrans;
+            uint32_t fackets;
+
+            uint32_t lastDataSent;
+            uint32_t lastAckSent;
+            uint32_t lastDataReceived;
+            uint32_t lastAckReceived;
+
+            uint32_t pmtu;
+            uint32_t receiveSsthresh;
+            uint32_t rtt;
+            uint32_t rttVariance;
+            uint32_t sendSsthresh;
+            uint32_t sendCongestionWindow;
+            uint32_t advmss;
+            uint32_t reordering;
+
+            uint32_t receiveRtt;
+            uint32_t receiveSpace;
+
+            uint32_t totalRetrans;
+
+            uint64_t pacingRate;
+            uint64_t maxPacingRate;
+            uint64_t bytesAcked;
+            uint64_t bytesReceived;
+            uint32_t segmentsOut;
+            uint32_t segmentsIn;
+
+            uint32_t notSentBytes;
+            uint32_t minRtt;
+            uint32_t dataSegmentsIn;
+            uint32_t dataSegmentsOut;
+
+            uint64_t deliveryRate;
+        } info;
+
+        memset(&info, 0, sizeof(info));
+        socklen_t length = sizeof(info);
+
+        if (getsockopt(socketFd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+        {
+            int error = getLastError();
+            Log(Log::Level::WARN) << "getsockopt(TCP_INFO) failed, error: " << error;
+            tcpInfo.valid = false;
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        float interval = std::chrono::duration_cast<std::chrono::duration<float>>(now - tcpInfoTime).count();
+
+        // the rates need two samples
+        bool measured = tcpInfo.valid && interval > 0.0f;
+
+        // older kernels fill only a part of the structure, the rest stays zero
+        tcpInfo.ackRate = (measured && info.bytesAcked >= tcpInfo.bytesAcked) ?
+            static_cast<uint64_t>((info.bytesAcked - tcpInfo.bytesAcked) / interval) : 0;
+        tcpInfo.bytesAcked = info.bytesAcked;
+        tcpInfo.valid = true;
+        tcpInfo.rtt = info.rtt;
+        tcpInfo.rttVariance = info.rttVariance;
+        tcpInfo.congestionWindow = info.sendCongestionWindow;
+        tcpInfo.retransmits = info.totalRetrans;
+        tcpInfo.unacked = info.unacked;
+        tcpInfo.deliveryRate = info.deliveryRate;
+        tcpInfo.notSentBytes = info.notSentBytes;
+
+        // the delivery rate of the kernel is only updated when something is acknowledged,
+        // a peer that stopped reading is caught by the acknowledged bytes
+        uint64_t backlog = getBacklog();
+        congested = measured && backlog > 0 && static_cast<float>(backlog) > tcpInfo.ackRate * MAX_BACKLOG_DELAY;
+#endif
+    }
+
+    void Socket::setPacingRate(uint64_t newPacingRate)
+    {
+        pacingRate = newPacingRate;
+
+#ifdef SO_MAX_PACING_RATE
+        // let the kernel spread the packets too (fq qdisc or TCP internal pacing)
+        if (socketFd != INVALID_SOCKET)
+        {
+            unsigned int value = static_cast<unsigned int>(std::min<uint64_t>(pacingRate, std::numeric_limits<unsigned int>::max()));
+
+            if (setsockopt(socketFd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) < 0)
+            {
+                int error = getLastError();
+                Log(Log::Level::WARN) << "setsockopt(SO_MAX_PACING_RATE) failed, error: " << error;
+            }
+        }
+#endif
+    }
+
+    void Socket::updatePacing()
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        if (measureTime == std::chrono::steady_clock::time_point())
+        {
+            measureTime = now;
+            pacingTime = now;
+        }
+
+        float measureInterval = std::chrono::duration_cast<std::chrono::duration<float>>(now - measureTime).count();
+
+        if (measureInterval >= 1.0f)
+        {
+            uint64_t queueRate = static_cast<uint64_t>(queuedBytes / measureInterval);
+            sendRate = static_cast<uint64_t>(writtenBytes / measureInterval);
+            queuedBytes = 0;
+            writtenBytes = 0;
+            measureTime = now;
+
+            // keep the last rate while nothing is sent
+            if (pacingHeadroom > 0.0f && queueRate > 0)
+            {
+                setPacingRate(std::max(static_cast<uint64_t>(queueRate * pacingHeadroom), MIN_PACING_RATE));
+            }
+            else if (pacingHeadroom <= 0.0f && pacingRate > 0)
+            {
+                setPacingRate(0);
+            }
+        }
+
+        if (pacingRate > 0)
+        {
+            float interval = std::chrono::duration_cast<std::chrono::duration<float>>(now - pacingTime).count();
+
+            // the bucket holds 20ms worth of data, enough for the writes between two polls
+            double bucketSize = std::max(static_cast<double>(pacingRate) / 50.0, static_cast<double>(MIN_PACING_BURST));
+            pacingTokens = std::min(pacingTokens + pacingRate * static_cast<double>(interval), bucketSize);
+        }
+
+        pacingTime = now;
+    }
+
     bool Socket::read()
     {
         if (accepting)
         {
-            sockaddr_in address;
+            // drain the whole accept queue, a burst of reconnecting clients must not wait for the next poll
+            for (;;)
+            {
+                sockaddr_in address;
 #ifdef _WIN32
-            int addressLength = static_cast<int>(sizeof(address));
+                int addressLength = static_cast<int>(sizeof(address));
 #else
-            socklen_t addressLength = sizeof(address);
+                socklen_t addressLength = sizeof(address);
 #endif
 
-            socket_t clientFd = ::accept(socketFd, reinterpret_cast<sockaddr*>(&address), &addressLength);
+#ifdef __linux__
+                socket_t clientFd = ::accept4(socketFd, reinterpret_cast<sockaddr*>(&address), &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+                socket_t clientFd = ::accept(socketFd, reinterpret_cast<sockaddr*>(&address), &addressLength);
+#endif
 
-            if (clientFd == INVALID_SOCKET)
-            {
-                int error = getLastError();
+                if (clientFd == INVALID_SOCKET)
+                {
+                    int error = getLastError();
 
-                if (error == EAGAIN ||
+                    if (error == EAGAIN ||
 #ifdef _WIN32
-                    error == WSAEWOULDBLOCK ||
+                        error == WSAEWOULDBLOCK ||
 #endif
-                    error == EWOULDBLOCK)
+                        error == EWOULDBLOCK)
+                    {
+                        break;
+                    }
+#ifndef _WIN32
+                    else if (error == ECONNABORTED || error == EINTR)
+                    {
+                        continue;
+                    }
+#endif
+                    else
+                    {
+                        Log(Log::Level::ERR) << "Failed to accept client, error: " << error;
+                        return false;
+                    }
+                }
+
+#if !defined(__linux__) && !defined(_WIN32)
+                int flags = fcntl(clientFd, F_GETFL, 0);
+
+                if (flags < 0 || fcntl(clientFd, F_SETFL, flags | O_NONBLOCK) != 0)
                 {
-                    Log(Log::Level::ERR) << "No sockets to accept";
+                    int error = getLastError();
+                    Log(Log::Level::ERR) << "Failed to set accepted socket to non-blocking, error: " << error;
+                    ::close(clientFd);
+                    continue;
                 }
-                else
+#endif
+
+                if (acceptLimit)
                 {
-                    Log(Log::Level::ERR) << "Failed to accept client, error: " << error;
-                    return false;
+                    auto currentTime = std::chrono::steady_clock::now();
+
+                    if (currentTime - acceptPeriodStart >= std::chrono::seconds(1))
+                    {
+                        acceptPeriodStart = currentTime;
+                        acceptPeriodCount = 0;
+                    }
+
+                    if (acceptPeriodCount >= acceptLimit)
+                    {
+                        if (acceptPeriodCount++ == acceptLimit)
+                        {
+                            Log(Log::Level::WARN) << "Accept limit of " << acceptLimit << " connections per second reached on " << ipToString(localIPAddress) << ":" << localPort << ", rejecting clients";
+                        }
+
+                        ++acceptOverflowCount;
+#ifdef _WIN32
+                        closesocket(clientFd);
+#else
+                        ::close(clientFd);
+#endif
+                        continue;
+                    }
+
+                    ++acceptPeriodCount;
                 }
-            }
-            else
-            {
+
+                ++acceptedCount;
+
                 Log(Log::Level::INFO) << "Client connected from " << ipToString(address.sin_addr.s_addr) << ":" << ntohs(address.sin_port) << " to " << ipToString(localIPAddress) << ":" << localPort;
 
                 Socket socket(network, clientFd, true,
                               localIPAddress, localPort,
                               address.sin_addr.s_addr,
                               ntohs(address.sin_port));
-                
+
+                // the accepted socket starts with the system defaults, only the options of the profile are set
+                socket.options = options;
+                socket.applyOptions(false);
+
                 if (acceptCallback)
                 {
                     acceptCallback(*this, socket);
@@ -593,6 +1065,19 @@ namespace relay
     {
         if (connecting)
         {
+            int error = 0;
+#ifdef _WIN32
+            int errorLength = static_cast<int>(sizeof(error));
+#else
+            socklen_t errorLength = sizeof(error);
+#endif
+
+            // a failed connect is reported as writable too
+            if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &errorLength) == 0 && error != 0)
+            {
+                return disconnected();
+            }
+
             connecting = false;
             ready = true;
             Log(Log::Level::INFO) << "Socket connected to " << remoteAddressString;
@@ -605,6 +1090,27 @@ namespace relay
         return writeData();
     }
 
+    bool Socket::wantsRead()
+    {
+        if (readPaused) return false;
+        if (readRate == 0) return true;
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (readTime != std::chrono::steady_clock::time_point())
+        {
+            float interval = std::chrono::duration_cast<std::chrono::duration<float>>(now - readTime).count();
+
+            // 20ms worth of data, at least one full read
+            double bucketSize = std::max(static_cast<double>(readRate) / 50.0, static_cast<double>(sizeof(TEMP_BUFFER)));
+            readTokens = std::min(readTokens + readRate * static_cast<double>(interval), bucketSize);
+        }
+
+        readTime = now;
+
+        return readTokens >= 1.0;
+    }
+
     bool Socket::readData()
     {
 #if defined(__APPLE__)
@@ -615,10 +1121,13 @@ namespace relay
         int flags = MSG_NOSIGNAL;
 #endif
 
+        size_t length = sizeof(TEMP_BUFFER);
+        if (readRate > 0) length = std::min(length, static_cast<size_t>(std::max(readTokens, 1.0)));
+
 #ifdef _WIN32
-        int size = recv(socketFd, reinterpret_cast<char*>(TEMP_BUFFER), sizeof(TEMP_BUFFER), flags);
+        int size = recv(socketFd, reinterpret_cast<char*>(TEMP_BUFFER), static_cast<int>(length), flags);
 #else
-        ssize_t size = recv(socketFd, reinterpret_cast<char*>(TEMP_BUFFER), sizeof(TEMP_BUFFER), flags);
+        ssize_t size = recv(socketFd, reinterpret_cast<char*>(TEMP_BUFFER), length, flags);
 #endif
 
         if (size < 0)
@@ -660,7 +1169,9 @@ namespace relay
             return true;
         }
 
-        Log(Log::Level::ALL) << "Socket received " << size << " bytes from " << remoteAddressString;
+        LOG(Log::Level::ALL) << "Socket received " << size << " bytes from " << remoteAddressString;
+
+        if (readRate > 0) readTokens = std::max(readTokens - size, 0.0);
 
         inData.assign(TEMP_BUFFER, TEMP_BUFFER + size);
 
@@ -672,10 +1183,21 @@ namespace relay
         return true;
     }
 
-    bool Socket::writeData()
+    bool Socket::writeData(bool paced)
     {
+        updatePacing();
+
         if (ready && !outData.empty())
         {
+            size_t length = outData.size();
+
+            if (paced && pacingRate > 0)
+            {
+                length = std::min(length, static_cast<size_t>(pacingTokens));
+
+                if (length == 0) return true;
+            }
+
 #if defined(__APPLE__)
             int flags = 0;
 #elif defined(_WIN32)
@@ -684,12 +1206,17 @@ namespace relay
             int flags = MSG_NOSIGNAL;
 #endif
 
+#ifdef MSG_MORE
+            // the queue ends with a whole frame, the tail of a frame that is cut by pacing waits for the rest
+            if (options.cork && length < outData.size()) flags |= MSG_MORE;
+#endif
+
 #ifdef _WIN32
-            int dataSize = static_cast<int>(outData.size());
+            int dataSize = static_cast<int>(length);
             int size = ::send(socketFd, reinterpret_cast<const char*>(outData.data()), dataSize, flags);
 #else
-            ssize_t dataSize = static_cast<ssize_t>(outData.size());
-            ssize_t size = ::send(socketFd, reinterpret_cast<const char*>(outData.data()), outData.size(), flags);
+            ssize_t dataSize = static_cast<ssize_t>(length);
+            ssize_t size = ::send(socketFd, reinterpret_cast<const char*>(outData.data()), length, flags);
 #endif
 
             if (size < 0)
@@ -698,6 +1225,8 @@ namespace relay
                 if (error == EAGAIN ||
 #ifdef _WIN32
                     error == WSAEWOULDBLOCK ||
+#else
+                    error == EINPROGRESS || // TCP Fast Open without a cookie
 #endif
                     error == EWOULDBLOCK)
                 {
@@ -725,16 +1254,18 @@ namespace relay
             }
             else if (size != dataSize)
             {
-                Log(Log::Level::ALL) << "Socket did not send all data to " << remoteAddressString << ", sent " << size << " out of " << outData.size() << " bytes";
+                LOG(Log::Level::ALL) << "Socket did not send all data to " << remoteAddressString << ", sent " << size << " out of " << outData.size() << " bytes";
             }
             else
             {
-                Log(Log::Level::ALL) << "Socket sent " << size << " bytes to " << remoteAddressString;
+                LOG(Log::Level::ALL) << "Socket sent " << size << " bytes to " << remoteAddressString;
             }
 
             if (size > 0)
             {
                 outData.erase(outData.begin(), outData.begin() + size);
+                writtenBytes += static_cast<uint64_t>(size);
+                if (pacingRate > 0) pacingTokens = std::max(pacingTokens - size, 0.0);
             }
         }
         
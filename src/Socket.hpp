@@ -5,6 +5,7 @@
 #pragma once
 
 #include <vector>
+#include <chrono>
 #include <functional>
 #include <cstdint>
 #include <string>
@@ -48,6 +49,32 @@ namespace relay
 
     class Network;
 
+    // kernel options of a socket, set from a socket profile of the configuration
+    struct SocketOptions
+    {
+        bool noDelay = false; // TCP_NODELAY
+        int sendBuffer = 0; // SO_SNDBUF, 0 for the system default
+        int receiveBuffer = 0; // SO_RCVBUF, 0 for the system default
+        int notSentLowat = 0; // TCP_NOTSENT_LOWAT, keeps the unsent data in the relay, 0 for no limit
+        int keepAlive = 0; // seconds of idle time before keepalive probes, 0 to disable
+        bool cork = false; // don't send the partial last segment of a frame that is written in parts
+
+        bool operator==(const SocketOptions& other) const
+        {
+            return noDelay == other.noDelay &&
+                sendBuffer == other.sendBuffer &&
+                receiveBuffer == other.receiveBuffer &&
+                notSentLowat == other.notSentLowat &&
+                keepAlive == other.keepAlive &&
+                cork == other.cork;
+        }
+
+        bool operator!=(const SocketOptions& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
     class Socket
     {
         friend Network;
@@ -57,6 +84,21 @@ namespace relay
         Socket(Network& aNetwork);
         virtual ~Socket();
 
+        // kernel view of the connection, sampled once a second where TCP_INFO is available
+        struct TcpInfo
+        {
+            bool valid = false;
+            uint32_t rtt = 0; // microseconds
+            uint32_t rttVariance = 0; // microseconds
+            uint32_t congestionWindow = 0; // segments
+            uint32_t retransmits = 0; // segments retransmitted since the connect
+            uint32_t unacked = 0; // segments in flight
+            uint64_t deliveryRate = 0; // bytes per second
+            uint32_t notSentBytes = 0; // in the kernel send buffer, not sent yet
+            uint64_t bytesAcked = 0;
+            uint64_t ackRate = 0; // bytes per second acknowledged since the previous sample
+        };
+
         Socket(const Socket&) = delete;
         Socket& operator=(const Socket&) = delete;
 
@@ -70,12 +112,44 @@ namespace relay
 
         bool startAccept(const std::string& address);
         bool startAccept(uint32_t address, uint16_t newPort);
+        bool startAccept(socket_t listenSocketFd);
+
+        void setListenBacklog(int backlog);
+        void setAcceptLimit(uint32_t connectionsPerSecond) { acceptLimit = connectionsPerSecond; }
+        uint64_t getAcceptedCount() const { return acceptedCount; }
+        uint64_t getAcceptOverflowCount() const { return acceptOverflowCount; }
 
         bool connect(const std::string& address);
         bool connect(uint32_t address, uint16_t newPort);
 
         bool isConnecting() const { return connecting; }
         void setConnectTimeout(float timeout);
+        void setFastOpen(bool enable) { fastOpen = enable; }
+        // applied right away to an open socket, otherwise when it is created; accepted sockets get the options of the listening one
+        void setOptions(const SocketOptions& newOptions);
+        const SocketOptions& getOptions() const { return options; }
+        // limits the writes to the measured rate of the sent data times the headroom (0 for no pacing)
+        void setPacing(float headroom) { pacingHeadroom = headroom; }
+
+        // bytes per second written to the kernel, measured every second
+        uint64_t getSendRate() const { return sendRate; }
+        uint64_t getPacingRate() const { return pacingRate; }
+        // seconds the queued data has to wait for the token bucket
+        float getPacingDelay() const;
+
+        // limits the reads to the rate (0 for no limit)
+        void setReadRate(uint64_t newReadRate) { readRate = newReadRate; }
+        // a paused socket is not polled for reading, TCP flow control slows down the sender
+        void setReadPaused(bool paused) { readPaused = paused; }
+        bool isReadPaused() const { return readPaused; }
+
+        const TcpInfo& getTcpInfo() const { return tcpInfo; }
+        // the data queued in the relay and the kernel would take too long to drain at the rate the peer acknowledges it
+        bool isCongested() const { return congested; }
+        // bytes queued in the relay and not sent by the kernel yet
+        uint64_t getBacklog() const { return outData.size() + tcpInfo.notSentBytes; }
+        // refills the read token bucket, false if the socket should not be read now
+        bool wantsRead();
 
         void setReadCallback(const std::function<void(Socket&, const std::vector<uint8_t>&)>& newReadCallback);
         void setCloseCallback(const std::function<void(Socket&)>& newCloseCallback);
@@ -92,8 +166,10 @@ namespace relay
         uint16_t getRemotePort() const { return remotePort; }
 
         bool isReady() const { return ready; }
+        socket_t getSocketFd() const { return socketFd; }
 
         bool hasOutData() const { return !outData.empty(); }
+        size_t getOutDataSize() const { return outData.size(); }
 
     protected:
         Socket(Network& aNetwork, socket_t aSocketFd, bool aReady,
@@ -104,7 +180,12 @@ namespace relay
         bool write();
 
         bool readData();
-        bool writeData();
+        bool writeData(bool paced = true);
+        void updatePacing();
+        void setPacingRate(uint64_t newPacingRate);
+        void sampleTcpInfo();
+        // changed sets the options that are at their defaults too
+        void applyOptions(bool changed);
 
         bool disconnected();
 
@@ -127,6 +208,36 @@ namespace relay
         float timeSinceConnect = 0.0f;
         bool accepting = false;
         bool connecting = false;
+        bool fastOpen = false;
+        SocketOptions options;
+        // sizes before the options overrode them (0 if they were not overridden)
+        int defaultSendBuffer = 0;
+        int defaultReceiveBuffer = 0;
+
+        int listenBacklog = 0; // 0 for SOMAXCONN
+        uint32_t acceptLimit = 0; // 0 for unlimited
+        uint32_t acceptPeriodCount = 0;
+        std::chrono::steady_clock::time_point acceptPeriodStart;
+        uint64_t acceptedCount = 0;
+        uint64_t acceptOverflowCount = 0;
+
+        float pacingHeadroom = 0.0f;
+        uint64_t pacingRate = 0; // 0 until the first measurement
+        double pacingTokens = 0.0;
+        std::chrono::steady_clock::time_point pacingTime;
+        std::chrono::steady_clock::time_point measureTime;
+        uint64_t queuedBytes = 0;
+        uint64_t writtenBytes = 0;
+        uint64_t sendRate = 0;
+
+        uint64_t readRate = 0;
+        double readTokens = 0.0;
+        std::chrono::steady_clock::time_point readTime;
+        bool readPaused = false;
+
+        TcpInfo tcpInfo;
+        std::chrono::steady_clock::time_point tcpInfoTime;
+        bool congested = false;
 
         std::function<void(Socket&, const std::vector<uint8_t>&)> readCallback;
         std::function<void(Socket&)> closeCallback;
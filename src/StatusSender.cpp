@@ -126,6 +126,23 @@ namespace relay
 
                 socket.send(buffer);
             }
+            else if (fields[1] == "/metrics")
+            {
+                std::string info;
+                relay.getMetrics(info);
+
+                std::string response = "HTTP/1.1 200 OK\r\n"
+                    "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+                    "Pragma: no-cache\r\n"
+                    "Expires: 0\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " + std::to_string(info.length()) + "\r\n"
+                    "\r\n" + info;
+
+                std::vector<uint8_t> buffer(response.begin(), response.end());
+
+                socket.send(buffer);
+            }
             else
             {
                 sendError();
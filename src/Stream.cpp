@@ -7,6 +7,8 @@
 #include "Connection.hpp"
 #include "Relay.hpp"
 #include "Server.hpp"
+#include "Endpoint.hpp"
+#include "Log.hpp"
 
 namespace relay
 {
@@ -25,6 +27,18 @@ namespace relay
 
     Stream::~Stream()
     {
+        if (leader)
+        {
+            auto i = std::find(leader->followers.begin(), leader->followers.end(), this);
+            if (i != leader->followers.end()) leader->followers.erase(i);
+        }
+
+        for (Stream* follower : followers)
+        {
+            follower->leader = nullptr;
+            if (follower->inputConnection == inputConnection) follower->inputConnection = nullptr;
+        }
+
         Log(Log::Level::INFO) << idString << "Delete";
     }
 
@@ -60,10 +74,151 @@ namespace relay
         return hasDependables;
     }
 
+    bool Stream::hasHostConnections() const
+    {
+        if (inputConnection && !leader && inputConnection->getType() == Connection::Type::HOST) return true;
+
+        for (const BackupInput& backupInput : backupInputs)
+        {
+            if (backupInput.connection->getType() == Connection::Type::HOST) return true;
+        }
+
+        for (const Connection* c : outputConnections)
+        {
+            if (c->getType() == Connection::Type::HOST) return true;
+        }
+
+        for (const Stream* follower : followers)
+        {
+            if (follower->hasHostConnections()) return true;
+        }
+
+        return false;
+    }
+
+    bool Stream::isSaturated(size_t limit) const
+    {
+        bool hasOutputs = !outputConnections.empty();
+
+        for (const Connection* outputConnection : outputConnections)
+        {
+            if (outputConnection->getQueuedBytes() < limit) return false;
+        }
+
+        for (const Stream* follower : followers)
+        {
+            if (follower->outputConnections.empty()) continue;
+            if (!follower->isSaturated(limit)) return false;
+            hasOutputs = true;
+        }
+
+        return hasOutputs;
+    }
+
+    void Stream::update(float delta)
+    {
+        if (switchingInput) switchTime += delta;
+
+        if (!backupInputs.empty())
+        {
+            for (BackupInput& backupInput : backupInputs)
+            {
+                backupInput.idleTime += delta;
+            }
+
+            // a paused input is not stalled, it is waiting for the outputs
+            if (inputConnection && inputConnection->isReadPaused()) inputIdleTime = 0.0f;
+            else inputIdleTime += delta;
+
+            Connection* stalledInput = inputConnection;
+
+            // the active input stopped sending (or a switch to it never completed), hand over to a backup that is still receiving
+            if (stalledInput && streaming &&
+                stalledInput->getEndpoint() &&
+                (!switchingInput || switchTime >= stalledInput->getEndpoint()->stallTimeout) &&
+                inputIdleTime >= stalledInput->getEndpoint()->stallTimeout)
+            {
+                for (size_t i = 0; i < backupInputs.size(); ++i)
+                {
+                    if (backupInputs[i].idleTime < stalledInput->getEndpoint()->stallTimeout)
+                    {
+                        Log(Log::Level::WARN) << idString << "No media from " << stalledInput->getIdString() << "for " << inputIdleTime << "s";
+
+                        BackupInput stalledBackup;
+                        stalledBackup.connection = stalledInput;
+                        stalledBackup.audioHeader = audioHeader;
+                        stalledBackup.videoHeader = videoHeader;
+                        stalledBackup.metaData = metaData;
+                        stalledBackup.idleTime = inputIdleTime;
+
+                        switchInput(i);
+                        backupInputs.push_back(stalledBackup);
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (!lingering) return;
+
+        lingerRemaining -= delta;
+
+        if (lingerRemaining <= 0.0f)
+        {
+            Log(Log::Level::INFO) << idString << "No viewers joined, closing the pulled input";
+            lingering = false;
+            ++server.getPullStats().expired;
+            close();
+        }
+    }
+
+    bool Stream::startLinger()
+    {
+        float lingerTime = 0.0f;
+
+        for (Connection* c : connections)
+        {
+            if (c->getType() == Connection::Type::CLIENT &&
+                c->getDirection() == Connection::Direction::INPUT &&
+                c->getEndpoint())
+            {
+                lingerTime = std::max(lingerTime, c->getEndpoint()->lingerTime);
+            }
+        }
+
+        if (lingerTime <= 0.0f) return false;
+
+        Log(Log::Level::INFO) << idString << "Last viewer left, keeping the pulled input for " << lingerTime << "s";
+        lingering = true;
+        lingerRemaining = lingerTime;
+
+        return true;
+    }
+
     void Stream::close()
     {
         closed = true;
-        if (inputConnection) inputConnection->close(true);
+        lingering = false;
+
+        // a shared input belongs to the leader
+        if (leader)
+        {
+            unfollow();
+        }
+        else
+        {
+            if (inputConnection) inputConnection->close(true);
+            releaseFollowers();
+        }
+
+        std::vector<BackupInput> oldBackupInputs;
+        oldBackupInputs.swap(backupInputs);
+
+        for (const BackupInput& backupInput : oldBackupInputs)
+        {
+            backupInput.connection->close(true);
+        }
+
         for (auto o : outputConnections)
         {
             o->close(true);
@@ -75,6 +230,65 @@ namespace relay
         server.cleanup();
     }
 
+    void Stream::addFollower(Stream& follower)
+    {
+        if (follower.leader) return;
+
+        followers.push_back(&follower);
+        follower.leader = this;
+
+        Log(Log::Level::INFO) << idString << "Sharing input with stream " << follower.getId();
+
+        // the follower joins a running stream, give it the headers it missed
+        if (streaming && inputConnection)
+        {
+            follower.start(*inputConnection);
+
+            if (!videoHeader.empty()) follower.forwardVideoHeader(videoHeader);
+            if (!audioHeader.empty()) follower.forwardAudioHeader(audioHeader);
+            if (metaData.getType() != amf::Node::Type::Unknown) follower.forwardMetaData(metaData);
+        }
+    }
+
+    void Stream::unfollow()
+    {
+        if (!leader) return;
+
+        auto i = std::find(leader->followers.begin(), leader->followers.end(), this);
+        if (i != leader->followers.end()) leader->followers.erase(i);
+
+        Connection* sharedConnection = inputConnection;
+
+        // the shared input connection belongs to the leader's stream
+        if (sharedConnection && sharedConnection->getStream() != this)
+        {
+            if (streaming) stop(*sharedConnection);
+            inputConnection = nullptr;
+        }
+
+        leader = nullptr;
+
+        if (!closed && !hasDependableConnections())
+        {
+            close();
+        }
+    }
+
+    void Stream::releaseFollowers()
+    {
+        std::vector<Stream*> oldFollowers;
+        oldFollowers.swap(followers);
+
+        for (Stream* follower : oldFollowers)
+        {
+            Log(Log::Level::INFO) << idString << "Stopped sharing input with stream " << follower->getId();
+
+            // the followers are left without an input, their servers start their own
+            follower->getServer().inputLost(*follower);
+            follower->unfollow();
+        }
+    }
+
     void Stream::start(relay::Connection &connection)
     {
         if (closed) return;
@@ -82,37 +296,62 @@ namespace relay
         Log() << idString << "Stream start " << connection.getIdString();
         if (connection.getDirection() == Connection::Direction::INPUT)
         {
+            if (inputConnection && inputConnection != &connection && canAddBackupInput(connection))
+            {
+                if (!findBackupInput(connection))
+                {
+                    Log(Log::Level::INFO) << idString << "Backup input added " << connection.getIdString();
+
+                    BackupInput backupInput;
+                    backupInput.connection = &connection;
+                    backupInputs.push_back(backupInput);
+                }
+
+                return;
+            }
+
             if (!inputConnection)
             {
                 inputConnection = &connection;
             }
             streaming = true;
 
-            for (const Endpoint& endpoint : server.getEndpoints())
+            for (const auto& endpoint : server.getEndpoints())
             {
-                if (endpoint.connectionType == Connection::Type::CLIENT &&
-                    endpoint.direction == Connection::Direction::OUTPUT)
+                if (endpoint->connectionType == Connection::Type::CLIENT &&
+                    endpoint->direction == Connection::Direction::OUTPUT)
                 {
-                    Connection* newConnection = server.createConnection(*this, endpoint);
-                    newConnection->connect();
+                    Connection* newConnection = server.createConnection(*this, *endpoint);
 
                     connections.push_back(newConnection);
                 }
             }
+
+            for (Stream* follower : followers)
+            {
+                follower->start(connection);
+            }
         }
         else if (connection.getDirection() == Connection::Direction::OUTPUT)
         {
+            if (lingering)
+            {
+                Log(Log::Level::INFO) << idString << "Viewer joined, reusing the pulled input";
+                lingering = false;
+                ++server.getPullStats().hits;
+            }
+
             if (!inputConnection && !inputConnectionCreated)
             {
-                for (const Endpoint& endpoint : server.getEndpoints())
+                for (const auto& endpoint : server.getEndpoints())
                 {
-                    if (endpoint.connectionType == Connection::Type::CLIENT &&
-                        endpoint.direction == Connection::Direction::INPUT &&
-                        !endpoint.isNameKnown())
+                    if (endpoint->connectionType == Connection::Type::CLIENT &&
+                        endpoint->direction == Connection::Direction::INPUT &&
+                        !endpoint->isNameKnown())
                     {
-                        auto ic = server.createConnection(*this, endpoint);
-                        ic->connect();
+                        auto ic = server.createConnection(*this, *endpoint);
                         inputConnectionCreated = true;
+                        ++server.getPullStats().misses;
 
                         connections.push_back(ic);
                     }
@@ -132,7 +371,7 @@ namespace relay
 
                 if (!videoHeader.empty()) connection.sendVideoHeader(videoHeader);
                 if (!audioHeader.empty()) connection.sendAudioHeader(audioHeader);
-                if (metaData.getType() != amf::Node::Type::Unknown) connection.sendMetaData(metaData);
+                if (metaData.getType() != amf::Node::Type::Unknown) sendEncodedMetaData(connection);
             }
         }
         else
@@ -146,6 +385,16 @@ namespace relay
         if (closed) return;
 
         Log() << idString << "Stream stop " << connection.getIdString();
+
+        if (removeBackupInput(connection)) return;
+
+        // the outputs keep running and get the media of the backup from its next keyframe
+        if (&connection == inputConnection && !backupInputs.empty())
+        {
+            switchInput(0);
+            return;
+        }
+
         if (&connection == inputConnection)
         {
             streaming = false;
@@ -172,6 +421,11 @@ namespace relay
                     it++;
                 }
             }
+
+            for (Stream* follower : followers)
+            {
+                follower->stop(connection);
+            }
         }
         else
         {
@@ -187,12 +441,298 @@ namespace relay
         }
 
         if (!hasDependableConnections())
+        {
+            // a viewer that comes back soon doesn't have to wait for the upstream connect
+            if (connection.getDirection() == Connection::Direction::OUTPUT && startLinger()) return;
+
+            close();
+        }
+    }
+
+    void Stream::addEndpoint(const Endpoint& endpoint)
+    {
+        if (closed) return;
+
+        if (endpoint.connectionType != Connection::Type::CLIENT) return;
+
+        if (endpoint.direction == Connection::Direction::OUTPUT && streaming)
+        {
+            Connection* newConnection = server.createConnection(*this, endpoint);
+
+            connections.push_back(newConnection);
+        }
+        else if (endpoint.direction == Connection::Direction::INPUT &&
+                 !endpoint.isNameKnown() &&
+                 !inputConnection && !inputConnectionCreated &&
+                 !outputConnections.empty())
+        {
+            auto ic = server.createConnection(*this, endpoint);
+            inputConnectionCreated = true;
+
+            connections.push_back(ic);
+        }
+    }
+
+    void Stream::removeEndpoint(const Endpoint& endpoint)
+    {
+        std::vector<Connection*> endpointConnections;
+
+        for (auto i = backupInputs.begin(); i != backupInputs.end();)
+        {
+            if (i->connection->getEndpoint() == &endpoint)
+            {
+                Connection* backupConnection = i->connection;
+                i = backupInputs.erase(i);
+
+                Log(Log::Level::INFO) << idString << "Endpoint removed, closing backup input " << backupConnection->getIdString();
+                backupConnection->close(true);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if (inputConnection && inputConnection->getEndpoint() == &endpoint)
+        {
+            endpointConnections.push_back(inputConnection);
+        }
+
+        for (Connection* c : outputConnections)
+        {
+            if (c->getEndpoint() == &endpoint &&
+                std::find(endpointConnections.begin(), endpointConnections.end(), c) == endpointConnections.end())
+            {
+                endpointConnections.push_back(c);
+            }
+        }
+
+        for (Connection* c : connections)
+        {
+            if (c->getEndpoint() == &endpoint &&
+                std::find(endpointConnections.begin(), endpointConnections.end(), c) == endpointConnections.end())
+            {
+                endpointConnections.push_back(c);
+            }
+        }
+
+        if (endpointConnections.empty()) return;
+
+        for (Connection* c : endpointConnections)
+        {
+            Log(Log::Level::INFO) << idString << "Endpoint removed, closing " << c->getIdString();
+
+            c->close(true);
+
+            if (inputConnection == c)
+            {
+                inputConnection = nullptr;
+                releaseFollowers();
+            }
+
+            auto outputIterator = std::find(outputConnections.begin(), outputConnections.end(), c);
+            if (outputIterator != outputConnections.end()) outputConnections.erase(outputIterator);
+
+            auto connectionIterator = std::find(connections.begin(), connections.end(), c);
+            if (connectionIterator != connections.end()) connections.erase(connectionIterator);
+        }
+
+        inputConnectionCreated = std::any_of(connections.begin(), connections.end(), [](Connection* c) {
+            return c->getType() == Connection::Type::CLIENT && c->getDirection() == Connection::Direction::INPUT;
+        });
+
+        if (!closed && !hasDependableConnections())
         {
             close();
         }
     }
 
-    void Stream::sendAudioHeader(const std::vector<uint8_t>& headerData)
+    bool Stream::canAddBackupInput(const Connection& connection) const
+    {
+        return connection.getEndpoint() &&
+            backupInputs.size() < connection.getEndpoint()->backupInputs;
+    }
+
+    Stream::BackupInput* Stream::findBackupInput(const Connection& connection)
+    {
+        for (BackupInput& backupInput : backupInputs)
+        {
+            if (backupInput.connection == &connection) return &backupInput;
+        }
+
+        return nullptr;
+    }
+
+    bool Stream::removeBackupInput(const Connection& connection)
+    {
+        for (auto i = backupInputs.begin(); i != backupInputs.end(); ++i)
+        {
+            if (i->connection == &connection)
+            {
+                Log(Log::Level::INFO) << idString << "Backup input removed " << connection.getIdString();
+                backupInputs.erase(i);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Stream::switchInput(size_t backupIndex)
+    {
+        BackupInput backupInput = backupInputs[backupIndex];
+        backupInputs.erase(backupInputs.begin() + static_cast<std::ptrdiff_t>(backupIndex));
+
+        Log(Log::Level::INFO) << idString << "Switching input to " << backupInput.connection->getIdString();
+
+        inputConnection = backupInput.connection;
+        if (!backupInput.audioHeader.empty()) audioHeader = backupInput.audioHeader;
+        // a backup without a video header has no video, so it does not wait for a keyframe
+        videoHeader = backupInput.videoHeader;
+        if (backupInput.metaData.getType() != amf::Node::Type::Unknown) setMetaData(backupInput.metaData);
+
+        switchingInput = true;
+        switchTime = 0.0f;
+        inputIdleTime = 0.0f;
+    }
+
+    bool Stream::canFinishSwitch(bool keyFrame) const
+    {
+        if (keyFrame || videoHeader.empty()) return true;
+
+        const Endpoint* endpoint = inputConnection ? inputConnection->getEndpoint() : nullptr;
+
+        return endpoint && (!endpoint->videoStream || switchTime >= endpoint->stallTimeout);
+    }
+
+    void Stream::finishSwitch(uint64_t timestamp)
+    {
+        // continue one frame after the last forwarded one
+        timestampOffset = static_cast<int64_t>(lastTimestamp + videoInterval) - static_cast<int64_t>(timestamp);
+        switchingInput = false;
+
+        Log(Log::Level::INFO) << idString << "Switched input at " << timestamp << ", timestamp offset " << timestampOffset;
+
+        if (!videoHeader.empty()) forwardVideoHeader(videoHeader);
+        if (!audioHeader.empty()) forwardAudioHeader(audioHeader);
+        if (metaData.getType() != amf::Node::Type::Unknown) forwardMetaData(metaData);
+    }
+
+    uint64_t Stream::rebaseTimestamp(uint64_t timestamp)
+    {
+        int64_t result = static_cast<int64_t>(timestamp) + timestampOffset;
+        if (result < 0) result = 0;
+
+        lastTimestamp = std::max(lastTimestamp, static_cast<uint64_t>(result));
+
+        return static_cast<uint64_t>(result);
+    }
+
+    void Stream::sendAudioHeader(Connection& source, const std::vector<uint8_t>& headerData)
+    {
+        if (BackupInput* backupInput = findBackupInput(source))
+        {
+            backupInput->audioHeader = headerData;
+        }
+        else if (switchingInput)
+        {
+            // sent together with the first keyframe
+            audioHeader = headerData;
+        }
+        else
+        {
+            forwardAudioHeader(headerData);
+        }
+    }
+
+    void Stream::sendVideoHeader(Connection& source, const std::vector<uint8_t>& headerData)
+    {
+        if (BackupInput* backupInput = findBackupInput(source))
+        {
+            backupInput->videoHeader = headerData;
+        }
+        else if (switchingInput)
+        {
+            videoHeader = headerData;
+        }
+        else
+        {
+            forwardVideoHeader(headerData);
+        }
+    }
+
+    void Stream::sendAudioFrame(Connection& source, uint64_t timestamp, const std::vector<uint8_t>& audioData)
+    {
+        if (BackupInput* backupInput = findBackupInput(source))
+        {
+            backupInput->idleTime = 0.0f;
+            return;
+        }
+
+        inputIdleTime = 0.0f;
+
+        if (switchingInput)
+        {
+            if (!canFinishSwitch(false)) return;
+
+            finishSwitch(timestamp);
+        }
+
+        forwardAudioFrame(rebaseTimestamp(timestamp), audioData);
+    }
+
+    void Stream::sendVideoFrame(Connection& source, uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType)
+    {
+        if (BackupInput* backupInput = findBackupInput(source))
+        {
+            backupInput->idleTime = 0.0f;
+            return;
+        }
+
+        inputIdleTime = 0.0f;
+
+        if (switchingInput)
+        {
+            if (!canFinishSwitch(frameType == VideoFrameType::KEY)) return;
+
+            finishSwitch(timestamp);
+        }
+
+        uint64_t rebasedTimestamp = rebaseTimestamp(timestamp);
+
+        if (rebasedTimestamp > lastVideoTimestamp && lastVideoTimestamp > 0)
+        {
+            videoInterval = rebasedTimestamp - lastVideoTimestamp;
+        }
+        lastVideoTimestamp = rebasedTimestamp;
+
+        forwardVideoFrame(rebasedTimestamp, videoData, frameType);
+    }
+
+    void Stream::sendMetaData(Connection& source, const amf::Node& newMetaData)
+    {
+        if (BackupInput* backupInput = findBackupInput(source))
+        {
+            backupInput->metaData = newMetaData;
+        }
+        else if (switchingInput)
+        {
+            setMetaData(newMetaData);
+        }
+        else
+        {
+            forwardMetaData(newMetaData);
+        }
+    }
+
+    void Stream::sendTextData(Connection& source, uint64_t timestamp, const amf::Node& textData)
+    {
+        if (findBackupInput(source) || switchingInput) return;
+
+        forwardTextData(rebaseTimestamp(timestamp), textData);
+    }
+
+    void Stream::forwardAudioHeader(const std::vector<uint8_t>& headerData)
     {
         audioHeader = headerData;
 
@@ -203,9 +743,14 @@ namespace relay
                 outputConnection->sendAudioHeader(headerData);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardAudioHeader(headerData);
+        }
     }
 
-    void Stream::sendVideoHeader(const std::vector<uint8_t>& headerData)
+    void Stream::forwardVideoHeader(const std::vector<uint8_t>& headerData)
     {
         videoHeader = headerData;
 
@@ -216,9 +761,14 @@ namespace relay
                 outputConnection->sendVideoHeader(headerData);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardVideoHeader(headerData);
+        }
     }
 
-    void Stream::sendAudioFrame(uint64_t timestamp, const std::vector<uint8_t>& audioData)
+    void Stream::forwardAudioFrame(uint64_t timestamp, const std::vector<uint8_t>& audioData)
     {
         for (Connection* outputConnection : outputConnections)
         {
@@ -227,9 +777,14 @@ namespace relay
                 outputConnection->sendAudioFrame(timestamp, audioData);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardAudioFrame(timestamp, audioData);
+        }
     }
 
-    void Stream::sendVideoFrame(uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType)
+    void Stream::forwardVideoFrame(uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType)
     {
         for (Connection* outputConnection : outputConnections)
         {
@@ -238,22 +793,53 @@ namespace relay
                 outputConnection->sendVideoFrame(timestamp, videoData, frameType);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardVideoFrame(timestamp, videoData, frameType);
+        }
     }
 
-    void Stream::sendMetaData(const amf::Node& newMetaData)
+    void Stream::setMetaData(const amf::Node& newMetaData)
     {
         metaData = newMetaData;
+        encodedMetaData.clear();
+    }
+
+    void Stream::sendEncodedMetaData(Connection& connection)
+    {
+        std::string profile = connection.getMetaDataProfile();
+        auto i = encodedMetaData.find(profile);
+
+        if (i == encodedMetaData.end())
+        {
+            i = encodedMetaData.insert(std::make_pair(profile, EncodedMetaData())).first;
+            i->second.metaData = connection.filterMetaData(metaData);
+            connection.encodeMetaData(i->second.metaData, i->second.data);
+        }
+
+        connection.sendMetaData(i->second.metaData, i->second.data);
+    }
+
+    void Stream::forwardMetaData(const amf::Node& newMetaData)
+    {
+        setMetaData(newMetaData);
 
         for (Connection* outputConnection : outputConnections)
         {
             if (outputConnection->getDirection() == Connection::Direction::OUTPUT)
             {
-                outputConnection->sendMetaData(metaData);
+                sendEncodedMetaData(*outputConnection);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardMetaData(newMetaData);
+        }
     }
 
-    void Stream::sendTextData(uint64_t timestamp, const amf::Node& textData)
+    void Stream::forwardTextData(uint64_t timestamp, const amf::Node& textData)
     {
         for (Connection* outputConnection : outputConnections)
         {
@@ -262,11 +848,21 @@ namespace relay
                 outputConnection->sendTextData(timestamp, textData);
             }
         }
+
+        for (Stream* follower : followers)
+        {
+            follower->forwardTextData(timestamp, textData);
+        }
     }
 
     void Stream::getConnections(std::map<Connection*, Stream*>& cons)
     {
-        if (inputConnection) cons[inputConnection] = this;
+        if (inputConnection && !leader) cons[inputConnection] = this;
+
+        for (const BackupInput& backupInput : backupInputs)
+        {
+            cons[backupInput.connection] = this;
+        }
 
         for (const auto& c : outputConnections)
         {
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <map>
 #include <string>
 #include <vector>
 #include "Amf.hpp"
@@ -16,6 +17,7 @@ namespace relay
     class Relay;
     class Server;
     class Connection;
+    struct Endpoint;
 
     class Stream
     {
@@ -41,16 +43,35 @@ namespace relay
         void start(Connection& connection);
         void stop(Connection& connection);
 
+        void addEndpoint(const Endpoint& endpoint);
+        void removeEndpoint(const Endpoint& endpoint);
+
         Connection* getInputConnection() const { return inputConnection; }
 
-        void sendAudioHeader(const std::vector<uint8_t>& headerData);
-        void sendVideoHeader(const std::vector<uint8_t>& headerData);
-        void sendAudioFrame(uint64_t timestamp, const std::vector<uint8_t>& audioData);
-        void sendVideoFrame(uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType);
-        void sendMetaData(const amf::Node& newMetaData);
-        void sendTextData(uint64_t timestamp, const amf::Node& textData);
+        // followers are streams of other servers that get their media from this stream's input
+        void addFollower(Stream& follower);
+        Stream* getLeader() const { return leader; }
+        // stops following and leaves the shared input to the leader
+        void unfollow();
+
+        // a second input can wait as a standby if its endpoint allows backup inputs
+        bool canAddBackupInput(const Connection& connection) const;
+
+        // media of the input connections, only the active input is forwarded
+        void sendAudioHeader(Connection& source, const std::vector<uint8_t>& headerData);
+        void sendVideoHeader(Connection& source, const std::vector<uint8_t>& headerData);
+        void sendAudioFrame(Connection& source, uint64_t timestamp, const std::vector<uint8_t>& audioData);
+        void sendVideoFrame(Connection& source, uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType);
+        void sendMetaData(Connection& source, const amf::Node& newMetaData);
+        void sendTextData(Connection& source, uint64_t timestamp, const amf::Node& textData);
+
+        void update(float delta);
 
         bool hasDependableConnections();
+        // true if a host connection uses the stream or one of its followers
+        bool hasHostConnections() const;
+        // true if the stream has outputs and all of them (including the followers') queue at least the limit
+        bool isSaturated(size_t limit) const;
         void close();
         bool isClosed() { return closed; }
         uint64_t getId() { return id; }
@@ -66,8 +87,29 @@ namespace relay
         std::string applicationName;
         std::string streamName;
 
+        // standby input, its headers are kept so that it can take over at any keyframe
+        struct BackupInput
+        {
+            Connection* connection = nullptr;
+            std::vector<uint8_t> audioHeader;
+            std::vector<uint8_t> videoHeader;
+            amf::Node metaData;
+            float idleTime = 0.0f;
+        };
+
         Connection* inputConnection = nullptr;
         bool inputConnectionCreated = false;
+        std::vector<BackupInput> backupInputs;
+        // the active input was replaced, nothing is forwarded until its first keyframe (or its first
+        // frame if it has no video or no keyframe arrived within the stall timeout)
+        bool switchingInput = false;
+        float switchTime = 0.0f;
+        float inputIdleTime = 0.0f;
+        // added to the timestamps of the active input so that the outputs see no jump after a switch
+        int64_t timestampOffset = 0;
+        uint64_t lastTimestamp = 0;
+        uint64_t lastVideoTimestamp = 0;
+        uint64_t videoInterval = 0;
         std::vector<Connection*> outputConnections;
 
         bool streaming = false;
@@ -75,6 +117,40 @@ namespace relay
         std::vector<uint8_t> videoHeader;
         amf::Node metaData;
 
+        // meta data filtered and encoded once per meta data profile of the outputs
+        struct EncodedMetaData
+        {
+            amf::Node metaData;
+            std::vector<uint8_t> data;
+        };
+        std::map<std::string, EncodedMetaData> encodedMetaData;
+
         std::vector<Connection*> connections;
+
+        Stream* leader = nullptr;
+        std::vector<Stream*> followers;
+
+        // pulled input kept after the last viewer left
+        bool lingering = false;
+        float lingerRemaining = 0.0f;
+
+        void releaseFollowers();
+        bool startLinger();
+
+        BackupInput* findBackupInput(const Connection& connection);
+        bool removeBackupInput(const Connection& connection);
+        void switchInput(size_t backupIndex);
+        bool canFinishSwitch(bool keyFrame) const;
+        void finishSwitch(uint64_t timestamp);
+        uint64_t rebaseTimestamp(uint64_t timestamp);
+        void setMetaData(const amf::Node& newMetaData);
+        void sendEncodedMetaData(Connection& connection);
+
+        void forwardAudioHeader(const std::vector<uint8_t>& headerData);
+        void forwardVideoHeader(const std::vector<uint8_t>& headerData);
+        void forwardAudioFrame(uint64_t timestamp, const std::vector<uint8_t>& audioData);
+        void forwardVideoFrame(uint64_t timestamp, const std::vector<uint8_t>& videoData, VideoFrameType frameType);
+        void forwardMetaData(const amf::Node& newMetaData);
+        void forwardTextData(uint64_t timestamp, const amf::Node& textData);
     };
 }
@@ -5,9 +5,13 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <map>
+#ifdef _MSC_VER
+#  include <stdlib.h>
+#endif
 
 union IntFloat64
 {
@@ -15,92 +19,344 @@ union IntFloat64
     double   f;
 };
 
-template <class T>
-inline uint32_t decodeIntBE(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, T& result)
+// byte order of the fixed width integers, loads and stores go through memcpy so that
+// the data doesn't have to be aligned
+inline uint8_t swapBytes(uint8_t value)
+{
+    return value;
+}
+
+inline uint16_t swapBytes(uint16_t value)
+{
+#if defined(_MSC_VER)
+    return _byteswap_ushort(value);
+#elif defined(__GNUC__)
+    return __builtin_bswap16(value);
+#else
+    return static_cast<uint16_t>((value << 8) | (value >> 8));
+#endif
+}
+
+inline uint32_t swapBytes(uint32_t value)
+{
+#if defined(_MSC_VER)
+    return _byteswap_ulong(value);
+#elif defined(__GNUC__)
+    return __builtin_bswap32(value);
+#else
+    return ((value & 0x000000FF) << 24) | ((value & 0x0000FF00) << 8) |
+        ((value & 0x00FF0000) >> 8) | ((value & 0xFF000000) >> 24);
+#endif
+}
+
+inline uint64_t swapBytes(uint64_t value)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(value);
+#elif defined(__GNUC__)
+    return __builtin_bswap64(value);
+#else
+    return (static_cast<uint64_t>(swapBytes(static_cast<uint32_t>(value))) << 32) |
+        swapBytes(static_cast<uint32_t>(value >> 32));
+#endif
+}
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+template <class T> inline T toBigEndian(T value) { return swapBytes(value); }
+template <class T> inline T toLittleEndian(T value) { return value; }
+#else
+template <class T> inline T toBigEndian(T value) { return value; }
+template <class T> inline T toLittleEndian(T value) { return swapBytes(value); }
+#endif
+
+// unsigned type that holds SIZE bytes
+template <uint32_t SIZE> struct UIntType;
+template <> struct UIntType<1> { typedef uint8_t Type; };
+template <> struct UIntType<2> { typedef uint16_t Type; };
+template <> struct UIntType<3> { typedef uint32_t Type; };
+template <> struct UIntType<4> { typedef uint32_t Type; };
+template <> struct UIntType<8> { typedef uint64_t Type; };
+
+template <uint32_t SIZE>
+inline typename UIntType<SIZE>::Type loadBE(const uint8_t* data)
+{
+    typename UIntType<SIZE>::Type value;
+    memcpy(&value, data, sizeof(value));
+    return toBigEndian(value);
+}
+
+template <>
+inline uint32_t loadBE<3>(const uint8_t* data)
+{
+    return (static_cast<uint32_t>(loadBE<2>(data)) << 8) | data[2];
+}
+
+template <uint32_t SIZE>
+inline typename UIntType<SIZE>::Type loadLE(const uint8_t* data)
+{
+    typename UIntType<SIZE>::Type value;
+    memcpy(&value, data, sizeof(value));
+    return toLittleEndian(value);
+}
+
+template <>
+inline uint32_t loadLE<3>(const uint8_t* data)
+{
+    return loadLE<2>(data) | (static_cast<uint32_t>(data[2]) << 16);
+}
+
+template <uint32_t SIZE>
+inline void storeBE(uint8_t* data, typename UIntType<SIZE>::Type value)
+{
+    value = toBigEndian(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+template <>
+inline void storeBE<3>(uint8_t* data, uint32_t value)
+{
+    storeBE<2>(data, static_cast<uint16_t>(value >> 8));
+    data[2] = static_cast<uint8_t>(value);
+}
+
+template <uint32_t SIZE>
+inline void storeLE(uint8_t* data, typename UIntType<SIZE>::Type value)
 {
-    if (buffer.size() - offset < size)
+    value = toLittleEndian(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+template <>
+inline void storeLE<3>(uint8_t* data, uint32_t value)
+{
+    storeLE<2>(data, static_cast<uint16_t>(value));
+    data[2] = static_cast<uint8_t>(value >> 16);
+}
+
+inline double loadDoubleBE(const uint8_t* data)
+{
+    IntFloat64 intFloat64;
+    intFloat64.i = loadBE<8>(data);
+    return intFloat64.f;
+}
+
+inline void storeDoubleBE(uint8_t* data, double value)
+{
+    IntFloat64 intFloat64;
+    intFloat64.f = value;
+    storeBE<8>(data, intFloat64.i);
+}
+
+// reads fixed width values from memory it doesn't own, every read fails without moving
+// the offset if there is not enough data left
+class ByteReader
+{
+public:
+    ByteReader(const uint8_t* aData, size_t aSize, size_t aOffset = 0):
+        data(aData), size(aSize), offset(aOffset)
     {
-        return 0;
     }
 
-    result = 0;
+    ByteReader(const std::vector<uint8_t>& buffer, size_t aOffset = 0):
+        data(buffer.data()), size(buffer.size()), offset(aOffset)
+    {
+    }
+
+    size_t getOffset() const { return offset; }
+    size_t getRemaining() const { return (offset < size) ? size - offset : 0; }
 
-    for (uint32_t i = 0; i < size; ++i)
+    template <uint32_t SIZE, class T>
+    bool readBE(T& result)
     {
-        result += static_cast<T>(*(buffer.data() + offset)) << 8 * (size - i - 1);
-        offset += 1;
+        if (getRemaining() < SIZE) return false;
+
+        result = static_cast<T>(loadBE<SIZE>(data + offset));
+        offset += SIZE;
+
+        return true;
     }
 
-    return size;
-}
+    template <uint32_t SIZE, class T>
+    bool readLE(T& result)
+    {
+        if (getRemaining() < SIZE) return false;
 
-template <>
-inline uint32_t decodeIntBE<uint8_t>(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, uint8_t& result)
+        result = static_cast<T>(loadLE<SIZE>(data + offset));
+        offset += SIZE;
+
+        return true;
+    }
+
+    bool readDouble(double& result)
+    {
+        if (getRemaining() < sizeof(double)) return false;
+
+        result = loadDoubleBE(data + offset);
+        offset += sizeof(double);
+
+        return true;
+    }
+
+    // points into the data instead of copying it
+    bool readBytes(size_t length, const uint8_t*& result)
+    {
+        if (getRemaining() < length) return false;
+
+        result = data + offset;
+        offset += length;
+
+        return true;
+    }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+};
+
+// writes to the end of a vector through a cursor, the space for all the writes is
+// reserved up front and the unused part is removed when the writer is destroyed
+class ByteWriter
 {
-    if (buffer.size() - offset < size)
+public:
+    ByteWriter(std::vector<uint8_t>& aBuffer, size_t capacity):
+        buffer(aBuffer), start(aBuffer.size())
     {
-        return 0;
+        buffer.resize(start + capacity);
+        cursor = buffer.data() + start;
+        end = buffer.data() + buffer.size();
     }
 
-    result = static_cast<uint8_t>(*(buffer.data() + offset));
-    offset += 1;
+    ~ByteWriter()
+    {
+        buffer.resize(getSize());
+    }
 
-    return size;
-}
+    ByteWriter(const ByteWriter&) = delete;
+    ByteWriter& operator=(const ByteWriter&) = delete;
+
+    // size of the buffer with the written bytes
+    size_t getSize() const { return static_cast<size_t>(cursor - buffer.data()); }
+    size_t getWritten() const { return getSize() - start; }
 
+    template <uint32_t SIZE, class T>
+    bool writeBE(T value)
+    {
+        if (static_cast<size_t>(end - cursor) < SIZE) return false;
+
+        storeBE<SIZE>(cursor, static_cast<typename UIntType<SIZE>::Type>(value));
+        cursor += SIZE;
+
+        return true;
+    }
+
+    template <uint32_t SIZE, class T>
+    bool writeLE(T value)
+    {
+        if (static_cast<size_t>(end - cursor) < SIZE) return false;
+
+        storeLE<SIZE>(cursor, static_cast<typename UIntType<SIZE>::Type>(value));
+        cursor += SIZE;
+
+        return true;
+    }
+
+    bool writeDouble(double value)
+    {
+        if (static_cast<size_t>(end - cursor) < sizeof(double)) return false;
+
+        storeDoubleBE(cursor, value);
+        cursor += sizeof(double);
+
+        return true;
+    }
+
+    bool writeBytes(const void* data, size_t length)
+    {
+        if (static_cast<size_t>(end - cursor) < length) return false;
+
+        memcpy(cursor, data, length);
+        cursor += length;
+
+        return true;
+    }
+
+private:
+    std::vector<uint8_t>& buffer;
+    size_t start;
+    uint8_t* cursor;
+    uint8_t* end;
+};
+
+// vector based helpers, they return the number of bytes read or written (0 on failure)
 template <class T>
-inline uint32_t decodeIntLE(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, T& result)
+inline uint32_t decodeIntBE(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, T& result)
 {
-    if (buffer.size() - offset < size)
+    if (offset > buffer.size() || buffer.size() - offset < size)
     {
         return 0;
     }
 
-    result = 0;
+    const uint8_t* data = buffer.data() + offset;
 
-    for (uint32_t i = 0; i < size; ++i)
+    switch (size)
     {
-        result += static_cast<T>(*(buffer.data() + offset)) << 8 * i;
-        offset += 1;
+        case 1: result = static_cast<T>(loadBE<1>(data)); break;
+        case 2: result = static_cast<T>(loadBE<2>(data)); break;
+        case 3: result = static_cast<T>(loadBE<3>(data)); break;
+        case 4: result = static_cast<T>(loadBE<4>(data)); break;
+        case 8: result = static_cast<T>(loadBE<8>(data)); break;
+        default:
+            result = 0;
+
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                result += static_cast<T>(data[i]) << 8 * (size - i - 1);
+            }
+            break;
     }
 
     return size;
 }
 
-template <>
-inline uint32_t decodeIntLE<uint8_t>(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, uint8_t& result)
+template <class T>
+inline uint32_t decodeIntLE(const std::vector<uint8_t>& buffer, uint32_t offset, uint32_t size, T& result)
 {
-    if (buffer.size() - offset < size)
+    if (offset > buffer.size() || buffer.size() - offset < size)
     {
         return 0;
     }
 
-    result = *(buffer.data() + offset);
-    offset += 1;
-    
+    const uint8_t* data = buffer.data() + offset;
+
+    switch (size)
+    {
+        case 1: result = static_cast<T>(loadLE<1>(data)); break;
+        case 2: result = static_cast<T>(loadLE<2>(data)); break;
+        case 3: result = static_cast<T>(loadLE<3>(data)); break;
+        case 4: result = static_cast<T>(loadLE<4>(data)); break;
+        case 8: result = static_cast<T>(loadLE<8>(data)); break;
+        default:
+            result = 0;
+
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                result += static_cast<T>(data[i]) << 8 * i;
+            }
+            break;
+    }
+
     return size;
 }
 
 inline uint32_t decodeDouble(const std::vector<uint8_t>& buffer, uint32_t offset, double& result)
 {
-    if (buffer.size() - offset < 8)
+    if (offset > buffer.size() || buffer.size() - offset < sizeof(double))
     {
         return 0;
     }
 
-    uint64_t value = 0;
-
-    for (uint32_t i = 0; i < sizeof(double); ++i)
-    {
-        value <<= 8;
-        value += *(buffer.data() + offset);
-        offset += 1;
-    }
-
-    IntFloat64 intFloat64;
-    intFloat64.i = value;
-
-    result = intFloat64.f;
+    result = loadDoubleBE(buffer.data() + offset);
 
     return sizeof(double);
 }
@@ -113,6 +369,11 @@ inline uint32_t decodeU29(const std::vector<uint8_t>& buffer, uint32_t offset, u
 
     for (uint32_t i = 0; i < 4; ++i)
     {
+        if (offset >= buffer.size())
+        {
+            return 0;
+        }
+
         uint8_t b = *(buffer.data() + offset);
 
         if (i == 3)
@@ -137,36 +398,62 @@ inline uint32_t decodeU29(const std::vector<uint8_t>& buffer, uint32_t offset, u
 template <class T>
 inline uint32_t encodeIntBE(std::vector<uint8_t>& buffer, uint32_t size, T value)
 {
-    for (uint32_t i = 0; i < size; ++i)
+    if (size > sizeof(uint64_t)) return 0;
+
+    uint8_t data[sizeof(uint64_t)];
+
+    switch (size)
     {
-        buffer.push_back(static_cast<uint8_t>(value >> 8 * (size - i - 1)));
+        case 1: storeBE<1>(data, static_cast<uint8_t>(value)); break;
+        case 2: storeBE<2>(data, static_cast<uint16_t>(value)); break;
+        case 3: storeBE<3>(data, static_cast<uint32_t>(value)); break;
+        case 4: storeBE<4>(data, static_cast<uint32_t>(value)); break;
+        case 8: storeBE<8>(data, static_cast<uint64_t>(value)); break;
+        default:
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                data[i] = static_cast<uint8_t>(static_cast<uint64_t>(value) >> 8 * (size - i - 1));
+            }
+            break;
     }
 
+    buffer.insert(buffer.end(), data, data + size);
+
     return size;
 }
 
 template <class T>
 inline uint32_t encodeIntLE(std::vector<uint8_t>& buffer, uint32_t size, T value)
 {
-    for (uint32_t i = 0; i < size; ++i)
+    if (size > sizeof(uint64_t)) return 0;
+
+    uint8_t data[sizeof(uint64_t)];
+
+    switch (size)
     {
-        buffer.push_back(static_cast<uint8_t>(value >> 8 * i));
+        case 1: storeLE<1>(data, static_cast<uint8_t>(value)); break;
+        case 2: storeLE<2>(data, static_cast<uint16_t>(value)); break;
+        case 3: storeLE<3>(data, static_cast<uint32_t>(value)); break;
+        case 4: storeLE<4>(data, static_cast<uint32_t>(value)); break;
+        case 8: storeLE<8>(data, static_cast<uint64_t>(value)); break;
+        default:
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                data[i] = static_cast<uint8_t>(static_cast<uint64_t>(value) >> 8 * i);
+            }
+            break;
     }
 
+    buffer.insert(buffer.end(), data, data + size);
+
     return size;
 }
 
 inline uint32_t encodeDouble(std::vector<uint8_t>& buffer, double value)
 {
-    IntFloat64 intFloat64;
-    intFloat64.f = value;
-
-    uint64_t data = intFloat64.i;
-
-    for (uint32_t i = 0; i < sizeof(double); ++i)
-    {
-        buffer.push_back(static_cast<uint8_t>(data >> 8 * (sizeof(value) - i - 1)));
-    }
+    uint8_t data[sizeof(double)];
+    storeDoubleBE(data, value);
+    buffer.insert(buffer.end(), data, data + sizeof(double));
 
     return sizeof(double);
 }
@@ -13,6 +13,7 @@
 #include <fcntl.h>
 
 #include "Constants.hpp"
+#include "HandOff.hpp"
 #include "Relay.hpp"
 #include "Log.hpp"
 #include "Version.hpp"
@@ -24,38 +25,36 @@ Network network;
 Relay rel(network);
 
 #ifndef _WIN32
+static const char* HANDOFF_SOCKET = "/var/run/rtmp_relay.sock";
+HandOff handOff(HANDOFF_SOCKET);
+
 static void signalHandler(int signo)
 {
     switch(signo)
     {
         case SIGHUP:
-            // rehash the server
-            if (!rel.init(config))
-            {
-                Log(Log::Level::ERR) << "Failed to reload config";
-                exit(EXIT_FAILURE);
-            }
+            // rehash the server, the reload itself is done in the main loop
+            rel.requestReload();
             break;
         case SIGTERM:
-            // shutdown the server
-            rel.close();
-            rel.closeLog();
-            exit(EXIT_SUCCESS);
+            // shutdown the server in the main loop
+            rel.requestStop();
             break;
         case SIGUSR1:
-        {
-            std::string str;
-            rel.getStats(str, ReportType::TEXT);
-            Log(Log::Level::INFO) << str;
+            // the stats are logged in the main loop
+            rel.requestStats();
+            break;
+        case SIGUSR2:
+            // hot restart, pass the listening sockets to the new process in the main loop
+            rel.requestHandOff();
             break;
-        }
         case SIGPIPE:
-            Log(Log::Level::ERR) << "Received SIGPIPE";
+            rel.reportBrokenPipe();
             break;
     }
 }
 
-static bool daemonize(const char* lock_file)
+static bool daemonize(const char* lock_file, pid_t previousPid)
 {
     pid_t pid = fork();
 
@@ -98,9 +97,32 @@ static bool daemonize(const char* lock_file)
         return false;
     }
 
-    if (lockf(lfp, F_TLOCK, 0) == -1)
+    // the running daemon releases the lock after it gets SIGUSR2
+    if (previousPid > 0)
+    {
+        if (!handOff.listen()) return false;
+
+        if (kill(previousPid, SIGUSR2) != 0)
+        {
+            Log(Log::Level::ERR) << "Failed to send SIGUSR2 to the running daemon";
+            return false;
+        }
+    }
+
+    for (int attempt = 0; lockf(lfp, F_TLOCK, 0) == -1; ++attempt)
+    {
+        if (previousPid <= 0 || attempt >= 100)
+        {
+            Log(Log::Level::ERR) << "Failed to lock the file";
+            return false;
+        }
+
+        usleep(100000);
+    }
+
+    if (ftruncate(lfp, 0) == -1)
     {
-        Log(Log::Level::ERR) << "Failed to lock the file";
+        Log(Log::Level::ERR) << "Failed to truncate lock file";
         return false;
     }
 
@@ -113,6 +135,8 @@ static bool daemonize(const char* lock_file)
         return false;
     }
 
+    rel.setHandOffPath(HANDOFF_SOCKET, lfp);
+
     // ignore child terminate signal
     if (std::signal(SIGCHLD, SIG_IGN) == SIG_ERR)
     {
@@ -127,6 +151,13 @@ static bool daemonize(const char* lock_file)
         return false;
     }
 
+    // hot restart request from a new process
+    if (std::signal(SIGUSR2, signalHandler) == SIG_ERR)
+    {
+        Log(Log::Level::ERR) << "Failed to capure SIGUSR2";
+        return false;
+    }
+
     Log(Log::Level::INFO) << "Daemon started, pid: " << getpid();
 
     return true;
@@ -160,6 +191,7 @@ static int getPid(const char* lockFile)
 int main(int argc, const char* argv[])
 {
     bool daemon = false;
+    bool hotRestart = false;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -194,6 +226,11 @@ int main(int argc, const char* argv[])
         {
             daemon = true;
         }
+        else if (std::string(argv[i]) == "--hot-restart")
+        {
+            daemon = true;
+            hotRestart = true;
+        }
         else if (std::string(argv[i]) == "--kill-daemon")
         {
 #ifndef _WIN32
@@ -227,7 +264,7 @@ int main(int argc, const char* argv[])
         else if (std::string(argv[i]) == "--help")
         {
             const char* exe = argc >= 1 ? argv[0] : "rtmp_relay";
-            Log(Log::Level::INFO) << "Usage: " << exe << " --config <path to config file> [--daemon] [--kill-daemon] [--log <level>]";
+            Log(Log::Level::INFO) << "Usage: " << exe << " --config <path to config file> [--daemon] [--hot-restart] [--kill-daemon] [--log <level>]";
             return EXIT_SUCCESS;
         }
         else if (std::string(argv[i]) == "--version")
@@ -246,7 +283,28 @@ int main(int argc, const char* argv[])
     if (daemon)
     {
 #ifndef _WIN32
-        if (!daemonize("/var/run/rtmp_relay.pid")) return EXIT_FAILURE;
+        pid_t previousPid = 0;
+
+        if (hotRestart && !(previousPid = getPid("/var/run/rtmp_relay.pid")))
+        {
+            Log(Log::Level::ERR) << "Failed to get the pid of the daemon";
+            return EXIT_FAILURE;
+        }
+
+        if (!daemonize("/var/run/rtmp_relay.pid", previousPid)) return EXIT_FAILURE;
+
+        if (hotRestart)
+        {
+            std::map<std::string, socket_t> sockets;
+
+            if (!handOff.receive(10.0f, sockets))
+            {
+                Log(Log::Level::ERR) << "Failed to take over the sockets of the running daemon";
+                return EXIT_FAILURE;
+            }
+
+            rel.inheritAcceptors(sockets);
+        }
 #else
         Log(Log::Level::ERR) << "Daemon is not supported on Windows";
         return EXIT_FAILURE;
@@ -274,6 +332,9 @@ int main(int argc, const char* argv[])
     }
 #endif
 
+    // after daemonizing, the thread would not survive the fork
+    Log::startThread();
+
     if (!rel.init(config))
     {
         Log(Log::Level::ERR) << "-----------------  RTMP Relay " << VERSION << " -----------------";